@@ -1459,7 +1459,7 @@ qsf_object_commitCB (gpointer key, gpointer value, gpointer data)
 		cm_kvp = kvp_frame_set_value (cm_kvp, (gchar *) xmlGetProp (node,
 				BAD_CAST QSF_OBJECT_KVP), cm_value);
 		qof_util_param_commit ((QofInstance *) qsf_ent, cm_param);
-		g_free (cm_value);
+		kvp_value_delete (cm_value);
 	}
 	if (safe_strcmp (qof_type, QOF_TYPE_COLLECT) == 0)
 	{
@@ -0,0 +1,38 @@
+/********************************************************************
+ * guid-p.h -- private interface to the GUID encoding               *
+ *                                                                  *
+ * This program is free software; you can redistribute it and/or    *
+ * modify it under the terms of the GNU General Public License as   *
+ * published by the Free Software Foundation; either version 2 of   *
+ * the License, or (at your option) any later version.              *
+ *                                                                  *
+ * This program is distributed in the hope that it will be useful,  *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of   *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the    *
+ * GNU General Public License for more details.                     *
+ *                                                                  *
+ * You should have received a copy of the GNU General Public License*
+ * along with this program; if not, contact:                        *
+ *                                                                  *
+ * Free Software Foundation           Voice:  +1-617-542-5942       *
+ * 51 Franklin Street, Fifth Floor    Fax:    +1-617-542-2652       *
+ * Boston, MA  02110-1301,  USA       gnu@gnu.org                   *
+ *                                                                  *
+ ********************************************************************/
+
+#ifndef QOF_GUID_P_H
+#define QOF_GUID_P_H
+
+#include "guid.h"
+
+/* The portable hex encoding of the GUID data, 32 chars and no null.
+ * guid_to_string_buff uses SSE2 instead where the compiler has it,
+ * and the two must give the same chars. */
+void guid_encode_scalar (const unsigned char *data, char *buffer);
+
+/* The portable decoding of 32 hex chars into the GUID data, FALSE if
+ * any of them is not a hex digit.  data may be part written then. */
+gboolean guid_decode_scalar (const unsigned char *string,
+	unsigned char *data);
+
+#endif
@@ -28,6 +28,8 @@
 #endif
 #include <ctype.h>
 #include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
 #include <glib.h>
 #include <stdlib.h>
 #include <stdio.h>
@@ -38,7 +40,14 @@
 #endif
 #include <time.h>
 #include <unistd.h>
+#ifdef __SSE2__
+# include <emmintrin.h>
+#endif
+#ifdef HAVE_SYS_RANDOM_H
+# include <sys/random.h>
+#endif
 #include "qof.h"
+#include "guid-p.h"
 #include "md5.h"
 
 # ifndef P_tmpdir
@@ -54,6 +63,19 @@
 /* Static global variables *****************************************/
 static gboolean guid_initialized = FALSE;
 static struct md5_ctx guid_context;
+static GuidSource guid_source = GUID_SOURCE_MD5;
+static gint urandom_fd = -1;
+
+/* GUID_SOURCE_RANDOM ids are cut from a buffer of random bytes that
+ * each thread fills with one call to the system. */
+#define GUID_BATCH 256
+
+typedef struct
+{
+	guchar data[GUID_BATCH * GUID_DATA_SIZE];
+	guint next;					/* ids already handed out */
+	pid_t pid;					/* a forked child must not reuse them */
+} GuidBatch;
 
 /* This static indicates the debugging module that this .o belongs to.  */
 static QofLogModule log_module = QOF_MOD_ENGINE;
@@ -289,6 +311,7 @@ guid_init (void)
 	/* Not needed; taken care of on first malloc.
 	 * guid_memchunk_init(); */
 
+	guid_source = GUID_SOURCE_MD5;
 	md5_init_ctx (&guid_context);
 
 	/* entropy pool */
@@ -426,6 +449,7 @@ guid_init_with_salt (const void *salt, size_t salt_len)
 void
 guid_init_only_salt (const void *salt, size_t salt_len)
 {
+	guid_source = GUID_SOURCE_MD5;
 	md5_init_ctx (&guid_context);
 
 	md5_process_bytes (salt, salt_len, &guid_context);
@@ -433,9 +457,132 @@ guid_init_only_salt (const void *salt, size_t salt_len)
 	guid_initialized = TRUE;
 }
 
+/* Fill buf from the random number generator of the system. */
+static gboolean
+random_bytes (guchar * buf, size_t len)
+{
+	ssize_t n;
+
+#ifdef HAVE_GETRANDOM
+	if (urandom_fd < 0)
+	{
+		while (len > 0)
+		{
+			n = getrandom (buf, len, 0);
+			if (n < 0)
+			{
+				if (errno == EINTR)
+					continue;
+				return FALSE;
+			}
+			buf += n;
+			len -= n;
+		}
+		return TRUE;
+	}
+#endif
+	while (len > 0)
+	{
+		n = read (urandom_fd, buf, len);
+		if (n <= 0)
+		{
+			if (n < 0 && errno == EINTR)
+				continue;
+			return FALSE;
+		}
+		buf += n;
+		len -= n;
+	}
+	return TRUE;
+}
+
+void
+guid_init_with_source (GuidSource source)
+{
+	guchar probe[GUID_DATA_SIZE];
+
+	guid_init ();
+	if (source != GUID_SOURCE_RANDOM)
+		return;
+
+	if (urandom_fd >= 0)
+		close (urandom_fd);
+	urandom_fd = -1;
+#ifdef HAVE_GETRANDOM
+	if (random_bytes (probe, sizeof (probe)))
+	{
+		guid_source = GUID_SOURCE_RANDOM;
+		return;
+	}
+#endif
+	urandom_fd = open ("/dev/urandom", O_RDONLY);
+	if (urandom_fd >= 0 && random_bytes (probe, sizeof (probe)))
+	{
+		guid_source = GUID_SOURCE_RANDOM;
+		return;
+	}
+	PWARN ("no system random number generator, using md5 ids");
+	if (urandom_fd >= 0)
+		close (urandom_fd);
+	urandom_fd = -1;
+}
+
 void
 guid_shutdown (void)
 {
+	if (urandom_fd >= 0)
+		close (urandom_fd);
+	urandom_fd = -1;
+	guid_source = GUID_SOURCE_MD5;
+}
+
+static gboolean
+guid_new_random (GUID * guid)
+{
+#ifdef G_THREADS_ENABLED
+#if GLIB_CHECK_VERSION(2,32,0)
+	static GPrivate guid_batch_key = G_PRIVATE_INIT (g_free);
+#else
+	static GStaticPrivate guid_batch_key = G_STATIC_PRIVATE_INIT;
+#endif
+	GuidBatch *batch;
+#if GLIB_CHECK_VERSION(2,32,0)
+	batch = g_private_get (&guid_batch_key);
+#else
+	batch = g_static_private_get (&guid_batch_key);
+#endif
+	if (batch == NULL)
+	{
+		batch = g_new0 (GuidBatch, 1);
+		batch->next = GUID_BATCH;
+#if GLIB_CHECK_VERSION(2,32,0)
+		g_private_set (&guid_batch_key, batch);
+#else
+		g_static_private_set (&guid_batch_key, batch, g_free);
+#endif
+	}
+#else
+	static GuidBatch the_batch = { {0}, GUID_BATCH, 0 };
+	GuidBatch *batch = &the_batch;
+#endif
+	guchar *data;
+
+	if (batch->next == GUID_BATCH || batch->pid != getpid ())
+	{
+		if (!random_bytes (batch->data, sizeof (batch->data)))
+			return FALSE;
+		batch->next = 0;
+		batch->pid = getpid ();
+	}
+	data = batch->data + batch->next++ * GUID_DATA_SIZE;
+	memcpy (guid->data, data, GUID_DATA_SIZE);
+	/* don't leave a copy behind */
+	memset (data, 0, GUID_DATA_SIZE);
+
+	/* RFC 4122: version 4 (random), variant 1 */
+	guid->data[6] = (guid->data[6] & 0x0F) | 0x40;
+	guid->data[8] = (guid->data[8] & 0x3F) | 0x80;
+	return TRUE;
 }
 
 #define GUID_PERIOD 5000
@@ -449,6 +596,14 @@ guid_new (GUID * guid)
 	if (guid == NULL)
 		return;
 
+	if (guid_source == GUID_SOURCE_RANDOM)
+	{
+		if (guid_new_random (guid))
+			return;
+		PERR ("system random number generator failed, using md5 ids");
+		guid_source = GUID_SOURCE_MD5;
+	}
+
 	if (!guid_initialized)
 		guid_init ();
 
@@ -501,14 +656,137 @@ guid_new_return (void)
 	return guid;
 }
 
+static const gchar hex_digits[] = "0123456789abcdef";
+
+/* value of each hex digit, -1 for anything else */
+static const gint8 hex_values[256] = {
+	-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+	-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+	-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+	 0,  1,  2,  3,  4,  5,  6,  7,  8,  9, -1, -1, -1, -1, -1, -1,
+	-1, 10, 11, 12, 13, 14, 15, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+	-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+	-1, 10, 11, 12, 13, 14, 15, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+	-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+	-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+	-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+	-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+	-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+	-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+	-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+	-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+	-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1
+};
+
 /* needs 32 bytes exactly, doesn't print a null char */
-static void
-encode_md5_data (const unsigned char *data, char *buffer)
+void
+guid_encode_scalar (const unsigned char *data, char *buffer)
 {
 	size_t count;
 
-	for (count = 0; count < GUID_DATA_SIZE; count++, buffer += 2)
-		sprintf (buffer, "%02x", data[count]);
+	for (count = 0; count < GUID_DATA_SIZE; count++)
+	{
+		*buffer++ = hex_digits[data[count] >> 4];
+		*buffer++ = hex_digits[data[count] & 0x0f];
+	}
+}
+
+/* returns true if the first 32 bytes of string are hex digits,
+ * decoded into data.  data is left part written otherwise. */
+gboolean
+guid_decode_scalar (const unsigned char *string, unsigned char *data)
+{
+	size_t count;
+
+	for (count = 0; count < GUID_DATA_SIZE; count++)
+	{
+		gint8 n1, n2;
+
+		/* a null char, i.e. a short string, is not a hex digit */
+		n1 = hex_values[string[2 * count]];
+		if (n1 < 0)
+			return FALSE;
+		n2 = hex_values[string[2 * count + 1]];
+		if (n2 < 0)
+			return FALSE;
+		data[count] = (n1 << 4) | n2;
+	}
+	return TRUE;
+}
+
+#ifdef __SSE2__
+static void
+encode_sse2 (const unsigned char *data, char *buffer)
+{
+	const __m128i mask = _mm_set1_epi8 (0x0f);
+	const __m128i nine = _mm_set1_epi8 (9);
+	const __m128i zero = _mm_set1_epi8 ('0');
+	const __m128i gap = _mm_set1_epi8 ('a' - '0' - 10);
+	__m128i in, hi, lo;
+
+	in = _mm_loadu_si128 ((const __m128i *) data);
+	hi = _mm_and_si128 (_mm_srli_epi16 (in, 4), mask);
+	lo = _mm_and_si128 (in, mask);
+	hi = _mm_add_epi8 (_mm_add_epi8 (hi, zero),
+		_mm_and_si128 (_mm_cmpgt_epi8 (hi, nine), gap));
+	lo = _mm_add_epi8 (_mm_add_epi8 (lo, zero),
+		_mm_and_si128 (_mm_cmpgt_epi8 (lo, nine), gap));
+	_mm_storeu_si128 ((__m128i *) buffer, _mm_unpacklo_epi8 (hi, lo));
+	_mm_storeu_si128 ((__m128i *) (buffer + 16), _mm_unpackhi_epi8 (hi, lo));
+}
+
+/* Decode 16 hex digits into 8 bytes, in the low half of the result.
+ * *ok is cleared if any of them is not a hex digit. */
+static inline __m128i
+decode_hex_16 (const unsigned char *string, gboolean * ok)
+{
+	__m128i c, low, digit, alpha, val;
+
+	c = _mm_loadu_si128 ((const __m128i *) string);
+	low = _mm_or_si128 (c, _mm_set1_epi8 (0x20));
+	/* bytes above 0x7f compare as negative and fail both tests */
+	digit = _mm_and_si128 (_mm_cmpgt_epi8 (c, _mm_set1_epi8 ('0' - 1)),
+		_mm_cmplt_epi8 (c, _mm_set1_epi8 ('9' + 1)));
+	alpha = _mm_and_si128 (_mm_cmpgt_epi8 (low, _mm_set1_epi8 ('a' - 1)),
+		_mm_cmplt_epi8 (low, _mm_set1_epi8 ('f' + 1)));
+	if (_mm_movemask_epi8 (_mm_or_si128 (digit, alpha)) != 0xffff)
+		*ok = FALSE;
+	val = _mm_or_si128 (
+		_mm_and_si128 (digit, _mm_sub_epi8 (c, _mm_set1_epi8 ('0'))),
+		_mm_and_si128 (alpha, _mm_sub_epi8 (low, _mm_set1_epi8 ('a' - 10))));
+	/* each 16 bit lane holds the high nibble in its low byte */
+	return _mm_or_si128 (
+		_mm_slli_epi16 (_mm_and_si128 (val, _mm_set1_epi16 (0x00ff)), 4),
+		_mm_srli_epi16 (val, 8));
+}
+
+static gboolean
+decode_sse2 (const unsigned char *string, unsigned char *data)
+{
+	gboolean ok = TRUE;
+	__m128i a, b;
+
+	/* don't read past the end of a short string */
+	if (memchr (string, '\0', GUID_ENCODING_LENGTH))
+		return FALSE;
+	a = decode_hex_16 (string, &ok);
+	b = decode_hex_16 (string + 16, &ok);
+	if (!ok)
+		return FALSE;
+	_mm_storeu_si128 ((__m128i *) data, _mm_packus_epi16 (a, b));
+	return TRUE;
+}
+#endif
+
+/* needs 32 bytes exactly, doesn't print a null char */
+static void
+encode_md5_data (const unsigned char *data, char *buffer)
+{
+#ifdef __SSE2__
+	encode_sse2 (data, buffer);
+#else
+	guid_encode_scalar (data, buffer);
+#endif
 }
 
 /* returns true if the first 32 bytes of buffer encode
@@ -517,42 +795,19 @@ encode_md5_data (const unsigned char *data, char *buffer)
 static gboolean
 decode_md5_string (const unsigned char *string, unsigned char *data)
 {
-	unsigned char n1, n2;
-	size_t count = -1;
-	unsigned char c1, c2;
+	size_t count;
 
 	if (NULL == data)
 		return FALSE;
 	if (NULL == string)
 		goto badstring;
-
-	for (count = 0; count < GUID_DATA_SIZE; count++)
-	{
-		/* check for a short string e.g. null string ... */
-		if ((0 == string[2 * count]) || (0 == string[2 * count + 1]))
-			goto badstring;
-
-		c1 = tolower (string[2 * count]);
-		if (!isxdigit (c1))
-			goto badstring;
-
-		c2 = tolower (string[2 * count + 1]);
-		if (!isxdigit (c2))
-			goto badstring;
-
-		if (isdigit (c1))
-			n1 = c1 - '0';
-		else
-			n1 = c1 - 'a' + 10;
-
-		if (isdigit (c2))
-			n2 = c2 - '0';
-		else
-			n2 = c2 - 'a' + 10;
-
-		data[count] = (n1 << 4) | n2;
-	}
-	return TRUE;
+#ifdef __SSE2__
+	if (decode_sse2 (string, data))
+		return TRUE;
+#else
+	if (guid_decode_scalar (string, data))
+		return TRUE;
+#endif
 
   badstring:
 	for (count = 0; count < GUID_DATA_SIZE; count++)
@@ -568,13 +823,13 @@ const char *
 guid_to_string (const GUID * guid)
 {
 #ifdef G_THREADS_ENABLED
-#ifdef GLIB_DEPRECATED_IN_2_32
+#if GLIB_CHECK_VERSION(2,32,0)
 	static GPrivate guid_buffer_key = G_PRIVATE_INIT (g_free);
 #else
 	static GStaticPrivate guid_buffer_key = G_STATIC_PRIVATE_INIT;
 #endif
 	gchar *string;
-#ifdef GLIB_DEPRECATED_IN_2_32
+#if GLIB_CHECK_VERSION(2,32,0)
 	string = g_private_get (&guid_buffer_key);
 #else
 	string = g_static_private_get (&guid_buffer_key);
@@ -582,7 +837,7 @@ guid_to_string (const GUID * guid)
 	if (string == NULL)
 	{
 		string = malloc (GUID_ENCODING_LENGTH + 1);
-#ifdef GLIB_DEPRECATED_IN_2_32
+#if GLIB_CHECK_VERSION(2,32,0)
 		g_private_set (&guid_buffer_key, string);
 #else
 		g_static_private_set (&guid_buffer_key, string, g_free);
@@ -616,6 +871,36 @@ string_to_guid (const char *string, GUID * guid)
 	return decode_md5_string ((const guchar *)string, (guid != NULL) ? guid->data : NULL);
 }
 
+void
+guids_to_strings (const GUID * guids, gchar * strings, gsize n)
+{
+	gsize i;
+
+	g_return_if_fail (guids || n == 0);
+	g_return_if_fail (strings || n == 0);
+	for (i = 0; i < n; i++)
+	{
+		encode_md5_data (guids[i].data, strings);
+		strings[GUID_ENCODING_LENGTH] = '\0';
+		strings += GUID_ENCODING_LENGTH + 1;
+	}
+}
+
+gsize
+strings_to_guids (const gchar * const *strings, GUID * guids, gsize n)
+{
+	gsize i, good;
+
+	g_return_val_if_fail (strings || n == 0, 0);
+	g_return_val_if_fail (guids || n == 0, 0);
+	for (i = 0, good = 0; i < n; i++)
+	{
+		if (decode_md5_string ((const guchar *) strings[i], guids[i].data))
+			good++;
+	}
+	return good;
+}
+
 gboolean
 guid_equal (const GUID * guid_1, const GUID * guid_2)
 {
@@ -646,7 +931,8 @@ guid_hash_to_guint (gconstpointer ptr)
 {
 	const GUID *guid = ptr;
 	guint hash = 0;
-	unsigned int i, j;
+	guint word;
+	unsigned int i;
 
 	if (!guid)
 	{
@@ -654,13 +940,11 @@ guid_hash_to_guint (gconstpointer ptr)
 		return 0;
 	}
 
-	for (i = 0, j = 0; i < sizeof (guint); i++, j++)
+	/* fold in every byte, not just the first few */
+	for (i = 0; i < GUID_DATA_SIZE; i += sizeof (word))
 	{
-		if (j == GUID_DATA_SIZE)
-			j = 0;
-		
-		hash <<= 4;
-		hash |= guid->data[j];
+		memcpy (&word, guid->data + i, sizeof (word));
+		hash = (hash * 31) ^ word;
 	}
 	
 	return hash;
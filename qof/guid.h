@@ -105,6 +105,29 @@ void guid_init_with_salt (const void *salt, size_t salt_len);
  */
 void guid_init_only_salt (const void *salt, size_t salt_len);
 
+/** Where guid_new() gets the bits of a new id from. */
+typedef enum
+{
+	/** Chained MD5 over a variety of system sources, the default.
+	 *  Not safe to call from several threads at once. */
+	GUID_SOURCE_MD5,
+	/** RFC 4122 version 4 ids, straight from the random number
+	 *  generator of the system (getrandom or /dev/urandom), fetched
+	 *  in batches.  Much faster, and safe to call from several
+	 *  threads at once. */
+	GUID_SOURCE_RANDOM
+} GuidSource;
+
+/** Initialize the id generator as guid_init() does and choose the
+ *  source of new ids.  If the system has no random number generator
+ *  to offer, the generator stays with ::GUID_SOURCE_MD5.
+ *
+ *  @note As with the other initialization functions, calling any of
+ *  them again resets the generator, and the source to
+ *  ::GUID_SOURCE_MD5.
+ */
+void guid_init_with_source (GuidSource source);
+
 /** Release the memory chunk associated with gui storage. Use this
  *  only when shutting down the program, as it invalidates *all*
  *  GUIDs at once. */
@@ -184,6 +207,18 @@ gchar *guid_to_string_buff (const GUID * guid, gchar * buff);
  * undefined. */
 gboolean string_to_guid (const gchar * string, GUID * guid);
 
+/** Encode an array of n guids.  strings must have room for n
+ *  null-terminated encodings, each GUID_ENCODING_LENGTH+1 characters
+ *  long, which are written one after the other. */
+void guids_to_strings (const GUID * guids, gchar * strings, gsize n);
+
+/** Decode an array of n strings, as string_to_guid() does, into
+ *  guids.  An invalid string leaves a guid of all zeros.
+ *
+ *  @return The number of strings that were valid. */
+gsize strings_to_guids (const gchar * const *strings, GUID * guids,
+						gsize n);
+
 
 /** Given two GUIDs, return TRUE if they are non-NULL and equal.
  * Return FALSE, otherwise. */
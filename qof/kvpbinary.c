@@ -0,0 +1,783 @@
+/********************************************************************\
+ * kvpbinary.c -- compact binary encoding of KvpFrame trees         *
+ *                                                                  *
+ * This program is free software; you can redistribute it and/or    *
+ * modify it under the terms of the GNU General Public License as   *
+ * published by the Free Software Foundation; either version 2 of   *
+ * the License, or (at your option) any later version.              *
+ *                                                                  *
+ * This program is distributed in the hope that it will be useful,  *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of   *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the    *
+ * GNU General Public License for more details.                     *
+ *                                                                  *
+ * You should have received a copy of the GNU General Public License*
+ * along with this program; if not, contact:                        *
+ *                                                                  *
+ * Free Software Foundation           Voice:  +1-617-542-5942       *
+ * 51 Franklin Street, Fifth Floor    Fax:    +1-617-542-2652       *
+ * Boston, MA  02110-1301,  USA       gnu@gnu.org                   *
+ *                                                                  *
+\********************************************************************/
+
+/* The encoding is:
+ *
+ *   "QKV" version
+ *   key count, the length in bytes of the keys, then each key as
+ *   length, bytes and a NUL
+ *   the top frame
+ *
+ * A frame is a slot count followed by the slots, each slot being the
+ * number of its key in the key table and then its value.  A value is
+ * a type byte and the length of what follows, so that a reader can
+ * step over values it does not want:
+ *
+ *   GINT64   zigzag varint
+ *   DOUBLE   8 bytes, little endian
+ *   NUMERIC  zigzag varint numerator and denominator
+ *   STRING   the bytes and a NUL
+ *   GUID     16 bytes
+ *   TIME     zigzag varint seconds, varint nanoseconds
+ *   BOOLEAN  one byte
+ *   BINARY   the bytes
+ *   GLIST    a count, then the values
+ *   FRAME    a frame
+ *
+ * All counts and lengths are unsigned varints, seven bits to a byte
+ * with the top bit set on all but the last byte.
+ */
+
+#include "config.h"
+#include <glib.h>
+#include <string.h>
+#include "qof.h"
+
+static QofLogModule log_module = QOF_MOD_KVP;
+
+#define KVP_BINARY_MAGIC "QKV"
+#define KVP_BINARY_VERSION 2
+/* refuse to follow nesting deeper than this in a damaged buffer */
+#define KVP_BINARY_MAX_DEPTH 64
+
+/* ============================================================ */
+/* writing */
+
+typedef struct
+{
+	GByteArray *out;
+	GHashTable *keys;			/* key -> index + 1 */
+	GPtrArray *key_list;
+} KvpEncoder;
+
+static void
+put_varint (GByteArray * out, guint64 v)
+{
+	guint8 buf[10];
+	guint n = 0;
+
+	while (v >= 0x80)
+	{
+		buf[n++] = (guint8) (v | 0x80);
+		v >>= 7;
+	}
+	buf[n++] = (guint8) v;
+	g_byte_array_append (out, buf, n);
+}
+
+static inline guint64
+zigzag (gint64 v)
+{
+	return ((guint64) v << 1) ^ (guint64) (v >> 63);
+}
+
+static inline gint64
+unzigzag (guint64 v)
+{
+	return (gint64) (v >> 1) ^ -(gint64) (v & 1);
+}
+
+static void encode_frame (KvpEncoder * enc, const KvpFrame * frame);
+
+static void
+collect_keys (const gchar * key, KvpValue * value, gpointer data);
+
+static void
+collect_value_keys (KvpEncoder * enc, KvpValue * value)
+{
+	GList *node;
+
+	switch (kvp_value_get_type (value))
+	{
+	case KVP_TYPE_FRAME:
+		kvp_frame_for_each_slot_const (kvp_value_get_frame (value),
+			collect_keys, enc);
+		break;
+	case KVP_TYPE_GLIST:
+		for (node = kvp_value_get_glist (value); node; node = node->next)
+			collect_value_keys (enc, node->data);
+		break;
+	default:
+		break;
+	}
+}
+
+static void
+collect_keys (const gchar * key, KvpValue * value, gpointer data)
+{
+	KvpEncoder *enc = data;
+
+	if (!g_hash_table_lookup (enc->keys, key))
+	{
+		g_ptr_array_add (enc->key_list, (gpointer) key);
+		g_hash_table_insert (enc->keys, (gpointer) key,
+			GUINT_TO_POINTER (enc->key_list->len));
+	}
+	collect_value_keys (enc, value);
+}
+
+/* Values are written with a placeholder length, which is filled in
+ * once the value is complete.  The placeholder is the widest a
+ * length can need, padded out with continuation bytes. */
+#define LEN_WIDTH 5
+
+static guint
+begin_value (KvpEncoder * enc, KvpValueType type)
+{
+	static const guint8 pad[LEN_WIDTH] = { 0x80, 0x80, 0x80, 0x80, 0 };
+	guint8 t = (guint8) type;
+
+	g_byte_array_append (enc->out, &t, 1);
+	g_byte_array_append (enc->out, pad, LEN_WIDTH);
+	return enc->out->len;
+}
+
+static void
+end_value (KvpEncoder * enc, guint start)
+{
+	guint32 len = enc->out->len - start;
+	guint8 *p = enc->out->data + start - LEN_WIDTH;
+	guint i;
+
+	for (i = 0; i < LEN_WIDTH - 1; i++)
+	{
+		p[i] = (guint8) (len | 0x80);
+		len >>= 7;
+	}
+	p[i] = (guint8) len;
+}
+
+static void
+encode_value (KvpEncoder * enc, KvpValue * value)
+{
+	KvpValueType type;
+	guint start;
+
+	type = kvp_value_get_type (value);
+	start = begin_value (enc, type);
+	switch (type)
+	{
+	case KVP_TYPE_GINT64:
+		put_varint (enc->out, zigzag (kvp_value_get_gint64 (value)));
+		break;
+	case KVP_TYPE_DOUBLE:
+	{
+		gdouble d = kvp_value_get_double (value);
+		guint64 bits;
+
+		memcpy (&bits, &d, sizeof (bits));
+		bits = GUINT64_TO_LE (bits);
+		g_byte_array_append (enc->out, (guint8 *) & bits, sizeof (bits));
+		break;
+	}
+	case KVP_TYPE_NUMERIC:
+	{
+		QofNumeric n = kvp_value_get_numeric (value);
+
+		put_varint (enc->out, zigzag (qof_numeric_num (n)));
+		put_varint (enc->out, zigzag (qof_numeric_denom (n)));
+		break;
+	}
+	case KVP_TYPE_STRING:
+	{
+		const gchar *str = kvp_value_get_string (value);
+
+		g_byte_array_append (enc->out, (const guint8 *) str,
+			strlen (str) + 1);
+		break;
+	}
+	case KVP_TYPE_GUID:
+		g_byte_array_append (enc->out,
+			kvp_value_get_guid (value)->data, GUID_DATA_SIZE);
+		break;
+	case KVP_TYPE_TIME:
+	{
+		QofTime *qt = kvp_value_get_time (value);
+
+		put_varint (enc->out, zigzag (qof_time_get_secs (qt)));
+		put_varint (enc->out, (guint64) qof_time_get_nanosecs (qt));
+		break;
+	}
+	case KVP_TYPE_BOOLEAN:
+	{
+		guint8 b = kvp_value_get_boolean (value) ? 1 : 0;
+
+		g_byte_array_append (enc->out, &b, 1);
+		break;
+	}
+	case KVP_TYPE_BINARY:
+	{
+		guint64 size;
+		gpointer data;
+
+		data = kvp_value_get_binary (value, &size);
+		g_byte_array_append (enc->out, data, size);
+		break;
+	}
+	case KVP_TYPE_GLIST:
+	{
+		GList *list, *node;
+
+		list = kvp_value_get_glist (value);
+		put_varint (enc->out, g_list_length (list));
+		for (node = list; node; node = node->next)
+			encode_value (enc, node->data);
+		break;
+	}
+	case KVP_TYPE_FRAME:
+		encode_frame (enc, kvp_value_get_frame (value));
+		break;
+	}
+	end_value (enc, start);
+}
+
+static void
+encode_slot (const gchar * key, KvpValue * value, gpointer data)
+{
+	KvpEncoder *enc = data;
+
+	put_varint (enc->out,
+		GPOINTER_TO_UINT (g_hash_table_lookup (enc->keys, key)) - 1);
+	encode_value (enc, value);
+}
+
+static void
+encode_frame (KvpEncoder * enc, const KvpFrame * frame)
+{
+	put_varint (enc->out, kvp_frame_get_count (frame));
+	kvp_frame_for_each_slot_const (frame, encode_slot, enc);
+}
+
+guint8 *
+kvp_frame_to_binary (const KvpFrame * frame, gsize * size)
+{
+	KvpEncoder enc;
+	GByteArray *keys;
+	guint8 version = KVP_BINARY_VERSION;
+	guint i;
+
+	g_return_val_if_fail (frame, NULL);
+	g_return_val_if_fail (size, NULL);
+	enc.out = g_byte_array_new ();
+	enc.keys = g_hash_table_new (g_str_hash, g_str_equal);
+	enc.key_list = g_ptr_array_new ();
+	kvp_frame_for_each_slot_const (frame, collect_keys, &enc);
+
+	g_byte_array_append (enc.out, (const guint8 *) KVP_BINARY_MAGIC,
+		strlen (KVP_BINARY_MAGIC));
+	g_byte_array_append (enc.out, &version, 1);
+	put_varint (enc.out, enc.key_list->len);
+	keys = g_byte_array_new ();
+	for (i = 0; i < enc.key_list->len; i++)
+	{
+		const gchar *key = g_ptr_array_index (enc.key_list, i);
+		gsize len = strlen (key);
+
+		put_varint (keys, len);
+		g_byte_array_append (keys, (const guint8 *) key, len + 1);
+	}
+	put_varint (enc.out, keys->len);
+	g_byte_array_append (enc.out, keys->data, keys->len);
+	g_byte_array_free (keys, TRUE);
+	encode_frame (&enc, frame);
+
+	g_hash_table_destroy (enc.keys);
+	g_ptr_array_free (enc.key_list, TRUE);
+	*size = enc.out->len;
+	return g_byte_array_free (enc.out, FALSE);
+}
+
+/* ============================================================ */
+/* reading */
+
+typedef struct
+{
+	const guint8 *p;
+	const guint8 *end;
+	gboolean bad;				/* ran off the end, or worse */
+} KvpReader;
+
+static guint64
+get_varint (KvpReader * r)
+{
+	guint64 v = 0;
+	guint shift = 0;
+
+	while (r->p < r->end && shift < 64)
+	{
+		guint8 b = *r->p++;
+
+		v |= (guint64) (b & 0x7f) << shift;
+		if (!(b & 0x80))
+			return v;
+		shift += 7;
+	}
+	r->bad = TRUE;
+	return 0;
+}
+
+static const guint8 *
+get_bytes (KvpReader * r, guint64 len)
+{
+	const guint8 *p = r->p;
+
+	if (r->bad || len > (guint64) (r->end - r->p))
+	{
+		r->bad = TRUE;
+		return NULL;
+	}
+	r->p += len;
+	return p;
+}
+
+/* Looking up a path reads the key table again for each segment, so
+ * that it allocates nothing.  Decoding the whole frame indexes the
+ * keys once instead. */
+typedef struct
+{
+	const guint8 *keys;			/* the first key in the table */
+	guint64 n_keys;
+	const gchar **key_at;		/* each key, when indexed */
+	const guint8 *top;			/* the top frame */
+	const guint8 *end;
+} KvpBinary;
+
+/* Check the header and find the top frame. */
+static gboolean
+binary_open (KvpBinary * bin, gconstpointer data, gsize size)
+{
+	KvpReader r;
+	guint64 len;
+	const guint8 *magic;
+
+	r.p = data;
+	r.end = r.p + size;
+	r.bad = FALSE;
+	bin->key_at = NULL;
+	magic = get_bytes (&r, strlen (KVP_BINARY_MAGIC) + 1);
+	if (!magic || memcmp (magic, KVP_BINARY_MAGIC, strlen (KVP_BINARY_MAGIC))
+		|| magic[strlen (KVP_BINARY_MAGIC)] != KVP_BINARY_VERSION)
+	{
+		PERR ("not a binary KvpFrame");
+		return FALSE;
+	}
+	bin->n_keys = get_varint (&r);
+	len = get_varint (&r);
+	bin->keys = r.p;
+	bin->end = r.end;
+	get_bytes (&r, len);
+	/* each key takes at least two bytes */
+	if (r.bad || bin->n_keys > len / 2)
+	{
+		PERR ("damaged key table");
+		return FALSE;
+	}
+	bin->top = r.p;
+	return TRUE;
+}
+
+/* Check the keys and point key_at at each of them, before decoding
+ * frames.  The caller frees key_at. */
+static gboolean
+binary_index_keys (KvpBinary * bin)
+{
+	KvpReader r;
+	guint64 i, len;
+	const guint8 *key;
+
+	r.p = bin->keys;
+	r.end = bin->top;
+	r.bad = FALSE;
+	bin->key_at = g_new (const gchar *, bin->n_keys + 1);
+	for (i = 0; i < bin->n_keys && !r.bad; i++)
+	{
+		len = get_varint (&r);
+		key = get_bytes (&r, len + 1);
+		if (key && key[len] != 0)
+			r.bad = TRUE;
+		bin->key_at[i] = (const gchar *) key;
+	}
+	if (r.bad)
+	{
+		PERR ("damaged key table");
+		g_free (bin->key_at);
+		bin->key_at = NULL;
+	}
+	return !r.bad;
+}
+
+/* The number of a key, or -1 if it is not in the table. */
+static gint64
+binary_find_key (const KvpBinary * bin, const gchar * key, gsize key_len)
+{
+	KvpReader r;
+	guint64 i, len;
+	const guint8 *p;
+
+	r.p = bin->keys;
+	r.end = bin->top;
+	r.bad = FALSE;
+	for (i = 0; i < bin->n_keys; i++)
+	{
+		len = get_varint (&r);
+		p = get_bytes (&r, len + 1);
+		if (!p)
+			break;
+		if (len == key_len && 0 == memcmp (p, key, len))
+			return (gint64) i;
+	}
+	return -1;
+}
+
+static KvpFrame *decode_frame (const KvpBinary * bin, KvpReader * r,
+							   guint depth);
+
+static KvpValue *
+decode_value (const KvpBinary * bin, KvpReader * r, guint depth)
+{
+	KvpReader v;
+	KvpValue *value;
+	guint8 type;
+	guint64 len;
+	const guint8 *p;
+
+	p = get_bytes (r, 1);
+	len = get_varint (r);
+	v.p = get_bytes (r, len);
+	if (r->bad)
+		return NULL;
+	type = *p;
+	v.end = v.p + len;
+	v.bad = FALSE;
+	value = NULL;
+	switch (type)
+	{
+	case KVP_TYPE_GINT64:
+		value = kvp_value_new_gint64 (unzigzag (get_varint (&v)));
+		break;
+	case KVP_TYPE_DOUBLE:
+	{
+		guint64 bits;
+		gdouble d;
+
+		p = get_bytes (&v, sizeof (bits));
+		if (!p)
+			break;
+		memcpy (&bits, p, sizeof (bits));
+		bits = GUINT64_FROM_LE (bits);
+		memcpy (&d, &bits, sizeof (d));
+		value = kvp_value_new_double (d);
+		break;
+	}
+	case KVP_TYPE_NUMERIC:
+	{
+		gint64 num, denom;
+
+		num = unzigzag (get_varint (&v));
+		denom = unzigzag (get_varint (&v));
+		value = kvp_value_new_numeric (qof_numeric_create (num, denom));
+		break;
+	}
+	case KVP_TYPE_STRING:
+		if (len == 0 || v.p[len - 1] != 0)
+			v.bad = TRUE;
+		else
+			value = kvp_value_new_string ((const gchar *) v.p);
+		break;
+	case KVP_TYPE_GUID:
+	{
+		GUID guid;
+
+		p = get_bytes (&v, GUID_DATA_SIZE);
+		if (!p)
+			break;
+		memcpy (guid.data, p, GUID_DATA_SIZE);
+		value = kvp_value_new_guid (&guid);
+		break;
+	}
+	case KVP_TYPE_TIME:
+	{
+		QofTime *qt;
+		QofTimeSecs secs;
+		glong nano;
+
+		secs = unzigzag (get_varint (&v));
+		nano = (glong) get_varint (&v);
+		if (v.bad)
+			break;
+		qt = qof_time_new ();
+		qof_time_set_secs (qt, secs);
+		qof_time_set_nanosecs (qt, nano);
+		value = kvp_value_new_time (qt);
+		break;
+	}
+	case KVP_TYPE_BOOLEAN:
+		p = get_bytes (&v, 1);
+		if (p)
+			value = kvp_value_new_boolean (*p != 0);
+		break;
+	case KVP_TYPE_BINARY:
+	{
+		gpointer copy;
+
+		/* g_memdup is deprecated, and g_memdup2 too new */
+		copy = g_malloc (len ? len : 1);
+		memcpy (copy, v.p, len);
+		value = kvp_value_new_binary_nc (copy, len);
+		break;
+	}
+	case KVP_TYPE_GLIST:
+	{
+		GList *list = NULL;
+		guint64 n, i;
+
+		if (depth >= KVP_BINARY_MAX_DEPTH)
+		{
+			v.bad = TRUE;
+			break;
+		}
+		n = get_varint (&v);
+		for (i = 0; i < n && !v.bad; i++)
+		{
+			KvpValue *item = decode_value (bin, &v, depth + 1);
+
+			if (item)
+				list = g_list_prepend (list, item);
+		}
+		if (v.bad)
+		{
+			kvp_glist_delete (list);
+			break;
+		}
+		/* nothing left that this version understands */
+		if (!list)
+			return NULL;
+		value = kvp_value_new_glist_nc (g_list_reverse (list));
+		break;
+	}
+	case KVP_TYPE_FRAME:
+	{
+		KvpFrame *frame;
+
+		if (depth >= KVP_BINARY_MAX_DEPTH)
+		{
+			v.bad = TRUE;
+			break;
+		}
+		frame = decode_frame (bin, &v, depth + 1);
+		if (frame)
+			value = kvp_value_new_frame_nc (frame);
+		break;
+	}
+	default:
+		/* written by a later version: skip it */
+		PWARN ("unknown KvpValue type %d", type);
+		return NULL;
+	}
+	if (v.bad || !value)
+	{
+		kvp_value_delete (value);
+		r->bad = TRUE;
+		return NULL;
+	}
+	return value;
+}
+
+static KvpFrame *
+decode_frame (const KvpBinary * bin, KvpReader * r, guint depth)
+{
+	KvpFrame *frame;
+	KvpValue *value;
+	guint64 n, i, index;
+
+	frame = kvp_frame_new ();
+	n = get_varint (r);
+	for (i = 0; i < n && !r->bad; i++)
+	{
+		index = get_varint (r);
+		if (index >= bin->n_keys)
+		{
+			r->bad = TRUE;
+			break;
+		}
+		value = decode_value (bin, r, depth);
+		if (value)
+			kvp_frame_set_slot_nc (frame, bin->key_at[index], value);
+	}
+	if (r->bad)
+	{
+		kvp_frame_delete (frame);
+		return NULL;
+	}
+	return frame;
+}
+
+KvpFrame *
+kvp_frame_from_binary (gconstpointer data, gsize size)
+{
+	KvpBinary bin;
+	KvpReader r;
+	KvpFrame *frame;
+
+	g_return_val_if_fail (data, NULL);
+	if (!binary_open (&bin, data, size) || !binary_index_keys (&bin))
+		return NULL;
+	r.p = bin.top;
+	r.end = bin.end;
+	r.bad = FALSE;
+	frame = decode_frame (&bin, &r, 0);
+	g_free (bin.key_at);
+	if (!frame)
+		PERR ("damaged binary KvpFrame");
+	return frame;
+}
+
+/* ============================================================ */
+/* looking up a path without decoding the frame */
+
+/* Find the value at the end of the path.  Leaves the reader on the
+ * type byte of the value. */
+static gboolean
+binary_find_path (gconstpointer data, gsize size, const gchar * path,
+	KvpBinary * bin, KvpReader * r)
+{
+	KvpReader v;
+	const gchar *seg, *next;
+	gint64 index;
+	guint64 n, i, len;
+	const guint8 *type;
+	gboolean found;
+
+	if (!data || !path || !binary_open (bin, data, size))
+		return FALSE;
+	r->p = bin->top;
+	r->end = bin->end;
+	r->bad = FALSE;
+	seg = path;
+	while (TRUE)
+	{
+		while ('/' == *seg)
+			seg++;
+		if (!*seg)
+			return FALSE;
+		next = strchr (seg, '/');
+		if (!next)
+			next = seg + strlen (seg);
+		index = binary_find_key (bin, seg, next - seg);
+		if (index < 0)
+			return FALSE;
+
+		/* r is at the start of a frame */
+		n = get_varint (r);
+		found = FALSE;
+		for (i = 0; i < n && !r->bad && !found; i++)
+		{
+			if (get_varint (r) == (guint64) index)
+			{
+				found = TRUE;
+				break;
+			}
+			/* step over the value */
+			get_bytes (r, 1);
+			get_bytes (r, get_varint (r));
+		}
+		if (!found || r->bad)
+			return FALSE;
+		while ('/' == *next)
+			next++;
+		if (!*next)
+			return TRUE;
+
+		/* go into the frame */
+		v = *r;
+		type = get_bytes (&v, 1);
+		len = get_varint (&v);
+		if (v.bad || *type != KVP_TYPE_FRAME
+			|| len > (guint64) (v.end - v.p))
+			return FALSE;
+		r->p = v.p;
+		r->end = v.p + len;
+		seg = next;
+	}
+}
+
+KvpValue *
+kvp_binary_get_value (gconstpointer data, gsize size, const gchar * path)
+{
+	KvpBinary bin;
+	KvpReader r;
+	KvpValue *value;
+
+	if (!binary_find_path (data, size, path, &bin, &r) ||
+		!binary_index_keys (&bin))
+		return NULL;
+	value = decode_value (&bin, &r, 0);
+	g_free (bin.key_at);
+	return value;
+}
+
+/* The contents of a value of the given type at the path. */
+static const guint8 *
+binary_get_typed (gconstpointer data, gsize size, const gchar * path,
+	KvpValueType type, guint64 * len)
+{
+	KvpBinary bin;
+	KvpReader r;
+	const guint8 *t;
+
+	if (!binary_find_path (data, size, path, &bin, &r))
+		return NULL;
+	t = get_bytes (&r, 1);
+	*len = get_varint (&r);
+	if (r.bad || *t != type)
+		return NULL;
+	return get_bytes (&r, *len);
+}
+
+const gchar *
+kvp_binary_get_string (gconstpointer data, gsize size, const gchar * path)
+{
+	const guint8 *p;
+	guint64 len;
+
+	p = binary_get_typed (data, size, path, KVP_TYPE_STRING, &len);
+	if (!p || len == 0 || p[len - 1] != 0)
+		return NULL;
+	return (const gchar *) p;
+}
+
+gboolean
+kvp_binary_get_gint64 (gconstpointer data, gsize size, const gchar * path,
+	gint64 * value)
+{
+	KvpReader r;
+	guint64 len;
+
+	g_return_val_if_fail (value, FALSE);
+	r.p = binary_get_typed (data, size, path, KVP_TYPE_GINT64, &len);
+	if (!r.p)
+		return FALSE;
+	r.end = r.p + len;
+	r.bad = FALSE;
+	*value = unzigzag (get_varint (&r));
+	return !r.bad;
+}
@@ -35,9 +35,47 @@
   * (qof_util_string_cache), as it is very likely we will see the 
   * same keys over and over again  */
 
+/* Most frames hold a handful of slots, so a frame starts out as a
+ * small array of slots sorted by key and only becomes a hash table
+ * once it grows past KVP_FRAME_FLAT_MAX slots. */
+#define KVP_FRAME_FLAT_MAX 8
+
+typedef struct
+{
+	gchar *key;
+	KvpValue *value;
+} KvpSlot;
+
+/* The slots of a frame.  kvp_frame_copy shares the body between the
+ * copies, and a copy gets a body of its own the first time a slot is
+ * set.  Only the top level of the body is copied then, as the frames
+ * below it are shared in the same way.
+ *
+ * Once a value or a frame inside the body has been handed out, the
+ * body is pinned: the caller may change it, or hold on to it, so
+ * kvp_frame_copy copies a pinned body straight away instead of
+ * sharing it. */
+typedef struct
+{
+	gint ref_count;
+	gboolean pinned;
+	KvpSlot *slots;
+	guint n_slots;
+	guint slots_size;
+	GHashTable *hash;			/* NULL while the frame is small */
+} KvpFrameBody;
+
+/* What a lookup does with the body of each frame it passes. */
+typedef enum
+{
+	KVP_ACCESS_PEEK,			/* only read, leave a shared body shared */
+	KVP_ACCESS_OWN,				/* about to change the frame */
+	KVP_ACCESS_PIN				/* hands out a pointer into the frame */
+} KvpAccess;
+
 struct _KvpFrame
 {
-	GHashTable *hash;
+	KvpFrameBody *body;			/* NULL until the first slot */
 };
 
 typedef struct
@@ -46,6 +84,12 @@ typedef struct
 	gint64 datasize;
 } KvpValueBinaryData;
 
+struct _KvpPath
+{
+	guint n_keys;
+	gchar **keys;				/* in the string cache */
+};
+
 struct _KvpValue
 {
 	KvpValueType type;
@@ -80,27 +124,64 @@ kvp_hash_func (gconstpointer v)
 static gint
 kvp_comp_func (gconstpointer v, gconstpointer v2)
 {
-	return g_str_equal (v, v2);
+	/* the stored keys are cached, so a cached key matches itself */
+	return (v == v2) || g_str_equal (v, v2);
 }
 
+/* Binary search of the slot array.  Sets *pos to the slot holding
+ * the key, or to where it would go if there is none. */
 static gboolean
-init_frame_body_if_needed (KvpFrame * f)
+kvp_body_find_slot (const KvpFrameBody * b, const gchar *key, guint * pos)
 {
-	if (!f->hash)
+	guint lo, hi, mid;
+	gint cmp;
+
+	lo = 0;
+	hi = b->n_slots;
+	while (lo < hi)
 	{
-		f->hash = g_hash_table_new (&kvp_hash_func, &kvp_comp_func);
+		mid = (lo + hi) / 2;
+		/* keys from a KvpPath are cached, as the slot keys are */
+		cmp = (key == b->slots[mid].key) ? 0 : strcmp (key, b->slots[mid].key);
+		if (cmp == 0)
+		{
+			*pos = mid;
+			return TRUE;
+		}
+		if (cmp < 0)
+			hi = mid;
+		else
+			lo = mid + 1;
 	}
-	return (f->hash != NULL);
+	*pos = lo;
+	return FALSE;
 }
 
-KvpFrame *
-kvp_frame_new (void)
+/* Move the slots of a frame that has outgrown the array into a hash
+ * table.  The keys stay in the string cache. */
+static void
+kvp_body_make_hash (KvpFrameBody * b)
 {
-	KvpFrame *retval = g_new0 (KvpFrame, 1);
+	guint i;
 
-	/* Save space until the frame is actually used */
-	retval->hash = NULL;
-	return retval;
+	if (b->hash)
+		return;
+	b->hash = g_hash_table_new (&kvp_hash_func, &kvp_comp_func);
+	for (i = 0; i < b->n_slots; i++)
+		g_hash_table_insert (b->hash, b->slots[i].key, b->slots[i].value);
+	g_free (b->slots);
+	b->slots = NULL;
+	b->n_slots = 0;
+	b->slots_size = 0;
+}
+
+static guint
+kvp_frame_size (const KvpFrame * f)
+{
+	if (!f->body)
+		return 0;
+	return f->body->hash ? g_hash_table_size (f->body->hash) :
+		f->body->n_slots;
 }
 
 static void
@@ -111,23 +192,102 @@ kvp_frame_delete_worker (gpointer key, gpointer value,
 	kvp_value_delete ((KvpValue *) value);
 }
 
+static void
+kvp_body_unref (KvpFrameBody * b)
+{
+	guint i;
+
+	if (!b || !g_atomic_int_dec_and_test (&b->ref_count))
+		return;
+	/* free any allocated resource for frame or its children */
+	for (i = 0; i < b->n_slots; i++)
+		kvp_frame_delete_worker (b->slots[i].key, b->slots[i].value, NULL);
+	g_free (b->slots);
+	if (b->hash)
+	{
+		g_hash_table_foreach (b->hash, &kvp_frame_delete_worker, NULL);
+		g_hash_table_destroy (b->hash);
+	}
+	g_slice_free (KvpFrameBody, b);
+}
+
+static void
+kvp_frame_copy_worker (gpointer key, gpointer value, gpointer user_data)
+{
+	KvpFrameBody *dest = (KvpFrameBody *) user_data;
+	g_hash_table_insert (dest->hash,
+		qof_util_string_cache_insert (key),
+		(gpointer) kvp_value_copy (value));
+}
+
+/* A new, unpinned body holding a copy of the top level of old. */
+static KvpFrameBody *
+kvp_body_copy (const KvpFrameBody * old)
+{
+	KvpFrameBody *b;
+	guint i;
+
+	b = g_slice_new0 (KvpFrameBody);
+	b->ref_count = 1;
+	if (old->hash)
+	{
+		b->hash = g_hash_table_new (&kvp_hash_func, &kvp_comp_func);
+		g_hash_table_foreach (old->hash, &kvp_frame_copy_worker, b);
+	}
+	else if (old->n_slots)
+	{
+		/* already in order, so the array is copied straight across */
+		b->slots = g_new (KvpSlot, old->n_slots);
+		b->slots_size = old->n_slots;
+		b->n_slots = old->n_slots;
+		for (i = 0; i < old->n_slots; i++)
+		{
+			b->slots[i].key = qof_util_string_cache_insert (old->slots[i].key);
+			b->slots[i].value = kvp_value_copy (old->slots[i].value);
+		}
+	}
+	return b;
+}
+
+/* Give the frame a body of its own, copying the top level of a
+ * shared one. */
+static void
+kvp_frame_unshare (KvpFrame * f)
+{
+	KvpFrameBody *old;
+
+	old = f->body;
+	if (!old || g_atomic_int_get (&old->ref_count) == 1)
+		return;
+	f->body = kvp_body_copy (old);
+	kvp_body_unref (old);
+}
+
+/* Give the frame a body of its own that is never shared again,
+ * before a pointer into it is handed out. */
+static void
+kvp_frame_pin (KvpFrame * f)
+{
+	kvp_frame_unshare (f);
+	if (f->body)
+		f->body->pinned = TRUE;
+}
+
+KvpFrame *
+kvp_frame_new (void)
+{
+	/* Save space until the frame is actually used */
+	return g_slice_new0 (KvpFrame);
+}
+
 void
 kvp_frame_delete (KvpFrame * frame)
 {
 	if (!frame)
 		return;
 
-	if (frame->hash)
-	{
-		/* free any allocated resource for frame or its children */
-		g_hash_table_foreach (frame->hash, &kvp_frame_delete_worker,
-			(gpointer) frame);
-
-		/* delete the hash table */
-		g_hash_table_destroy (frame->hash);
-		frame->hash = NULL;
-	}
-	g_free (frame);
+	kvp_body_unref (frame->body);
+	g_slice_free (KvpFrame, frame);
 }
 
 gboolean
@@ -135,18 +295,7 @@ kvp_frame_is_empty (KvpFrame * frame)
 {
 	if (!frame)
 		return TRUE;
-	if (!frame->hash)
-		return TRUE;
-	return FALSE;
-}
-
-static void
-kvp_frame_copy_worker (gpointer key, gpointer value, gpointer user_data)
-{
-	KvpFrame *dest = (KvpFrame *) user_data;
-	g_hash_table_insert (dest->hash,
-		qof_util_string_cache_insert (key),
-		(gpointer) kvp_value_copy (value));
+	return (kvp_frame_size (frame) == 0);
 }
 
 KvpFrame *
@@ -154,51 +303,102 @@ kvp_frame_copy (const KvpFrame * frame)
 {
 	KvpFrame *retval = kvp_frame_new ();
 
-	if (!frame)
+	if (!frame || !frame->body)
 		return retval;
 
-	if (frame->hash)
+	if (frame->body->pinned)
 	{
-		if (!init_frame_body_if_needed (retval))
-			return (NULL);
-		g_hash_table_foreach (frame->hash,
-			&kvp_frame_copy_worker, (gpointer) retval);
+		retval->body = kvp_body_copy (frame->body);
+		return retval;
 	}
+	g_atomic_int_inc (&frame->body->ref_count);
+	retval->body = frame->body;
 	return retval;
 }
 
-/* Replace the old value with the new value.  Return the old value.
- * Passing in a null value into this routine has the effect of 
- * removing the key from the KVP tree.
- */
-KvpValue *
-kvp_frame_replace_slot_nc (KvpFrame * frame, const gchar *slot,
+static KvpValue *
+kvp_body_replace_hash_slot (KvpFrameBody * b, const gchar *slot,
 	KvpValue * new_value)
 {
 	gpointer orig_key;
 	gpointer orig_value = NULL;
 	int key_exists;
 
-	if (!frame || !slot)
-		return NULL;
-	if (!init_frame_body_if_needed (frame))
-		return NULL;			/* Error ... */
-
-	key_exists = g_hash_table_lookup_extended (frame->hash, slot,
+	key_exists = g_hash_table_lookup_extended (b->hash, slot,
 		&orig_key, &orig_value);
 	if (key_exists)
 	{
-		g_hash_table_remove (frame->hash, slot);
+		g_hash_table_remove (b->hash, slot);
 		qof_util_string_cache_remove (orig_key);
 	}
 	else
 		orig_value = NULL;
 	if (new_value)
-		g_hash_table_insert (frame->hash,
+		g_hash_table_insert (b->hash,
 			qof_util_string_cache_insert ((gpointer) slot), new_value);
 	return (KvpValue *) orig_value;
 }
 
+/* Replace the old value with the new value.  Return the old value.
+ * Passing in a null value into this routine has the effect of 
+ * removing the key from the KVP tree.
+ */
+KvpValue *
+kvp_frame_replace_slot_nc (KvpFrame * frame, const gchar *slot,
+	KvpValue * new_value)
+{
+	KvpFrameBody *b;
+	KvpValue *orig_value;
+	guint pos;
+
+	if (!frame || !slot)
+		return NULL;
+	if (!frame->body)
+	{
+		if (!new_value)
+			return NULL;
+		frame->body = g_slice_new0 (KvpFrameBody);
+		frame->body->ref_count = 1;
+	}
+	kvp_frame_unshare (frame);
+	b = frame->body;
+	if (b->hash)
+		return kvp_body_replace_hash_slot (b, slot, new_value);
+
+	if (kvp_body_find_slot (b, slot, &pos))
+	{
+		orig_value = b->slots[pos].value;
+		if (new_value)
+		{
+			b->slots[pos].value = new_value;
+			return orig_value;
+		}
+		qof_util_string_cache_remove (b->slots[pos].key);
+		b->n_slots--;
+		memmove (&b->slots[pos], &b->slots[pos + 1],
+			(b->n_slots - pos) * sizeof (KvpSlot));
+		return orig_value;
+	}
+	if (!new_value)
+		return NULL;
+	if (b->n_slots == KVP_FRAME_FLAT_MAX)
+	{
+		kvp_body_make_hash (b);
+		return kvp_body_replace_hash_slot (b, slot, new_value);
+	}
+	if (b->n_slots == b->slots_size)
+	{
+		b->slots_size = b->slots_size ? b->slots_size * 2 : 2;
+		b->slots = g_renew (KvpSlot, b->slots, b->slots_size);
+	}
+	memmove (&b->slots[pos + 1], &b->slots[pos],
+		(b->n_slots - pos) * sizeof (KvpSlot));
+	b->slots[pos].key = qof_util_string_cache_insert ((gpointer) slot);
+	b->slots[pos].value = new_value;
+	b->n_slots++;
+	return NULL;
+}
+
 /* Passing in a null value into this routine has the effect
  * of deleting the old value stored at this slot.
  */
@@ -211,18 +411,49 @@ kvp_frame_set_slot_destructively (KvpFrame * frame, const gchar *slot,
 	kvp_value_delete (old_value);
 }
 
+/* Look up a slot without giving the frame a body of its own, for
+ * callers that only read the value. */
+static KvpValue *
+kvp_frame_peek_slot (const KvpFrame * frame, const gchar *slot)
+{
+	KvpFrameBody *b;
+	guint pos;
+
+	if (!frame || !slot || !frame->body)
+		return NULL;
+	b = frame->body;
+	if (b->hash)
+		return g_hash_table_lookup (b->hash, slot);
+	if (kvp_body_find_slot (b, slot, &pos))
+		return b->slots[pos].value;
+	return NULL;
+}
+
+static KvpValue *
+kvp_frame_access_slot (const KvpFrame * frame, const gchar *slot,
+	KvpAccess how)
+{
+	if (!frame || !slot)
+		return NULL;
+	if (KVP_ACCESS_OWN == how)
+		kvp_frame_unshare ((KvpFrame *) frame);
+	else if (KVP_ACCESS_PIN == how)
+		kvp_frame_pin ((KvpFrame *) frame);
+	return kvp_frame_peek_slot (frame, slot);
+}
+
 /* ============================================================ */
 /* Get the named frame, or create it if it doesn't exist.
  * gcc -O3 should inline it.  It performs no error checks,
  * the caller is responsible of passing good keys and frames.
  */
 static inline KvpFrame *
-get_or_make (KvpFrame * fr, const gchar *key)
+get_or_make (KvpFrame * fr, const gchar *key, KvpAccess how)
 {
 	KvpFrame *next_frame;
 	KvpValue *value;
 
-	value = kvp_frame_get_slot (fr, key);
+	value = kvp_frame_access_slot (fr, key, how);
 	if (value)
 		next_frame = kvp_value_get_frame (value);
 	else
@@ -239,7 +470,8 @@ get_or_make (KvpFrame * fr, const gchar *key)
  * mangled .
  */
 static KvpFrame *
-kvp_frame_get_frame_slash_trash (KvpFrame * frame, gchar *key_path)
+kvp_frame_get_frame_slash_trash (KvpFrame * frame, gchar *key_path,
+	KvpAccess how)
 {
 	gchar *key, *next;
 	if (!frame || !key_path)
@@ -259,7 +491,7 @@ kvp_frame_get_frame_slash_trash (KvpFrame * frame, gchar *key_path)
 		if (next)
 			*next = 0x0;
 
-		frame = get_or_make (frame, key);
+		frame = get_or_make (frame, key, how);
 		if (!frame)
 			break;				/* error - should never happen */
 
@@ -274,7 +506,7 @@ kvp_frame_get_frame_slash_trash (KvpFrame * frame, gchar *key_path)
  */
 static inline const KvpFrame *
 kvp_frame_get_frame_or_null_slash_trash (const KvpFrame * frame,
-	gchar *key_path)
+	gchar *key_path, KvpAccess how)
 {
 	KvpValue *value;
 	gchar *key, *next;
@@ -295,7 +527,7 @@ kvp_frame_get_frame_or_null_slash_trash (const KvpFrame * frame,
 		if (next)
 			*next = 0x0;
 
-		value = kvp_frame_get_slot (frame, key);
+		value = kvp_frame_access_slot (frame, key, how);
 		if (!value)
 			return NULL;
 		frame = kvp_value_get_frame (value);
@@ -314,7 +546,7 @@ kvp_frame_get_frame_or_null_slash_trash (const KvpFrame * frame,
 
 static inline KvpFrame *
 get_trailer_make (KvpFrame * frame, const gchar *key_path, 
-				  gchar **end_key)
+				  gchar **end_key, KvpAccess how)
 {
 	gchar *last_key;
 
@@ -334,7 +566,7 @@ get_trailer_make (KvpFrame * frame, const gchar *key_path,
 		root = g_strdup (key_path);
 		lkey = strrchr (root, '/');
 		*lkey = 0;
-		frame = kvp_frame_get_frame_slash_trash (frame, root);
+		frame = kvp_frame_get_frame_slash_trash (frame, root, how);
 		g_free (root);
 		last_key++;
 	}
@@ -346,12 +578,13 @@ get_trailer_make (KvpFrame * frame, const gchar *key_path,
 
 /* Return pointer to last frame in path, or NULL if the path
  * doesn't exist.  Also store the last dangling part of path
- * in 'end_key'.
+ * in 'end_key'.  With KVP_ACCESS_PEEK, the frames are only read,
+ * and the caller must not change the one returned.
  */
 
 static inline const KvpFrame *
 get_trailer_or_null (const KvpFrame * frame, const gchar *key_path,
-	gchar **end_key)
+	gchar **end_key, KvpAccess how)
 {
 	gchar *last_key;
 
@@ -371,7 +604,7 @@ get_trailer_or_null (const KvpFrame * frame, const gchar *key_path,
 		root = g_strdup (key_path);
 		lkey = strrchr (root, '/');
 		*lkey = 0;
-		frame = kvp_frame_get_frame_or_null_slash_trash (frame, root);
+		frame = kvp_frame_get_frame_or_null_slash_trash (frame, root, how);
 		g_free (root);
 
 		last_key++;
@@ -383,12 +616,28 @@ get_trailer_or_null (const KvpFrame * frame, const gchar *key_path,
 
 /* ============================================================ */
 
+/* Set the value at the end of the path, creating the frames on the
+ * way.  The frame returned is only safe to hand out if the path was
+ * walked with KVP_ACCESS_PIN. */
+static KvpFrame *
+kvp_frame_set_value_trash (KvpFrame * frame, const gchar *key_path,
+	KvpValue * value, KvpAccess how)
+{
+	gchar *last_key;
+
+	frame = get_trailer_make (frame, key_path, &last_key, how);
+	if (!frame)
+		return NULL;
+	kvp_frame_set_slot_destructively (frame, last_key, value);
+	return frame;
+}
+
 void
 kvp_frame_set_gint64 (KvpFrame * frame, const gchar *path, gint64 ival)
 {
 	KvpValue *value;
 	value = kvp_value_new_gint64 (ival);
-	frame = kvp_frame_set_value_nc (frame, path, value);
+	frame = kvp_frame_set_value_trash (frame, path, value, KVP_ACCESS_OWN);
 	if (!frame)
 		kvp_value_delete (value);
 }
@@ -398,7 +647,7 @@ kvp_frame_set_double (KvpFrame * frame, const gchar *path, gdouble dval)
 {
 	KvpValue *value;
 	value = kvp_value_new_double (dval);
-	frame = kvp_frame_set_value_nc (frame, path, value);
+	frame = kvp_frame_set_value_trash (frame, path, value, KVP_ACCESS_OWN);
 	if (!frame)
 		kvp_value_delete (value);
 }
@@ -408,7 +657,7 @@ kvp_frame_set_time (KvpFrame * frame, const gchar *path, QofTime *qt)
 {
 	KvpValue *value;
 	value = kvp_value_new_time (qt);
-	frame = kvp_frame_set_value_nc (frame, path, value);
+	frame = kvp_frame_set_value_trash (frame, path, value, KVP_ACCESS_OWN);
 	if (!frame)
 		kvp_value_delete (value);
 }
@@ -419,7 +668,7 @@ kvp_frame_set_numeric (KvpFrame * frame, const gchar *path,
 {
 	KvpValue *value;
 	value = kvp_value_new_numeric (nval);
-	frame = kvp_frame_set_value_nc (frame, path, value);
+	frame = kvp_frame_set_value_trash (frame, path, value, KVP_ACCESS_OWN);
 	if (!frame)
 		kvp_value_delete (value);
 }
@@ -430,7 +679,7 @@ kvp_frame_set_boolean (KvpFrame * frame, const gchar * path,
 {
 	KvpValue * value;
 	value = kvp_value_new_boolean (val);
-	frame = kvp_frame_set_value_nc (frame, path, value);
+	frame = kvp_frame_set_value_trash (frame, path, value, KVP_ACCESS_OWN);
 	if (!frame)
 		kvp_value_delete (value);
 }
@@ -441,7 +690,7 @@ kvp_frame_set_string (KvpFrame * frame, const gchar *path,
 {
 	KvpValue *value;
 	value = kvp_value_new_string (str);
-	frame = kvp_frame_set_value_nc (frame, path, value);
+	frame = kvp_frame_set_value_trash (frame, path, value, KVP_ACCESS_OWN);
 	if (!frame)
 		kvp_value_delete (value);
 }
@@ -452,7 +701,7 @@ kvp_frame_set_guid (KvpFrame * frame, const gchar *path,
 {
 	KvpValue *value;
 	value = kvp_value_new_guid (guid);
-	frame = kvp_frame_set_value_nc (frame, path, value);
+	frame = kvp_frame_set_value_trash (frame, path, value, KVP_ACCESS_OWN);
 	if (!frame)
 		kvp_value_delete (value);
 }
@@ -462,7 +711,7 @@ kvp_frame_set_frame (KvpFrame * frame, const gchar *path, KvpFrame * fr)
 {
 	KvpValue *value;
 	value = kvp_value_new_frame (fr);
-	frame = kvp_frame_set_value_nc (frame, path, value);
+	frame = kvp_frame_set_value_trash (frame, path, value, KVP_ACCESS_OWN);
 	if (!frame)
 		kvp_value_delete (value);
 }
@@ -472,7 +721,7 @@ kvp_frame_set_frame_nc (KvpFrame * frame, const gchar *path, KvpFrame * fr)
 {
 	KvpValue *value;
 	value = kvp_value_new_frame_nc (fr);
-	frame = kvp_frame_set_value_nc (frame, path, value);
+	frame = kvp_frame_set_value_trash (frame, path, value, KVP_ACCESS_OWN);
 	if (!frame)
 		kvp_value_delete (value);
 }
@@ -483,13 +732,8 @@ KvpFrame *
 kvp_frame_set_value_nc (KvpFrame * frame, const gchar *key_path,
 	KvpValue * value)
 {
-	gchar *last_key;
-
-	frame = get_trailer_make (frame, key_path, &last_key);
-	if (!frame)
-		return NULL;
-	kvp_frame_set_slot_destructively (frame, last_key, value);
-	return frame;
+	return kvp_frame_set_value_trash (frame, key_path, value,
+		KVP_ACCESS_PIN);
 }
 
 KvpFrame *
@@ -499,7 +743,7 @@ kvp_frame_set_value (KvpFrame * frame, const gchar *key_path,
 	KvpValue *new_value = NULL;
 	gchar *last_key;
 
-	frame = get_trailer_make (frame, key_path, &last_key);
+	frame = get_trailer_make (frame, key_path, &last_key, KVP_ACCESS_PIN);
 	if (!frame)
 		return NULL;
 
@@ -518,10 +762,12 @@ kvp_frame_replace_value_nc (KvpFrame * frame, const gchar *key_path,
 
 	last_key = NULL;
 	if (new_value)
-		frame = get_trailer_make (frame, key_path, &last_key);
+		frame = get_trailer_make (frame, key_path, &last_key,
+			KVP_ACCESS_OWN);
 	else
 		frame =
-			(KvpFrame *) get_trailer_or_null (frame, key_path, &last_key);
+			(KvpFrame *) get_trailer_or_null (frame, key_path, &last_key,
+			KVP_ACCESS_OWN);
 	if (!frame)
 		return NULL;
 
@@ -538,7 +784,8 @@ kvp_frame_add_value_nc (KvpFrame * frame, const gchar *path,
 	gchar *key = NULL;
 	KvpValue *oldvalue;
 
-	frame = (KvpFrame *) get_trailer_or_null (frame, path, &key);
+	frame = (KvpFrame *) get_trailer_or_null (frame, path, &key,
+		KVP_ACCESS_PIN);
 	oldvalue = kvp_frame_get_slot (frame, key);
 
 	ENTER ("old frame=%s", kvp_frame_to_string (frame));
@@ -708,13 +955,8 @@ kvp_frame_set_slot_nc (KvpFrame * frame, const gchar *slot,
 KvpValue *
 kvp_frame_get_slot (const KvpFrame * frame, const gchar *slot)
 {
-	KvpValue *v;
-	if (!frame)
-		return NULL;
-	if (!frame->hash)
-		return NULL;			/* Error ... */
-	v = g_hash_table_lookup (frame->hash, slot);
-	return v;
+	/* the caller may change the value, or keep it */
+	return kvp_frame_access_slot (frame, slot, KVP_ACCESS_PIN);
 }
 
 /* ============================================================ */
@@ -749,7 +991,7 @@ kvp_frame_set_slot_path (KvpFrame * frame,
 
 		g_return_if_fail (*next_key != '\0');
 
-		value = kvp_frame_get_slot (frame, key);
+		value = kvp_frame_access_slot (frame, key, KVP_ACCESS_OWN);
 		if (!value)
 		{
 			KvpFrame *new_frame = kvp_frame_new ();
@@ -757,7 +999,7 @@ kvp_frame_set_slot_path (KvpFrame * frame,
 
 			kvp_frame_set_slot_nc (frame, key, frame_value);
 
-			value = kvp_frame_get_slot (frame, key);
+			value = kvp_frame_access_slot (frame, key, KVP_ACCESS_OWN);
 			if (!value)
 				break;
 		}
@@ -796,7 +1038,7 @@ kvp_frame_set_slot_path_gslist (KvpFrame * frame,
 			return;
 		}
 
-		value = kvp_frame_get_slot (frame, key);
+		value = kvp_frame_access_slot (frame, key, KVP_ACCESS_OWN);
 		if (!value)
 		{
 			KvpFrame *new_frame = kvp_frame_new ();
@@ -804,7 +1046,7 @@ kvp_frame_set_slot_path_gslist (KvpFrame * frame,
 
 			kvp_frame_set_slot_nc (frame, key, frame_value);
 
-			value = kvp_frame_get_slot (frame, key);
+			value = kvp_frame_access_slot (frame, key, KVP_ACCESS_OWN);
 			if (!value)
 				return;
 		}
@@ -915,48 +1157,48 @@ gint64
 kvp_frame_get_gint64 (const KvpFrame * frame, const gchar *path)
 {
 	gchar *key = NULL;
-	frame = get_trailer_or_null (frame, path, &key);
-	return kvp_value_get_gint64 (kvp_frame_get_slot (frame, key));
+	frame = get_trailer_or_null (frame, path, &key, KVP_ACCESS_PEEK);
+	return kvp_value_get_gint64 (kvp_frame_peek_slot (frame, key));
 }
 
 gdouble
 kvp_frame_get_double (const KvpFrame * frame, const gchar *path)
 {
 	gchar *key = NULL;
-	frame = get_trailer_or_null (frame, path, &key);
-	return kvp_value_get_double (kvp_frame_get_slot (frame, key));
+	frame = get_trailer_or_null (frame, path, &key, KVP_ACCESS_PEEK);
+	return kvp_value_get_double (kvp_frame_peek_slot (frame, key));
 }
 
 QofNumeric
 kvp_frame_get_numeric (const KvpFrame * frame, const gchar *path)
 {
 	gchar *key = NULL;
-	frame = get_trailer_or_null (frame, path, &key);
-	return kvp_value_get_numeric (kvp_frame_get_slot (frame, key));
+	frame = get_trailer_or_null (frame, path, &key, KVP_ACCESS_PEEK);
+	return kvp_value_get_numeric (kvp_frame_peek_slot (frame, key));
 }
 
 gchar *
 kvp_frame_get_string (const KvpFrame * frame, const gchar *path)
 {
 	gchar *key = NULL;
-	frame = get_trailer_or_null (frame, path, &key);
-	return kvp_value_get_string (kvp_frame_get_slot (frame, key));
+	frame = get_trailer_or_null (frame, path, &key, KVP_ACCESS_PEEK);
+	return kvp_value_get_string (kvp_frame_peek_slot (frame, key));
 }
 
 gboolean
 kvp_frame_get_boolean (const KvpFrame * frame, const gchar * path)
 {
 	gchar * key = NULL;
-	frame = get_trailer_or_null (frame, path, &key);
-	return kvp_value_get_boolean (kvp_frame_get_slot (frame, key));
+	frame = get_trailer_or_null (frame, path, &key, KVP_ACCESS_PEEK);
+	return kvp_value_get_boolean (kvp_frame_peek_slot (frame, key));
 }
 
 GUID *
 kvp_frame_get_guid (const KvpFrame * frame, const gchar *path)
 {
 	gchar *key = NULL;
-	frame = get_trailer_or_null (frame, path, &key);
-	return kvp_value_get_guid (kvp_frame_get_slot (frame, key));
+	frame = get_trailer_or_null (frame, path, &key, KVP_ACCESS_PEEK);
+	return kvp_value_get_guid (kvp_frame_peek_slot (frame, key));
 }
 
 void *
@@ -964,8 +1206,8 @@ kvp_frame_get_binary (const KvpFrame * frame, const gchar *path,
 	guint64 * size_return)
 {
 	gchar *key = NULL;
-	frame = get_trailer_or_null (frame, path, &key);
-	return kvp_value_get_binary (kvp_frame_get_slot (frame, key),
+	frame = get_trailer_or_null (frame, path, &key, KVP_ACCESS_PEEK);
+	return kvp_value_get_binary (kvp_frame_peek_slot (frame, key),
 		size_return);
 }
 
@@ -973,15 +1215,15 @@ QofTime *
 kvp_frame_get_time (const KvpFrame * frame, const gchar *path)
 {
 	gchar *key = NULL;
-	frame = get_trailer_or_null (frame, path, &key);
-	return kvp_value_get_time (kvp_frame_get_slot (frame, key));
+	frame = get_trailer_or_null (frame, path, &key, KVP_ACCESS_PEEK);
+	return kvp_value_get_time (kvp_frame_peek_slot (frame, key));
 }
 
 KvpFrame *
 kvp_frame_get_frame (const KvpFrame * frame, const gchar *path)
 {
 	gchar *key = NULL;
-	frame = get_trailer_or_null (frame, path, &key);
+	frame = get_trailer_or_null (frame, path, &key, KVP_ACCESS_PIN);
 	return kvp_value_get_frame (kvp_frame_get_slot (frame, key));
 }
 
@@ -989,7 +1231,7 @@ KvpValue *
 kvp_frame_get_value (const KvpFrame * frame, const gchar *path)
 {
 	gchar *key = NULL;
-	frame = get_trailer_or_null (frame, path, &key);
+	frame = get_trailer_or_null (frame, path, &key, KVP_ACCESS_PIN);
 	return kvp_frame_get_slot (frame, key);
 }
 
@@ -1008,7 +1250,7 @@ kvp_frame_get_frame_gslist (KvpFrame * frame, GSList * key_path)
 		if (!key)
 			return frame;		/* an unusual but valid exit for this routine. */
 
-		frame = get_or_make (frame, key);
+		frame = get_or_make (frame, key, KVP_ACCESS_PIN);
 		if (!frame)
 			return frame;		/* this should never happen */
 
@@ -1028,7 +1270,7 @@ kvp_frame_get_frame_path (KvpFrame * frame, const gchar *key, ...)
 
 	while (key)
 	{
-		frame = get_or_make (frame, key);
+		frame = get_or_make (frame, key, KVP_ACCESS_PIN);
 		if (!frame)
 			break;				/* error, should never occur */
 		key = va_arg (ap, const char *);
@@ -1046,7 +1288,7 @@ kvp_frame_get_frame_slash (KvpFrame * frame, const gchar *key_path)
 		return frame;
 
 	root = g_strdup (key_path);
-	frame = kvp_frame_get_frame_slash_trash (frame, root);
+	frame = kvp_frame_get_frame_slash_trash (frame, root, KVP_ACCESS_PIN);
 	g_free (root);
 	return frame;
 }
@@ -1119,6 +1361,128 @@ kvp_frame_get_slot_path_gslist (KvpFrame * frame, GSList * key_path)
 	}
 }
 
+/* ============================================================ */
+
+KvpPath *
+kvp_path_new (const gchar *path)
+{
+	KvpPath *kpath;
+	gchar **split;
+	guint i, n;
+
+	if (!path || !*path || '/' == path[strlen (path) - 1])
+		return NULL;
+	split = g_strsplit (path, "/", -1);
+	for (i = 0, n = 0; split[i]; i++)
+	{
+		if (*split[i])
+			n++;
+	}
+	kpath = NULL;
+	if (n)
+	{
+		kpath = g_new (KvpPath, 1);
+		kpath->n_keys = n;
+		kpath->keys = g_new (gchar *, n);
+		for (i = 0, n = 0; split[i]; i++)
+		{
+			if (*split[i])
+				kpath->keys[n++] = qof_util_string_cache_insert (split[i]);
+		}
+	}
+	g_strfreev (split);
+	return kpath;
+}
+
+KvpPath *
+kvp_path_new_gslist (GSList * key_path)
+{
+	KvpPath *kpath;
+	guint i;
+
+	if (!key_path)
+		return NULL;
+	kpath = g_new (KvpPath, 1);
+	kpath->n_keys = g_slist_length (key_path);
+	kpath->keys = g_new (gchar *, kpath->n_keys);
+	for (i = 0; key_path; key_path = key_path->next, i++)
+	{
+		if (!key_path->data)
+		{
+			kpath->n_keys = i;
+			kvp_path_free (kpath);
+			return NULL;
+		}
+		kpath->keys[i] = qof_util_string_cache_insert (key_path->data);
+	}
+	return kpath;
+}
+
+void
+kvp_path_free (KvpPath * path)
+{
+	guint i;
+
+	if (!path)
+		return;
+	for (i = 0; i < path->n_keys; i++)
+		qof_util_string_cache_remove (path->keys[i]);
+	g_free (path->keys);
+	g_free (path);
+}
+
+const KvpValue *
+kvp_frame_get_value_path (const KvpFrame * frame, const KvpPath * path)
+{
+	const KvpValue *value;
+	guint i;
+
+	if (!frame || !path)
+		return NULL;
+	for (i = 0; i + 1 < path->n_keys; i++)
+	{
+		value = kvp_frame_peek_slot (frame, path->keys[i]);
+		if (!value)
+			return NULL;
+		frame = kvp_value_get_frame (value);
+		if (!frame)
+			return NULL;
+	}
+	return kvp_frame_peek_slot (frame, path->keys[path->n_keys - 1]);
+}
+
+KvpFrame *
+kvp_frame_set_value_path_nc (KvpFrame * frame, const KvpPath * path,
+	KvpValue * value)
+{
+	guint i;
+
+	if (!frame || !path)
+		return NULL;
+	for (i = 0; i + 1 < path->n_keys; i++)
+	{
+		frame = get_or_make (frame, path->keys[i], KVP_ACCESS_PIN);
+		if (!frame)
+			return NULL;
+	}
+	kvp_frame_set_slot_destructively (frame, path->keys[path->n_keys - 1],
+		value);
+	return frame;
+}
+
+KvpFrame *
+kvp_frame_set_value_path (KvpFrame * frame, const KvpPath * path,
+	const KvpValue * value)
+{
+	KvpValue *new_value;
+
+	new_value = value ? kvp_value_copy (value) : NULL;
+	frame = kvp_frame_set_value_path_nc (frame, path, new_value);
+	if (!frame)
+		kvp_value_delete (new_value);
+	return frame;
+}
+
 /* *******************************************************************
  * kvp glist functions
  ********************************************************************/
@@ -1204,7 +1568,7 @@ kvp_glist_compare (const GList * list1, const GList * list2)
 KvpValue *
 kvp_value_new_gint64 (gint64 value)
 {
-	KvpValue *retval = g_new0 (KvpValue, 1);
+	KvpValue *retval = g_slice_new0 (KvpValue);
 	retval->type = KVP_TYPE_GINT64;
 	retval->value.int64 = value;
 	return retval;
@@ -1213,7 +1577,7 @@ kvp_value_new_gint64 (gint64 value)
 KvpValue *
 kvp_value_new_double (gdouble value)
 {
-	KvpValue *retval = g_new0 (KvpValue, 1);
+	KvpValue *retval = g_slice_new0 (KvpValue);
 	retval->type = KVP_TYPE_DOUBLE;
 	retval->value.dbl = value;
 	return retval;
@@ -1222,7 +1586,7 @@ kvp_value_new_double (gdouble value)
 KvpValue *
 kvp_value_new_boolean (gboolean value)
 {
-	KvpValue * retval = g_new0 (KvpValue, 1);
+	KvpValue * retval = g_slice_new0 (KvpValue);
 	retval->type = KVP_TYPE_BOOLEAN;
 	retval->value.gbool = value;
 	return retval;
@@ -1231,7 +1595,7 @@ kvp_value_new_boolean (gboolean value)
 KvpValue *
 kvp_value_new_numeric (QofNumeric value)
 {
-	KvpValue *retval = g_new0 (KvpValue, 1);
+	KvpValue *retval = g_slice_new0 (KvpValue);
 	retval->type = KVP_TYPE_NUMERIC;
 	retval->value.numeric = value;
 	return retval;
@@ -1244,7 +1608,7 @@ kvp_value_new_string (const gchar *value)
 	if (!value)
 		return NULL;
 
-	retval = g_new0 (KvpValue, 1);
+	retval = g_slice_new0 (KvpValue);
 	retval->type = KVP_TYPE_STRING;
 	retval->value.str = g_strdup (value);
 	return retval;
@@ -1257,17 +1621,17 @@ kvp_value_new_guid (const GUID * value)
 	if (!value)
 		return NULL;
 
-	retval = g_new0 (KvpValue, 1);
+	retval = g_slice_new0 (KvpValue);
 	retval->type = KVP_TYPE_GUID;
-	retval->value.guid = g_new0 (GUID, 1);
-	memcpy (retval->value.guid, value, sizeof (GUID));
+	retval->value.guid = guid_malloc ();
+	*retval->value.guid = *value;
 	return retval;
 }
 
 KvpValue *
 kvp_value_new_time (QofTime *value)
 {
-	KvpValue *retval = g_new0 (KvpValue, 1);
+	KvpValue *retval = g_slice_new0 (KvpValue);
 	retval->type = KVP_TYPE_TIME;
 	retval->value.qt = value;
 	return retval;
@@ -1280,7 +1644,7 @@ kvp_value_new_binary (gconstpointer value, guint64 datasize)
 	if (!value)
 		return NULL;
 
-	retval = g_new0 (KvpValue, 1);
+	retval = g_slice_new0 (KvpValue);
 	retval->type = KVP_TYPE_BINARY;
 	retval->value.binary.data = g_new0 (gpointer, datasize);
 	retval->value.binary.datasize = datasize;
@@ -1295,7 +1659,7 @@ kvp_value_new_binary_nc (gpointer value, guint64 datasize)
 	if (!value)
 		return NULL;
 
-	retval = g_new0 (KvpValue, 1);
+	retval = g_slice_new0 (KvpValue);
 	retval->type = KVP_TYPE_BINARY;
 	retval->value.binary.data = value;
 	retval->value.binary.datasize = datasize;
@@ -1309,7 +1673,7 @@ kvp_value_new_glist (const GList * value)
 	if (!value)
 		return NULL;
 
-	retval = g_new0 (KvpValue, 1);
+	retval = g_slice_new0 (KvpValue);
 	retval->type = KVP_TYPE_GLIST;
 	retval->value.list = kvp_glist_copy (value);
 	return retval;
@@ -1322,7 +1686,7 @@ kvp_value_new_glist_nc (GList * value)
 	if (!value)
 		return NULL;
 
-	retval = g_new0 (KvpValue, 1);
+	retval = g_slice_new0 (KvpValue);
 	retval->type = KVP_TYPE_GLIST;
 	retval->value.list = value;
 	return retval;
@@ -1335,7 +1699,7 @@ kvp_value_new_frame (const KvpFrame * value)
 	if (!value)
 		return NULL;
 
-	retval = g_new0 (KvpValue, 1);
+	retval = g_slice_new0 (KvpValue);
 	retval->type = KVP_TYPE_FRAME;
 	retval->value.frame = kvp_frame_copy (value);
 	return retval;
@@ -1348,7 +1712,7 @@ kvp_value_new_frame_nc (KvpFrame * value)
 	if (!value)
 		return NULL;
 
-	retval = g_new0 (KvpValue, 1);
+	retval = g_slice_new0 (KvpValue);
 	retval->type = KVP_TYPE_FRAME;
 	retval->value.frame = value;
 	return retval;
@@ -1366,7 +1730,7 @@ kvp_value_delete (KvpValue * value)
 		g_free (value->value.str);
 		break;
 	case KVP_TYPE_GUID:
-		g_free (value->value.guid);
+		guid_free (value->value.guid);
 		break;
 	case KVP_TYPE_BINARY:
 		g_free (value->value.binary.data);
@@ -1384,7 +1748,7 @@ kvp_value_delete (KvpValue * value)
 	default:
 		break;
 	}
-	g_free (value);
+	g_slice_free (KvpValue, value);
 }
 
 KvpValueType
@@ -1618,7 +1982,6 @@ kvp_value_copy (const KvpValue * value)
 		return kvp_value_new_guid (value->value.guid);
 		break;
 	case KVP_TYPE_BOOLEAN:
-		return NULL;
 		return kvp_value_new_boolean (value->value.gbool);
 		break;
 	case KVP_TYPE_TIME :
@@ -1638,6 +2001,25 @@ kvp_value_copy (const KvpValue * value)
 	return NULL;
 }
 
+void
+kvp_frame_for_each_slot_const (const KvpFrame * f, KvpValueForeachCB proc,
+	gpointer data)
+{
+	KvpFrameBody *b;
+	guint i;
+
+	if (!f || !proc || !f->body)
+		return;
+	b = f->body;
+	if (b->hash)
+	{
+		g_hash_table_foreach (b->hash, (GHFunc) proc, data);
+		return;
+	}
+	for (i = 0; i < b->n_slots; i++)
+		proc (b->slots[i].key, b->slots[i].value, data);
+}
+
 void
 kvp_frame_for_each_slot (KvpFrame * f, KvpValueForeachCB proc, gpointer data)
 {
@@ -1645,9 +2027,9 @@ kvp_frame_for_each_slot (KvpFrame * f, KvpValueForeachCB proc, gpointer data)
 		return;
 	if (!proc)
 		return;
-	if (!(f->hash))
-		return;
-	g_hash_table_foreach (f->hash, (GHFunc) proc, data);
+	/* the callback may change the values, or keep them */
+	kvp_frame_pin (f);
+	kvp_frame_for_each_slot_const (f, proc, data);
 }
 
 gint
@@ -1730,7 +2112,7 @@ kvp_frame_compare_helper (const gchar *key, KvpValue * val, gpointer data)
 	if (status->compare == 0)
 	{
 		KvpFrame *other_frame = status->other_frame;
-		KvpValue *other_val = kvp_frame_get_slot (other_frame, key);
+		KvpValue *other_val = kvp_frame_peek_slot (other_frame, key);
 
 		if (other_val)
 			status->compare = kvp_value_compare (val, other_val);
@@ -1751,26 +2133,27 @@ kvp_frame_compare (const KvpFrame * fa, const KvpFrame * fb)
 		return -1;
 	if (fa && !fb)
 		return 1;
+	/* copies that have not been changed */
+	if (fa->body == fb->body)
+		return 0;
 
 	/* nothing is always less than something */
-	if (!fa->hash && fb->hash)
+	if (!kvp_frame_size (fa) && kvp_frame_size (fb))
 		return -1;
-	if (fa->hash && !fb->hash)
+	if (kvp_frame_size (fa) && !kvp_frame_size (fb))
 		return 1;
 
 	status.compare = 0;
 	status.other_frame = (KvpFrame *) fb;
 
-	kvp_frame_for_each_slot ((KvpFrame *) fa, kvp_frame_compare_helper,
-		&status);
+	kvp_frame_for_each_slot_const (fa, kvp_frame_compare_helper, &status);
 
 	if (status.compare != 0)
 		return status.compare;
 
 	status.other_frame = (KvpFrame *) fa;
 
-	kvp_frame_for_each_slot ((KvpFrame *) fb, kvp_frame_compare_helper,
-		&status);
+	kvp_frame_for_each_slot_const (fb, kvp_frame_compare_helper, &status);
 
 	return (-status.compare);
 }
@@ -1898,10 +2281,10 @@ kvp_value_to_bare_string (const KvpValue * val)
 			KvpFrame *frame;
 
 			frame = kvp_value_get_frame (val);
-			if (frame->hash)
+			if (!kvp_frame_is_empty (frame))
 			{
 				tmp1 = g_strdup ("");
-				g_hash_table_foreach (frame->hash,
+				kvp_frame_for_each_slot_const (frame, (KvpValueForeachCB)
 					kvp_frame_to_bare_string_helper, &tmp1);
 			}
 			return tmp1;
@@ -2015,9 +2398,8 @@ kvp_frame_to_string (const KvpFrame * frame)
 
 	tmp1 = g_strdup_printf ("{\n");
 
-	if (frame->hash)
-		g_hash_table_foreach (frame->hash, kvp_frame_to_string_helper,
-			&tmp1);
+	kvp_frame_for_each_slot_const (frame,
+		(KvpValueForeachCB) kvp_frame_to_string_helper, &tmp1);
 	{
 		gchar *tmp2;
 		tmp2 = g_strdup_printf ("%s}\n", tmp1);
@@ -2032,7 +2414,20 @@ GHashTable *
 kvp_frame_get_hash (const KvpFrame * frame)
 {
 	g_return_val_if_fail (frame != NULL, NULL);
-	return frame->hash;
+	if (!frame->body)
+		return NULL;
+	/* callers expect the slots in a hash table, whatever the size,
+	 * and may change the values in it */
+	kvp_frame_pin ((KvpFrame *) frame);
+	kvp_body_make_hash (frame->body);
+	return frame->body->hash;
+}
+
+guint
+kvp_frame_get_count (const KvpFrame * frame)
+{
+	g_return_val_if_fail (frame != NULL, 0);
+	return kvp_frame_size (frame);
 }
 
 /* ========================== END OF FILE ======================= */
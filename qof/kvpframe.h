@@ -77,6 +77,9 @@ typedef struct _KvpFrame KvpFrame;
  * KvpValueType enum. */
 typedef struct _KvpValue KvpValue;
 
+/** A path into nested frames, split up once for repeated use. */
+typedef struct _KvpPath KvpPath;
+
 /** \brief possible types in the union KvpValue 
  
  \todo In the long run, this could be synchronised with the 
@@ -149,7 +152,16 @@ void
 kvp_frame_delete (KvpFrame * frame);
 
 /** Perform a deep (recursive) value copy, copying the frame, 
- *  subframes, and the values as well. */
+ *  subframes, and the values as well.
+ *
+ *  The copy is made lazily: the two frames share their slots until
+ *  one of them is changed, and then only the level being changed is
+ *  copied.  A frame that has handed out a KvpValue or KvpFrame inside
+ *  it, through kvp_frame_get_slot(), kvp_frame_get_frame(),
+ *  kvp_frame_for_each_slot() and the like, is copied straight away,
+ *  so the pointer stays with the frame it came from.  Reading a frame
+ *  through the typed kvp_frame_get_ routines, kvp_frame_get_value_path()
+ *  or kvp_frame_for_each_slot_const() never copies it. */
 KvpFrame *
 kvp_frame_copy (const KvpFrame * frame);
 
@@ -591,6 +603,45 @@ KvpValue *kvp_frame_get_slot_path_gslist (KvpFrame * frame,
 
 /** @} */
 
+/** @name KvpFrame Pre-parsed Paths
+
+  A path that is looked up again and again, in a query or a backend,
+  can be split into its keys once with kvp_path_new().  The keys are
+  kept in the string cache, so using the path afterwards neither
+  copies nor splits the path string.
+ @{
+*/
+/** Split a path of the form "a/b/c".  Repeated and leading slashes
+ * are ignored.  Returns NULL for a path with no keys or with a
+ * trailing slash. */
+KvpPath *kvp_path_new (const gchar * path);
+
+/** Build a path from a list of keys, as used by
+ * kvp_frame_get_slot_path_gslist(). */
+KvpPath *kvp_path_new_gslist (GSList * key_path);
+
+void kvp_path_free (KvpPath * path);
+
+/** The value at the end of the path, or NULL if any portion of the
+ * path doesn't exist.  The frame is only read, so the value must not
+ * be changed. */
+const KvpValue *kvp_frame_get_value_path (const KvpFrame * frame,
+									const KvpPath * path);
+
+/** Store a copy of the value at the end of the path, creating the
+ * frames along the way.  As kvp_frame_set_value(), returns the frame
+ * holding the value, and a NULL value deletes the old value. */
+KvpFrame *kvp_frame_set_value_path (KvpFrame * frame,
+									const KvpPath * path,
+									const KvpValue * value);
+
+/** As kvp_frame_set_value_path() but stores the value without
+ * copying it. */
+KvpFrame *kvp_frame_set_value_path_nc (KvpFrame * frame,
+									   const KvpPath * path,
+									   KvpValue * value);
+/** @} */
+
 /** 
  kvp_glist_compare() compares <b>GLists of KvpValue values</b> (not to
  be confused with GLists of something else):  it iterates over
@@ -772,6 +823,13 @@ typedef void (*KvpValueForeachCB) (const gchar *key, KvpValue * value, gpointer
 void 
 kvp_frame_for_each_slot (KvpFrame * f, KvpValueForeachCB, gpointer data);
 
+/** As kvp_frame_for_each_slot(), for callers that only read the
+   values: proc must not change or keep them.  The frame is left
+   as it is, so several threads may walk the same frame at once. */
+void
+kvp_frame_for_each_slot_const (const KvpFrame * f, KvpValueForeachCB proc,
+	gpointer data);
+
 /** @} */
 
 /** @} */
@@ -84,8 +84,19 @@ gint kvp_frame_compare (const KvpFrame * fa, const KvpFrame * fb);
 gchar *kvp_frame_to_string (const KvpFrame * frame);
 gchar *binary_to_string (const void *data, guint32 size);
 gchar *kvp_value_glist_to_string (const GList * list);
+/**
+ * The slots of the frame as a hash table, or NULL if the frame has
+ * never held a slot.  Small frames keep their slots in a sorted array
+ * and this moves them into a hash table for good, so prefer
+ * kvp_frame_for_each_slot() or kvp_frame_get_count().
+ */
 GHashTable *kvp_frame_get_hash (const KvpFrame * frame);
 
+/**
+ * The number of slots held directly in the frame.
+ */
+guint kvp_frame_get_count (const KvpFrame * frame);
+
 /** @name KvpBag Bags of GUID Pointers 
  @{ 
 */
@@ -162,6 +173,46 @@ qof_kvp_bag_remove_frame (KvpFrame * root, const gchar *path,
 
 /***********************************************************************/
 
+/** @} */
+
+/** @name KvpFrame Binary Encoding
+
+ A compact binary form of a whole tree of frames, for storing KVP
+ data in a single blob.  Each key is stored once however often it
+ is used.  A value can be read straight out of an encoded buffer,
+ for example one that has been mapped in from a file, without
+ decoding the rest of the frame.
+
+ The buffer is not tied to the machine that wrote it.  Time values
+ are decoded into new QofTimes, which belong to the caller, as with
+ kvp_value_new_time().
+ @{
+*/
+
+/** Encode a frame and everything below it.  Returns a newly allocated
+ * buffer, to be released with g_free(), and sets *size to its length. */
+guint8 *kvp_frame_to_binary (const KvpFrame * frame, gsize * size);
+
+/** Decode a buffer written by kvp_frame_to_binary(), or return NULL
+ * if it is damaged.  Values of types this version does not know are
+ * left out. */
+KvpFrame *kvp_frame_from_binary (gconstpointer data, gsize size);
+
+/** Decode only the value at the path, or return NULL if there is
+ * none.  The value belongs to the caller. */
+KvpValue *kvp_binary_get_value (gconstpointer data, gsize size,
+								const gchar * path);
+
+/** The string at the path, pointing into the buffer itself, or NULL
+ * if the path does not hold a string. */
+const gchar *kvp_binary_get_string (gconstpointer data, gsize size,
+									const gchar * path);
+
+/** Read the integer at the path into *value.  Returns FALSE if the
+ * path does not hold a ::KVP_TYPE_GINT64. */
+gboolean kvp_binary_get_gint64 (gconstpointer data, gsize size,
+								const gchar * path, gint64 * value);
+
 /** @} */
 /** @} */
 #endif /* KVPUTIL_H */
@@ -43,6 +43,8 @@
 	@ingroup QOF
     @addtogroup Query Query:      Querying for Objects
     @ingroup QOF
+    @addtogroup Index Index:      Secondary indexes on entity parameters
+    @ingroup QOF
     @addtogroup SQL SQL Interface to Query
     @ingroup QOF
 	@addtogroup Error Error: Extensible error handling.
@@ -83,6 +85,7 @@
 #include "qofobject.h"
 #include "qofquery.h"
 #include "qofquerycore.h"
+#include "qofindex.h"
 #include "qoferror.h"
 #include "qofsession.h"
 #include "qofsql.h"
@@ -90,6 +93,7 @@
 #include "qofbookmerge.h"
 #include "qofreference.h"
 #include "qofundo.h"
+#include "qofsnapshot.h"
 //#include "deprecated.h"
 
 /** allow easy logging of QSF debug messages */
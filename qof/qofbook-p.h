@@ -56,6 +56,11 @@ struct _QofBook
 	*/
 	GHashTable *hash_of_collections;
 
+	/** The collections of registered types, by their type id.
+	hash_of_collections only holds those of other types. */
+	QofCollection **collections;
+	guint n_collections;
+
 	/** In order to store arbitrary data, for extensibility,
 	add a table	that will be used to hold arbitrary pointers. */
 	GHashTable *data_tables;
@@ -92,6 +97,22 @@ struct _QofBook
 	/** Backend private expansion data
 	used by the sql backend for kvp management */
 	guint32 idata;
+
+	/** Moves on with every change, see qof_book_get_generation */
+	guint64 generation;
+
+	/** Memory handed out by qof_book_alloc, NULL until first used */
+	struct _QofBookArena *arena;
+
+	/** GUIDs interned by qof_book_get_handle, in blocks that never
+	move, and an open addressing table of their handles */
+	GUID **handle_blocks;
+	guint32 n_handles;
+	guint32 *handle_slots;
+	guint32 handle_slots_size;
+
+	/** The QofSnapshot of the book that are still open */
+	GList *snapshots;
 };
 
 /**
@@ -43,9 +43,46 @@
 #include "qofbook-p.h"
 #include "qofid-p.h"
 #include "qofobject-p.h"
+#include "qofsnapshot-p.h"
 
 static QofLogModule log_module = QOF_MOD_ENGINE;
 
+/* The last generation handed out to any book.  Books on different
+ * threads draw from it, and the generation of a book is read by the
+ * query cache of any thread, so both go under the lock. */
+static guint64 last_generation = 0;
+G_LOCK_DEFINE_STATIC (last_generation);
+
+/* qof_book_alloc carves small blocks out of large chunks, keeping one
+ * free list for each size, so that a book full of objects needs few
+ * calls to malloc and all of them are released together with the
+ * book.  Larger blocks are allocated one by one, but still belong to
+ * the book. */
+#define ARENA_ALIGN   16
+#define ARENA_CLASSES 32		/* blocks of up to 512 bytes */
+#define ARENA_CHUNK   (64 * 1024)
+
+typedef struct _ArenaFree
+{
+	struct _ArenaFree *next;
+} ArenaFree;
+
+/* header in front of each large block, must fit in ARENA_ALIGN */
+typedef struct _ArenaBig
+{
+	struct _ArenaBig *prev;
+	struct _ArenaBig *next;
+} ArenaBig;
+
+struct _QofBookArena
+{
+	GSList *chunks;
+	guchar *top;
+	gsize left;
+	ArenaFree *free[ARENA_CLASSES];
+	ArenaBig *big;
+};
+
 static void
 coll_destroy (gpointer col)
 {
@@ -68,7 +105,7 @@ qof_book_init (QofBook * book)
 	book->book_open = 'y';
 	book->version = 0;
 	book->idata = 0;
-	book->undo_data = g_new0 (QofUndo, 1);
+	book->undo_data = qof_book_alloc (book, sizeof (QofUndo));
 }
 
 QofBook *
@@ -85,6 +122,206 @@ qof_book_new (void)
 	return book;
 }
 
+static void
+arena_destroy (struct _QofBookArena *arena)
+{
+	GSList *node;
+	ArenaBig *big, *next;
+
+	for (node = arena->chunks; node; node = node->next)
+		g_free (node->data);
+	g_slist_free (arena->chunks);
+	for (big = arena->big; big; big = next)
+	{
+		next = big->next;
+		g_free (big);
+	}
+	g_free (arena);
+}
+
+gpointer
+qof_book_alloc (QofBook * book, gsize size)
+{
+	struct _QofBookArena *arena;
+	ArenaFree *block;
+	guint cls;
+
+	g_return_val_if_fail (book, NULL);
+	if (size == 0)
+		return NULL;
+	if (!book->arena)
+		book->arena = g_new0 (struct _QofBookArena, 1);
+	arena = book->arena;
+	cls = (size - 1) / ARENA_ALIGN;
+	if (cls >= ARENA_CLASSES)
+	{
+		ArenaBig *big;
+
+		big = g_malloc0 (ARENA_ALIGN + size);
+		big->next = arena->big;
+		if (arena->big)
+			arena->big->prev = big;
+		arena->big = big;
+		return (guchar *) big + ARENA_ALIGN;
+	}
+	block = arena->free[cls];
+	if (block)
+	{
+		arena->free[cls] = block->next;
+		memset (block, 0, (cls + 1) * ARENA_ALIGN);
+		return block;
+	}
+	size = (cls + 1) * ARENA_ALIGN;
+	if (arena->left < size)
+	{
+		/* the rest of the old chunk is wasted */
+		arena->top = g_malloc0 (ARENA_CHUNK);
+		arena->left = ARENA_CHUNK;
+		arena->chunks = g_slist_prepend (arena->chunks, arena->top);
+	}
+	block = (ArenaFree *) arena->top;
+	arena->top += size;
+	arena->left -= size;
+	return block;
+}
+
+void
+qof_book_free (QofBook * book, gpointer mem, gsize size)
+{
+	struct _QofBookArena *arena;
+	ArenaFree *block;
+	guint cls;
+
+	if (!mem)
+		return;
+	g_return_if_fail (book && book->arena);
+	arena = book->arena;
+	cls = (size - 1) / ARENA_ALIGN;
+	if (cls >= ARENA_CLASSES)
+	{
+		ArenaBig *big;
+
+		big = (ArenaBig *) ((guchar *) mem - ARENA_ALIGN);
+		if (big->prev)
+			big->prev->next = big->next;
+		else
+			arena->big = big->next;
+		if (big->next)
+			big->next->prev = big->prev;
+		g_free (big);
+		return;
+	}
+	block = mem;
+	block->next = arena->free[cls];
+	arena->free[cls] = block;
+}
+
+/* Handles are interned in blocks of this many GUIDs. */
+#define HANDLE_BLOCK_BITS 10
+#define HANDLE_BLOCK (1 << HANDLE_BLOCK_BITS)
+
+static GUID *
+handle_guid (QofBook * book, QofHandle handle)
+{
+	return &book->handle_blocks[handle >> HANDLE_BLOCK_BITS]
+		[handle & (HANDLE_BLOCK - 1)];
+}
+
+/* The slot holding the handle of the GUID, or the empty slot where
+ * it should go. */
+static guint32 *
+handle_find (QofBook * book, const GUID * guid)
+{
+	guint32 mask = book->handle_slots_size - 1;
+	guint32 i, *slot;
+
+	for (i = guid_hash_to_guint (guid) & mask;; i = (i + 1) & mask)
+	{
+		slot = &book->handle_slots[i];
+		if (*slot == QOF_HANDLE_NONE ||
+			guid_equal (handle_guid (book, *slot), guid))
+			return slot;
+	}
+}
+
+static void
+handle_grow (QofBook * book)
+{
+	guint32 size, h, *slot;
+
+	size = MAX (book->handle_slots_size * 2, 64);
+	g_free (book->handle_slots);
+	book->handle_slots = g_new0 (guint32, size);
+	book->handle_slots_size = size;
+	for (h = 1; h <= book->n_handles; h++)
+	{
+		slot = handle_find (book, handle_guid (book, h));
+		*slot = h;
+	}
+}
+
+static void
+handle_destroy (QofBook * book)
+{
+	guint32 i;
+
+	if (book->handle_blocks)
+	{
+		for (i = 0; i <= book->n_handles >> HANDLE_BLOCK_BITS; i++)
+			g_free (book->handle_blocks[i]);
+	}
+	g_free (book->handle_blocks);
+	g_free (book->handle_slots);
+	book->handle_blocks = NULL;
+	book->handle_slots = NULL;
+	book->n_handles = 0;
+	book->handle_slots_size = 0;
+}
+
+QofHandle
+qof_book_get_handle (QofBook * book, const GUID * guid)
+{
+	guint32 *slot, h;
+
+	g_return_val_if_fail (book, QOF_HANDLE_NONE);
+	g_return_val_if_fail (guid, QOF_HANDLE_NONE);
+	/* keep at least a quarter of the slots empty */
+	if ((book->n_handles + 1) * 4 > book->handle_slots_size * 3)
+		handle_grow (book);
+	slot = handle_find (book, guid);
+	if (*slot != QOF_HANDLE_NONE)
+		return *slot;
+	h = ++book->n_handles;
+	if ((h & (HANDLE_BLOCK - 1)) == 0 || h == 1)
+	{
+		book->handle_blocks = g_renew (GUID *, book->handle_blocks,
+			(h >> HANDLE_BLOCK_BITS) + 1);
+		book->handle_blocks[h >> HANDLE_BLOCK_BITS] =
+			g_new (GUID, HANDLE_BLOCK);
+	}
+	*handle_guid (book, h) = *guid;
+	*slot = h;
+	return h;
+}
+
+QofHandle
+qof_book_lookup_handle (QofBook * book, const GUID * guid)
+{
+	g_return_val_if_fail (book, QOF_HANDLE_NONE);
+	if (!guid || !book->n_handles)
+		return QOF_HANDLE_NONE;
+	return *handle_find (book, guid);
+}
+
+const GUID *
+qof_book_handle_to_guid (QofBook * book, QofHandle handle)
+{
+	g_return_val_if_fail (book, NULL);
+	if (handle == QOF_HANDLE_NONE || handle > book->n_handles)
+		return NULL;
+	return handle_guid (book, handle);
+}
+
 static void
 book_final (gpointer key, gpointer value, gpointer booq)
 {
@@ -98,9 +335,12 @@ book_final (gpointer key, gpointer value, gpointer booq)
 void
 qof_book_destroy (QofBook * book)
 {
+	guint i;
+
 	if (!book)
 		return;
 	ENTER ("book=%p", book);
+	qof_snapshot_book_destroyed (book);
 	book->shutting_down = TRUE;
 	qof_event_force (&book->inst.entity, QOF_EVENT_DESTROY, NULL);
 	/* Call the list of finalizers, let them do their thing. 
@@ -115,6 +355,18 @@ qof_book_destroy (QofBook * book)
 	qof_instance_release (&book->inst);
 	g_hash_table_destroy (book->hash_of_collections);
 	book->hash_of_collections = NULL;
+	for (i = 0; i < book->n_collections; i++)
+	{
+		if (book->collections[i])
+			qof_collection_destroy (book->collections[i]);
+	}
+	g_free (book->collections);
+	book->collections = NULL;
+	book->n_collections = 0;
+	/* whatever the objects did not give back goes now */
+	if (book->arena)
+		arena_destroy (book->arena);
+	handle_destroy (book);
 	g_free (book);
 	LEAVE ("book=%p", book);
 }
@@ -182,6 +434,30 @@ qof_book_kvp_changed (QofBook * book)
 	if (!book)
 		return;
 	book->inst.dirty = TRUE;
+	qof_book_mark_changed (book);
+}
+
+guint64
+qof_book_get_generation (QofBook * book)
+{
+	guint64 generation;
+
+	if (!book)
+		return 0;
+	G_LOCK (last_generation);
+	generation = book->generation;
+	G_UNLOCK (last_generation);
+	return generation;
+}
+
+void
+qof_book_mark_changed (QofBook * book)
+{
+	if (!book)
+		return;
+	G_LOCK (last_generation);
+	book->generation = ++last_generation;
+	G_UNLOCK (last_generation);
 }
 
 /* Store arbitrary pointers in the QofBook for data storage extensibility */
@@ -216,13 +492,53 @@ qof_book_get_data (QofBook * book, const gchar * key)
 	return g_hash_table_lookup (book->data_tables, (gpointer) key);
 }
 
+QofCollection *
+qof_book_get_collection_by_id (QofBook * book, gint type_id)
+{
+	QofCollection *col;
+	QofIdTypeConst type;
+	gpointer key;
+
+	g_return_val_if_fail (book, NULL);
+	if (type_id >= 0 && (guint) type_id < book->n_collections &&
+		book->collections[type_id])
+		return book->collections[type_id];
+	type = qof_object_get_type_name (type_id);
+	if (!type)
+		return NULL;
+	if ((guint) type_id >= book->n_collections)
+	{
+		book->collections = g_renew (QofCollection *, book->collections,
+			type_id + 1);
+		memset (book->collections + book->n_collections, 0,
+			(type_id + 1 - book->n_collections) * sizeof (QofCollection *));
+		book->n_collections = type_id + 1;
+	}
+	/* the book may have been given the collection before the type
+	 * was registered */
+	if (g_hash_table_lookup_extended (book->hash_of_collections, type,
+			&key, (gpointer *) & col))
+	{
+		g_hash_table_steal (book->hash_of_collections, type);
+		qof_util_string_cache_remove (key);
+	}
+	else
+		col = qof_collection_new ((QofIdType) type);
+	book->collections[type_id] = col;
+	return col;
+}
+
 QofCollection *
 qof_book_get_collection (QofBook * book, QofIdType entity_type)
 {
 	QofCollection *col;
+	gint type_id;
 
 	if (!book || !entity_type)
 		return NULL;
+	type_id = qof_object_get_type_id (entity_type);
+	if (type_id >= 0)
+		return qof_book_get_collection_by_id (book, type_id);
 	col = g_hash_table_lookup (book->hash_of_collections, entity_type);
 	if (!col)
 	{
@@ -253,9 +569,15 @@ qof_book_foreach_collection (QofBook * book,
 	QofCollectionForeachCB cb, gpointer user_data)
 {
 	struct _iterate qiter;
+	guint i;
 
 	g_return_if_fail (book);
 	g_return_if_fail (cb);
+	for (i = 0; i < book->n_collections; i++)
+	{
+		if (book->collections[i])
+			cb (book->collections[i], user_data);
+	}
 	qiter.fn = cb;
 	qiter.data = user_data;
 	g_hash_table_foreach (book->hash_of_collections, foreach_cb, &qiter);
@@ -98,6 +98,14 @@ void qof_book_mark_closed (QofBook * book);
  */
 QofCollection *qof_book_get_collection (QofBook *, QofIdType);
 
+/** Return the collection of a registered type, given the number of
+ *  the type (see ::qof_object_get_type_id).  This is an array lookup,
+ *  without hashing the name of the type.  Returns NULL if there is
+ *  no type with that number.
+ */
+QofCollection *qof_book_get_collection_by_id (QofBook * book,
+											  gint type_id);
+
 /** Invoke the indicated callback on each collection in the book. */
 typedef void (*QofCollectionForeachCB) (QofCollection *, gpointer user_data);
 void qof_book_foreach_collection (QofBook *, QofCollectionForeachCB,
@@ -158,6 +166,75 @@ void qof_book_mark_saved (QofBook * book);
  * is marked 'dirty'. */
 void qof_book_kvp_changed (QofBook * book);
 
+/** A number that moves on whenever QOF sees the book change:
+ *    when objects are added to or released from the book, marked
+ *    dirty, or when a parameter change is committed with
+ *    qof_util_param_commit().  Getting the same generation twice
+ *    means the book has not changed in between, as far as QOF can
+ *    tell.  Generations are never reused, not even by another book.
+ */
+guint64 qof_book_get_generation (QofBook * book);
+
+/** Move the generation of the book on, for changes made behind
+ *    the back of QOF. */
+void qof_book_mark_changed (QofBook * book);
+
+/** Allocate size bytes of zeroed memory that belongs to the book.
+
+Objects can use this instead of g_new0 for their instances and other
+data that lives exactly as long as the book.  Small blocks are carved
+from large chunks, so loading a book makes far fewer calls to malloc,
+and whatever is still allocated when the book is destroyed is
+released in bulk, after the objects have been told to go with
+::QofObject book_end.
+
+Memory from qof_book_alloc must not be passed to g_free, or outlive
+the book.  It must not be moved to another book: use
+::qof_entity_copy_to_session or similar instead.
+
+QOF itself only allocates the undo records of the book from it (see
+qofundo.h).  Instances belong to the objects that create them, the
+GUID is part of the instance, and KvpFrames are shared between copies
+(see kvp_frame_copy) and carried into other books by qof_book_merge,
+so any of them can outlive the book they were made in.
+
+@return NULL if size is zero.
+*/
+gpointer qof_book_alloc (QofBook * book, gsize size);
+
+/** Return memory from qof_book_alloc to the book.
+
+size must be the size that was allocated.  Freeing is optional
+while the book is shutting down (see ::qof_book_shutting_down),
+the memory goes with the book anyway.
+*/
+void qof_book_free (QofBook * book, gpointer mem, gsize size);
+
+/** A handle stands for a GUID within one book.
+
+Handles are small integers, handed out from 1 up in the order the
+GUIDs are first seen, so that a structure that refers to many
+entities can keep four bytes for each instead of a GUID, and can use
+the handle as an index into its own arrays.  A handle stays valid for
+the life of the book, even if no entity has the GUID any more, and is
+meaningless in any other book.
+*/
+typedef guint32 QofHandle;
+
+/** Not the handle of any GUID. */
+#define QOF_HANDLE_NONE 0
+
+/** The handle of a GUID in the book, making one if it has none yet. */
+QofHandle qof_book_get_handle (QofBook * book, const GUID * guid);
+
+/** The handle of a GUID in the book, or ::QOF_HANDLE_NONE if it has
+none. */
+QofHandle qof_book_lookup_handle (QofBook * book, const GUID * guid);
+
+/** The GUID a handle stands for, NULL if the handle is not one of
+the book.  The GUID belongs to the book and lives as long as it. */
+const GUID *qof_book_handle_to_guid (QofBook * book, QofHandle handle);
+
 /** The qof_book_equal() method returns TRUE if books are equal.
  * XXX this routine is broken, and does not currently compare data.
  */
@@ -241,6 +241,8 @@ qof_book_merge_compare (QofBookMergeData * mergeData)
 		}
 		if (safe_strcmp (mergeType, QOF_TYPE_KVP) == 0)
 		{
+			kvp_frame_delete (kvpImport);
+			kvp_frame_delete (kvpTarget);
 			kvpImport =
 				kvp_frame_copy (qtparam->param_getfcn (mergeEnt, qtparam));
 			kvpTarget =
@@ -311,8 +313,8 @@ qof_book_merge_compare (QofBookMergeData * mergeData)
 		paramList = g_slist_next (paramList);
 	}
 	mergeData->currentRule = currentRule;
-	g_free (kvpImport);
-	g_free (kvpTarget);
+	kvp_frame_delete (kvpImport);
+	kvp_frame_delete (kvpTarget);
 	return 0;
 }
 
@@ -44,6 +44,11 @@ Use qof_event_gen instead.
 void
 qof_event_generate (const GUID * guid, QofIdType e_type, QofEventId event_id);
 
+/* The number of events dropped while events were suspended.  A
+ * handler that keeps state up to date from events has to start
+ * again from scratch when this changes. */
+guint qof_event_get_missed (void);
+
 /* generates an event even when events are suspended! */
 void qof_event_force (QofEntity * entity, QofEventId event_id,
 					  gpointer event_data);
@@ -32,6 +32,7 @@ static guint suspend_counter = 0;
 static gint next_handler_id = 1;
 static guint handler_run_level = 0;
 static guint pending_deletes = 0;
+static guint missed_events = 0;
 static GList *handlers = NULL;
 
 /* This static indicates the debugging module that this .o belongs to.  */
@@ -238,11 +239,20 @@ qof_event_gen (QofEntity * entity, QofEventId event_id, gpointer event_data)
 		return;
 
 	if (suspend_counter)
+	{
+		missed_events++;
 		return;
+	}
 
 	qof_event_generate_internal (entity, event_id, event_data);
 }
 
+guint
+qof_event_get_missed (void)
+{
+	return missed_events;
+}
+
 /* deprecated */
 void
 qof_event_generate (const GUID * guid, QofIdType e_type, QofEventId event_id)
@@ -251,7 +261,10 @@ qof_event_generate (const GUID * guid, QofIdType e_type, QofEventId event_id)
 	ent.guid = *guid;
 	ent.e_type = e_type;
 	if (suspend_counter)
+	{
+		missed_events++;
 		return;
+	}
 	/* caution: this is an incomplete entity! */
 	qof_event_generate_internal (&ent, event_id, NULL);
 }
@@ -46,10 +46,39 @@ void qof_entity_set_guid (QofEntity * ent, const GUID * guid);
  */
 void qof_collection_insert_entity (QofCollection *, QofEntity *);
 
+/** Move the generation of the collection on and write the change
+ *  to its journal.  Adding and removing entities is noted by the
+ *  collection itself, changes to an entity are noted by the
+ *  instance code.
+ */
+void qof_collection_note_change (QofCollection * col, const GUID * guid,
+								 gint event);
+
 /** reset value of dirty flag */
 void qof_collection_mark_clean (QofCollection *);
 void qof_collection_mark_dirty (QofCollection *);
 
+/** Walk the entities of a collection one at a time, in the
+ *  order they were added.  While an iterator is open the collection
+ *  is not compacted, so entities may be added or removed between
+ *  steps: removed entities are skipped, added ones are visited.
+ *  Close the iterator with qof_collection_iter_end().
+ */
+typedef struct _QofCollectionIter
+{
+	QofCollection *col;
+	guint pos;
+} QofCollectionIter;
+
+void qof_collection_iter_init (QofCollectionIter * iter,
+							   QofCollection * col);
+
+/** Returns NULL after the last entity. */
+QofEntity *qof_collection_iter_next (QofCollectionIter * iter);
+
+/** Close the iterator; harmless if it is not open. */
+void qof_collection_iter_end (QofCollectionIter * iter);
+
 /** @} */
 /** @} */
 /** @} */
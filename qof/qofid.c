@@ -29,16 +29,62 @@
 
 #include "qof.h"
 #include "qofid-p.h"
+#include "qofindex-p.h"
 
 static QofLogModule log_module = QOF_MOD_ENGINE;
 
+/* Searching an index can build it or file pending entities, so
+ * queries running in parallel on other threads must take turns. */
+G_LOCK_DEFINE_STATIC (index_lock);
+
+/* The entities of a collection are kept in an open addressing table
+ * with the GUID itself as the key, so that a lookup is one hash of
+ * the GUID and, mostly, one compare.  Removing an entity leaves a
+ * tombstone in its slot rather than moving other entities.
+ *
+ * Walking the collection uses a second, dense array of the entities
+ * in the order they were added.  A removed entity leaves a hole in
+ * it, and the holes are squeezed out once they outnumber the
+ * entities, but never while the collection is being walked.
+ */
+typedef struct
+{
+	GUID guid;
+	QofEntity *ent;				/* NULL if the slot was never used */
+	guint pos;					/* of ent in the dense array */
+} QofIdSlot;
+
+#define ID_TABLE_MIN 16
+static const gchar id_tombstone = 0;
+#define ID_TOMBSTONE ((QofEntity *) &id_tombstone)
+#define ID_SLOT_FULL(slot) ((slot)->ent && (slot)->ent != ID_TOMBSTONE)
+
 struct QofCollection_s
 {
 	QofIdType e_type;
 	gboolean is_dirty;
 
-	GHashTable *hash_of_entities;
+	QofIdSlot *slots;
+	guint size;					/* a power of two */
+	guint count;				/* entities */
+	guint used;					/* entities and tombstones */
+
+	QofEntity **ents;			/* in order of insertion, NULL for holes */
+	guint n_ents;				/* entities and holes */
+	guint ents_size;
+	gint walking;				/* foreach calls and iterators, atomic */
+	guint layout;				/* one more each time ents is compacted */
+
+	guint64 generation;			/* one more with every change */
+	QofCollectionChange *journal;	/* ring of the latest changes */
+	guint journal_size;
+	guint journal_next;			/* where the next change goes */
+	guint journal_len;			/* changes kept */
+
 	gpointer data;				/* place where object class can hang arbitrary data */
+
+	/* parameter name -> QofIndex, built when first searched */
+	GHashTable *indexes;
 };
 
 /* =============================================================== */
@@ -111,10 +157,189 @@ qof_entity_get_guid (QofEntity * ent)
 
 /* =============================================================== */
 
+/* Mix all 128 bits: GUIDs read in from outside need not be random. */
+static guint
+id_hash (const GUID * guid)
+{
+	guint64 a, b;
+
+	memcpy (&a, guid->data, sizeof (a));
+	memcpy (&b, guid->data + sizeof (a), sizeof (b));
+	a ^= b * G_GUINT64_CONSTANT (0x9E3779B97F4A7C15);
+	a ^= a >> 32;
+	a *= G_GUINT64_CONSTANT (0xD6E8FEB86659FD93);
+	a ^= a >> 32;
+	return (guint) a;
+}
+
 static gboolean
-id_compare (gconstpointer key_1, gconstpointer key_2)
+id_equal (const GUID * guid_1, const GUID * guid_2)
+{
+	guint64 a[2], b[2];
+
+	memcpy (a, guid_1->data, sizeof (a));
+	memcpy (b, guid_2->data, sizeof (b));
+	return (a[0] == b[0]) && (a[1] == b[1]);
+}
+
+/* The slot holding the GUID, or else the slot it should go in. */
+static QofIdSlot *
+id_table_find (QofCollection * col, const GUID * guid)
+{
+	QofIdSlot *slot, *tomb = NULL;
+	guint mask = col->size - 1;
+	guint i;
+
+	for (i = id_hash (guid) & mask;; i = (i + 1) & mask)
+	{
+		slot = &col->slots[i];
+		if (!slot->ent)
+			return tomb ? tomb : slot;
+		if (slot->ent == ID_TOMBSTONE)
+		{
+			if (!tomb)
+				tomb = slot;
+		}
+		else if (id_equal (&slot->guid, guid))
+			return slot;
+	}
+}
+
+/* Make room for at least need more entities, dropping the tombstones. */
+static void
+id_table_grow (QofCollection * col, guint need)
+{
+	QofIdSlot *old, *slot;
+	guint old_size, size, i, j;
+
+	size = ID_TABLE_MIN;
+	while (size < (col->count + need) * 2)
+		size *= 2;
+	old = col->slots;
+	old_size = col->size;
+	col->slots = g_new0 (QofIdSlot, size);
+	col->size = size;
+	col->used = col->count;
+	for (i = 0; i < old_size; i++)
+	{
+		if (!ID_SLOT_FULL (&old[i]))
+			continue;
+		for (j = id_hash (&old[i].guid) & (size - 1);;
+			j = (j + 1) & (size - 1))
+		{
+			slot = &col->slots[j];
+			if (!slot->ent)
+				break;
+		}
+		*slot = old[i];
+	}
+	g_free (old);
+}
+
+/* Squeeze the holes out of the dense array. */
+static void
+id_table_compact (QofCollection * col)
+{
+	guint *moved;
+	guint i, j;
+
+	moved = g_new (guint, col->n_ents);
+	for (i = 0, j = 0; i < col->n_ents; i++)
+	{
+		moved[i] = j;
+		if (col->ents[i])
+			col->ents[j++] = col->ents[i];
+	}
+	for (i = 0; i < col->size; i++)
+	{
+		if (ID_SLOT_FULL (&col->slots[i]))
+			col->slots[i].pos = moved[col->slots[i].pos];
+	}
+	g_free (moved);
+	col->n_ents = j;
+	col->layout++;
+}
+
+/* Only called when an entity is removed: a walk that finds the
+ * table full of holes leaves them for the next writer. */
+static void
+id_table_maybe_compact (QofCollection * col)
+{
+	if (!g_atomic_int_get (&col->walking) &&
+		col->n_ents - col->count > MAX (col->count, ID_TABLE_MIN))
+		id_table_compact (col);
+}
+
+/* Replaces any entity with the same GUID, in its place. */
+static void
+id_table_insert (QofCollection * col, QofEntity * ent)
+{
+	QofIdSlot *slot;
+
+	/* keep at least a quarter of the slots empty */
+	if ((col->used + 1) * 4 > col->size * 3)
+		id_table_grow (col, 1);
+	slot = id_table_find (col, &ent->guid);
+	if (!slot->ent)
+		col->used++;
+	if (ID_SLOT_FULL (slot))
+	{
+		col->ents[slot->pos] = ent;
+		slot->ent = ent;
+		return;
+	}
+	if (col->n_ents == col->ents_size)
+	{
+		col->ents_size = MAX (col->ents_size * 2, ID_TABLE_MIN);
+		col->ents = g_renew (QofEntity *, col->ents, col->ents_size);
+	}
+	col->count++;
+	slot->guid = ent->guid;
+	slot->ent = ent;
+	slot->pos = col->n_ents;
+	col->ents[col->n_ents++] = ent;
+}
+
+/* Make room for need more entities in one go. */
+static void
+id_table_reserve (QofCollection * col, guint need)
+{
+	if ((col->used + need) * 4 > col->size * 3)
+		id_table_grow (col, need);
+	if (col->n_ents + need > col->ents_size)
+	{
+		col->ents_size = MAX (col->n_ents + need, ID_TABLE_MIN);
+		col->ents = g_renew (QofEntity *, col->ents, col->ents_size);
+	}
+}
+
+/* FALSE if there was nothing to remove. */
+static gboolean
+id_table_remove (QofCollection * col, const GUID * guid)
+{
+	QofIdSlot *slot;
+
+	if (!col->count)
+		return FALSE;
+	slot = id_table_find (col, guid);
+	if (!ID_SLOT_FULL (slot))
+		return FALSE;
+	col->ents[slot->pos] = NULL;
+	slot->ent = ID_TOMBSTONE;
+	col->count--;
+	id_table_maybe_compact (col);
+	return TRUE;
+}
+
+static QofEntity *
+id_table_lookup (QofCollection * col, const GUID * guid)
 {
-	return guid_equal (key_1, key_2);
+	QofIdSlot *slot;
+
+	if (!col->count)
+		return NULL;
+	slot = id_table_find (col, guid);
+	return ID_SLOT_FULL (slot) ? slot->ent : NULL;
 }
 
 QofCollection *
@@ -123,8 +348,11 @@ qof_collection_new (QofIdType type)
 	QofCollection *col;
 	col = g_new0 (QofCollection, 1);
 	col->e_type = CACHE_INSERT (type);
-	col->hash_of_entities = g_hash_table_new (guid_hash_to_guint, id_compare);
+	col->size = ID_TABLE_MIN;
+	col->slots = g_new0 (QofIdSlot, col->size);
 	col->data = NULL;
+	col->indexes = NULL;
+	col->journal_size = QOF_COLLECTION_JOURNAL_SIZE;
 	return col;
 }
 
@@ -132,9 +360,15 @@ void
 qof_collection_destroy (QofCollection * col)
 {
 	CACHE_REMOVE (col->e_type);
-	g_hash_table_destroy (col->hash_of_entities);
+	g_free (col->slots);
+	g_free (col->ents);
+	g_free (col->journal);
+	if (col->indexes)
+		g_hash_table_destroy (col->indexes);
+	col->indexes = NULL;
 	col->e_type = NULL;
-	col->hash_of_entities = NULL;
+	col->slots = NULL;
+	col->ents = NULL;
 	col->data = NULL; /** XXX there should be a destroy notifier for this */
 	g_free (col);
 }
@@ -150,6 +384,34 @@ qof_collection_get_type (QofCollection * col)
 
 /* =============================================================== */
 
+static void
+index_insert_cb (gpointer key __attribute__ ((unused)), gpointer value,
+	gpointer user_data)
+{
+	qof_index_insert (value, user_data);
+}
+
+static void
+index_remove_cb (gpointer key __attribute__ ((unused)), gpointer value,
+	gpointer user_data)
+{
+	qof_index_remove (value, user_data);
+}
+
+static void
+collection_index_insert (QofCollection * col, QofEntity * ent)
+{
+	if (col->indexes)
+		g_hash_table_foreach (col->indexes, index_insert_cb, ent);
+}
+
+static void
+collection_index_remove (QofCollection * col, QofEntity * ent)
+{
+	if (col->indexes)
+		g_hash_table_foreach (col->indexes, index_remove_cb, ent);
+}
+
 static void
 qof_collection_remove_entity (QofEntity * ent)
 {
@@ -159,7 +421,9 @@ qof_collection_remove_entity (QofEntity * ent)
 	col = ent->collection;
 	if (!col)
 		return;
-	g_hash_table_remove (col->hash_of_entities, &ent->guid);
+	if (id_table_remove (col, &ent->guid))
+		qof_collection_note_change (col, &ent->guid, QOF_EVENT_REMOVE);
+	collection_index_remove (col, ent);
 	qof_collection_mark_dirty (col);
 	ent->collection = NULL;
 }
@@ -173,8 +437,10 @@ qof_collection_insert_entity (QofCollection * col, QofEntity * ent)
 		return;
 	g_return_if_fail (col->e_type == ent->e_type);
 	qof_collection_remove_entity (ent);
-	g_hash_table_insert (col->hash_of_entities, &ent->guid, ent);
+	id_table_insert (col, ent);
+	collection_index_insert (col, ent);
 	qof_collection_mark_dirty (col);
+	qof_collection_note_change (col, &ent->guid, QOF_EVENT_ADD);
 	ent->collection = col;
 }
 
@@ -198,74 +464,154 @@ qof_collection_add_entity (QofCollection * coll, QofEntity * ent)
 	{
 		return FALSE;
 	}
-	g_hash_table_insert (coll->hash_of_entities, &ent->guid, ent);
+	id_table_insert (coll, ent);
+	collection_index_insert (coll, ent);
 	qof_collection_mark_dirty (coll);
+	qof_collection_note_change (coll, &ent->guid, QOF_EVENT_ADD);
 	return TRUE;
 }
 
+/* The set operations below walk the dense array of one collection
+ * and probe the table of the other directly, rather than going
+ * through a callback and the public lookup for every entity. */
+
+/* Add entities known not to be in the collection yet. */
 static void
-collection_merge_cb (QofEntity * ent, gpointer data)
+collection_add_new (QofCollection * col, QofEntity ** ents, guint n)
 {
-	QofCollection *target;
+	guint i;
 
-	target = (QofCollection *) data;
-	qof_collection_add_entity (target, ent);
+	if (!n)
+		return;
+	id_table_reserve (col, n);
+	for (i = 0; i < n; i++)
+	{
+		id_table_insert (col, ents[i]);
+		collection_index_insert (col, ents[i]);
+		qof_collection_note_change (col, &ents[i]->guid, QOF_EVENT_ADD);
+	}
+	qof_collection_mark_dirty (col);
 }
 
-gboolean
-qof_collection_merge (QofCollection * target, QofCollection * merge)
+/* Collections smaller than this are probed in the calling thread,
+ * and no thread gets less than a chunk of this size, as for the
+ * scans of qof_query_run. */
+#define PROBE_PARALLEL_MIN 4096
+#define PROBE_CHUNK_MIN    1024
+
+/* A stretch of the dense array of one collection, probed against
+ * the GUID table of another.  Probing only reads both tables, and
+ * each chunk writes to its own stretch of the found array. */
+typedef struct
 {
-	if (!target || !merge)
+	QofEntity **ents;
+	guint len;
+	QofCollection *other;
+	gboolean in_other;
+	QofEntity **found;
+	guint n_found;
+} QofProbeChunk;
+
+static void
+probe_chunk (gpointer data, gpointer user_data __attribute__ ((unused)))
+{
+	QofProbeChunk *chunk = data;
+	QofEntity *ent;
+	guint i;
+
+	for (i = 0; i < chunk->len; i++)
 	{
-		return FALSE;
+		ent = chunk->ents[i];
+		if (ent && (id_table_lookup (chunk->other, &ent->guid) != NULL) ==
+			chunk->in_other)
+			chunk->found[chunk->n_found++] = ent;
 	}
-	g_return_val_if_fail (target->e_type == merge->e_type, FALSE);
-	qof_collection_foreach (merge, collection_merge_cb, target);
-	return TRUE;
 }
 
-static void
-collection_compare_cb (QofEntity * ent, gpointer user_data)
+/* Gather the entities of col that are (or are not) in other, in the
+ * order of col.  Large collections are shared out to as many threads
+ * as qof_query_set_max_threads allows. */
+static QofEntity **
+collection_probe (QofCollection * col, QofCollection * other,
+	gboolean in_other, guint * n_found)
 {
-	QofCollection *target;
-	QofEntity *e;
-	gint value;
-
-	e = NULL;
-	target = (QofCollection *) user_data;
-	if (!target || !ent)
+	QofProbeChunk *chunks;
+	QofEntity **found;
+	GThreadPool *pool;
+	GError *error = NULL;
+	guint size, n_chunks, i, n;
+	gint threads;
+
+	found = g_new (QofEntity *, col->n_ents + 1);
+	threads = qof_query_get_max_threads ();
+	if (threads < 2 || col->count < PROBE_PARALLEL_MIN)
+		size = MAX (col->n_ents, 1);
+	else
+		size = MAX (col->n_ents / (threads * 4), PROBE_CHUNK_MIN);
+	n_chunks = (col->n_ents + size - 1) / size;
+	pool = NULL;
+	if (n_chunks > 1)
 	{
-		return;
+		PINFO ("probing %d entities in %d chunks", col->n_ents, n_chunks);
+		pool = g_thread_pool_new (probe_chunk, NULL, threads, FALSE, &error);
+		if (!pool)
+		{
+			PWARN ("no thread pool: %s", error->message);
+			g_error_free (error);
+		}
 	}
-	value = *(gint *) qof_collection_get_data (target);
-	if (value != 0)
+	chunks = g_new0 (QofProbeChunk, n_chunks);
+	for (i = 0; i < n_chunks; i++)
 	{
-		return;
+		chunks[i].ents = col->ents + i * size;
+		chunks[i].len = MIN (size, col->n_ents - i * size);
+		chunks[i].other = other;
+		chunks[i].in_other = in_other;
+		chunks[i].found = found + i * size;
+		if (pool)
+			g_thread_pool_push (pool, &chunks[i], NULL);
+		else
+			probe_chunk (&chunks[i], NULL);
 	}
-	if (guid_equal (&ent->guid, guid_null ()))
+	/* wait for the pool to finish all chunks */
+	if (pool)
+		g_thread_pool_free (pool, FALSE, TRUE);
+
+	/* close up the gaps between the chunks */
+	for (i = 0, n = 0; i < n_chunks; i++)
 	{
-		value = -1;
-		qof_collection_set_data (target, &value);
-		return;
+		if (chunks[i].found != found + n)
+			memmove (found + n, chunks[i].found,
+				chunks[i].n_found * sizeof (QofEntity *));
+		n += chunks[i].n_found;
 	}
-	g_return_if_fail (target->e_type == ent->e_type);
-	e = qof_collection_lookup_entity (target, &ent->guid);
-	if (e == NULL)
+	g_free (chunks);
+	*n_found = n;
+	return found;
+}
+
+gboolean
+qof_collection_merge (QofCollection * target, QofCollection * merge)
+{
+	QofEntity **ents;
+	guint n;
+
+	if (!target || !merge)
 	{
-		value = 1;
-		qof_collection_set_data (target, &value);
-		return;
+		return FALSE;
 	}
-	value = 0;
-	qof_collection_set_data (target, &value);
+	g_return_val_if_fail (target->e_type == merge->e_type, FALSE);
+	if (target == merge)
+		return TRUE;
+	ents = collection_probe (merge, target, FALSE, &n);
+	collection_add_new (target, ents, n);
+	g_free (ents);
+	return TRUE;
 }
 
 gint
 qof_collection_compare (QofCollection * target, QofCollection * merge)
 {
-	gint value;
-
-	value = 0;
 	if (!target && !merge)
 		return 0;
 	if (target == merge)
@@ -276,16 +622,82 @@ qof_collection_compare (QofCollection * target, QofCollection * merge)
 		return 1;
 	if (target->e_type != merge->e_type)
 		return -1;
-	qof_collection_set_data (target, &value);
-	qof_collection_foreach (merge, collection_compare_cb, target);
-	value = *(gint *) qof_collection_get_data (target);
-	if (value == 0)
+	/* a null GUID never gets into a collection */
+	return qof_collection_equal (target, merge) ? 0 : 1;
+}
+
+gboolean
+qof_collection_equal (QofCollection * a, QofCollection * b)
+{
+	guint i;
+
+	g_return_val_if_fail (a && b, FALSE);
+	if (a == b)
+		return TRUE;
+	if (a->e_type != b->e_type || a->count != b->count)
+		return FALSE;
+	/* same count, so a within b means the same set */
+	if (qof_query_get_max_threads () > 1 && a->count >= PROBE_PARALLEL_MIN)
+	{
+		QofEntity **ents;
+		guint n;
+
+		ents = collection_probe (a, b, FALSE, &n);
+		g_free (ents);
+		return (n == 0);
+	}
+	for (i = 0; i < a->n_ents; i++)
 	{
-		qof_collection_set_data (merge, &value);
-		qof_collection_foreach (target, collection_compare_cb, merge);
-		value = *(gint *) qof_collection_get_data (merge);
+		if (a->ents[i] && !id_table_lookup (b, &a->ents[i]->guid))
+			return FALSE;
 	}
-	return value;
+	return TRUE;
+}
+
+QofCollection *
+qof_collection_union (QofCollection * a, QofCollection * b)
+{
+	QofCollection *col;
+	QofEntity **ents;
+	guint n;
+
+	g_return_val_if_fail (a && b, NULL);
+	g_return_val_if_fail (a->e_type == b->e_type, NULL);
+	col = qof_collection_new (a->e_type);
+	ents = collection_probe (a, col, FALSE, &n);
+	collection_add_new (col, ents, n);
+	g_free (ents);
+	if (b != a)
+		qof_collection_merge (col, b);
+	return col;
+}
+
+static QofCollection *
+collection_select (QofCollection * a, QofCollection * b, gboolean in_b)
+{
+	QofCollection *col;
+	QofEntity **ents;
+	guint n;
+
+	g_return_val_if_fail (a && b, NULL);
+	g_return_val_if_fail (a->e_type == b->e_type, NULL);
+	col = qof_collection_new (a->e_type);
+	ents = collection_probe (a, b, in_b, &n);
+	collection_add_new (col, ents, n);
+	g_free (ents);
+	return col;
+}
+
+QofCollection *
+qof_collection_intersection (QofCollection * a, QofCollection * b)
+{
+	return collection_select (a, b, TRUE);
+}
+
+QofCollection *
+qof_collection_difference (QofCollection * a, QofCollection * b)
+{
+	return collection_select (a, b, FALSE);
 }
 
 QofEntity *
@@ -295,7 +707,7 @@ qof_collection_lookup_entity (QofCollection * col, const GUID * guid)
 	g_return_val_if_fail (col, NULL);
 	if (guid == NULL)
 		return NULL;
-	ent = g_hash_table_lookup (col->hash_of_entities, guid);
+	ent = id_table_lookup (col, guid);
 	return ent;
 }
 
@@ -323,7 +735,7 @@ qof_collection_count (QofCollection * col)
 {
 	guint c;
 
-	c = g_hash_table_size (col->hash_of_entities);
+	c = col->count;
 	return c;
 }
 
@@ -355,6 +767,73 @@ qof_collection_mark_dirty (QofCollection * col)
 
 /* =============================================================== */
 
+void
+qof_collection_note_change (QofCollection * col, const GUID * guid,
+	gint event)
+{
+	QofCollectionChange *change;
+
+	if (!col)
+		return;
+	col->generation++;
+	if (!col->journal_size)
+		return;
+	if (!col->journal)
+		col->journal = g_new (QofCollectionChange, col->journal_size);
+	change = &col->journal[col->journal_next];
+	change->guid = *guid;
+	change->event = event;
+	change->generation = col->generation;
+	col->journal_next = (col->journal_next + 1) % col->journal_size;
+	if (col->journal_len < col->journal_size)
+		col->journal_len++;
+}
+
+guint64
+qof_collection_get_generation (QofCollection * col)
+{
+	g_return_val_if_fail (col, 0);
+	return col->generation;
+}
+
+gboolean
+qof_collection_changes_since (QofCollection * col, guint64 generation,
+	QofCollectionChangeCB cb, gpointer user_data)
+{
+	guint64 oldest;
+	guint i, pos;
+
+	g_return_val_if_fail (col, FALSE);
+	g_return_val_if_fail (cb, FALSE);
+	if (generation >= col->generation)
+		return TRUE;
+	/* every generation has one change, the latest journal_len are kept */
+	oldest = col->generation - col->journal_len + 1;
+	if (generation + 1 < oldest)
+		return FALSE;
+	pos = (col->journal_next + col->journal_size - col->journal_len +
+		(guint) (generation + 1 - oldest)) % col->journal_size;
+	for (i = 0; i < col->generation - generation; i++)
+	{
+		cb (&col->journal[pos], user_data);
+		pos = (pos + 1) % col->journal_size;
+	}
+	return TRUE;
+}
+
+void
+qof_collection_set_journal_size (QofCollection * col, guint size)
+{
+	g_return_if_fail (col);
+	g_free (col->journal);
+	col->journal = NULL;
+	col->journal_size = size;
+	col->journal_next = 0;
+	col->journal_len = 0;
+}
+
+/* =============================================================== */
+
 gpointer
 qof_collection_get_data (QofCollection * col)
 {
@@ -372,35 +851,166 @@ qof_collection_set_data (QofCollection * col, gpointer user_data)
 
 /* =============================================================== */
 
-struct _iterate
+void
+qof_collection_foreach (QofCollection * col, QofEntityForeachCB cb_func,
+	gpointer user_data)
 {
-	QofEntityForeachCB fcn;
-	gpointer data;
-};
+	guint i, n;
 
-static void
-foreach_cb (gpointer key __attribute__ ((unused)), gpointer item, 
-			gpointer arg)
+	g_return_if_fail (col);
+	g_return_if_fail (cb_func);
+
+	/* The callback may remove entities, which only leaves holes, or
+	 * add them, at the end where they are not visited.  Walks on
+	 * other threads only read the table, so none of them compacts
+	 * it. */
+	g_atomic_int_inc (&col->walking);
+	n = col->n_ents;
+	for (i = 0; i < n; i++)
+	{
+		if (col->ents[i])
+			cb_func (col->ents[i], user_data);
+	}
+	g_atomic_int_dec_and_test (&col->walking);
+}
+
+guint
+qof_collection_get_chunk (QofCollection * col, guint * pos,
+	QofEntity ** ents, guint max)
 {
-	struct _iterate *qiter = arg;
-	QofEntity *ent = item;
+	guint n;
+
+	g_return_val_if_fail (col, 0);
+	g_return_val_if_fail (pos, 0);
+	g_return_val_if_fail (ents || max == 0, 0);
+	for (n = 0; n < max && *pos < col->n_ents; (*pos)++)
+	{
+		if (col->ents[*pos])
+			ents[n++] = col->ents[*pos];
+	}
+	return n;
+}
 
-	qiter->fcn (ent, qiter->data);
+guint
+qof_collection_get_layout (QofCollection * col)
+{
+	g_return_val_if_fail (col, 0);
+	return col->layout;
 }
 
 void
-qof_collection_foreach (QofCollection * col, QofEntityForeachCB cb_func,
-	gpointer user_data)
+qof_collection_iter_init (QofCollectionIter * iter, QofCollection * col)
 {
-	struct _iterate qiter;
-
+	g_return_if_fail (iter);
 	g_return_if_fail (col);
-	g_return_if_fail (cb_func);
+	/* counted with the foreach calls, so removals only leave holes */
+	g_atomic_int_inc (&col->walking);
+	iter->col = col;
+	iter->pos = 0;
+}
+
+QofEntity *
+qof_collection_iter_next (QofCollectionIter * iter)
+{
+	QofCollection *col;
+
+	g_return_val_if_fail (iter, NULL);
+	col = iter->col;
+	if (!col)
+		return NULL;
+	while (iter->pos < col->n_ents)
+	{
+		QofEntity *ent = col->ents[iter->pos++];
+
+		if (ent)
+			return ent;
+	}
+	return NULL;
+}
 
-	qiter.fcn = cb_func;
-	qiter.data = user_data;
+void
+qof_collection_iter_end (QofCollectionIter * iter)
+{
+	g_return_if_fail (iter);
+	if (!iter->col)
+		return;
+	g_atomic_int_dec_and_test (&iter->col->walking);
+	iter->col = NULL;
+}
 
-	g_hash_table_foreach (col->hash_of_entities, foreach_cb, &qiter);
+/* =============================================================== */
+
+static void
+index_fill_cb (QofEntity * ent, gpointer arg)
+{
+	qof_index_insert (arg, ent);
+}
+
+QofIndex *
+qof_collection_get_index (QofCollection * col, const gchar * param_name)
+{
+	QofIndex *idx;
+
+	g_return_val_if_fail (col, NULL);
+	g_return_val_if_fail (param_name, NULL);
+
+	G_LOCK (index_lock);
+	idx = col->indexes ? g_hash_table_lookup (col->indexes, param_name) :
+		NULL;
+	if (!qof_index_exists (col->e_type, param_name))
+	{
+		/* the index has been dropped since it was built */
+		if (idx)
+			g_hash_table_remove (col->indexes, param_name);
+		G_UNLOCK (index_lock);
+		return NULL;
+	}
+	if (!idx)
+	{
+		idx = qof_index_new (col->e_type, param_name);
+		if (!idx)
+		{
+			G_UNLOCK (index_lock);
+			return NULL;
+		}
+		if (!col->indexes)
+			col->indexes = g_hash_table_new_full (g_str_hash, g_str_equal,
+				NULL, (GDestroyNotify) qof_index_free);
+		g_hash_table_insert (col->indexes,
+			(gchar *) qof_index_get_param (idx)->param_name, idx);
+		qof_collection_foreach (col, index_fill_cb, idx);
+	}
+	qof_index_flush (idx);
+	G_UNLOCK (index_lock);
+	return idx;
+}
+
+gboolean
+qof_collection_index_range (QofCollection * col, const gchar * param_name,
+	gconstpointer lower, gboolean lower_inclusive,
+	gconstpointer upper, gboolean upper_inclusive,
+	QofEntityForeachCB cb, gpointer user_data)
+{
+	QofIndex *idx;
+
+	g_return_val_if_fail (col, FALSE);
+	g_return_val_if_fail (param_name, FALSE);
+	g_return_val_if_fail (cb, FALSE);
+
+	idx = qof_collection_get_index (col, param_name);
+	if (!idx)
+		return FALSE;
+	qof_index_range (idx, lower, lower_inclusive, upper, upper_inclusive,
+		cb, user_data);
+	return TRUE;
+}
+
+void
+qof_collection_reindex_entity (QofEntity * ent)
+{
+	if (!ent || !ent->collection)
+		return;
+	collection_index_insert (ent->collection, ent);
 }
 
 /* =============================================================== */
@@ -186,11 +186,43 @@ qof_collection_lookup_entity (QofCollection *, const GUID *);
 /** Callback type for qof_entity_foreach */
 typedef void (*QofEntityForeachCB) (QofEntity *, gpointer user_data);
 
-/** Call the callback for each entity in the collection. */
+/** Call the callback for each entity in the collection, in the
+ * order the entities were added to it.
+ *
+ * The callback may remove entities from the collection: those not
+ * yet visited are skipped.  Entities added by the callback are not
+ * visited.
+ */
 void 
 qof_collection_foreach (QofCollection *, QofEntityForeachCB,
 						gpointer user_data);
 
+/** Copy the next entities of the collection into an array.
+
+Walks the collection in the same order as qof_collection_foreach,
+up to max entities at a time, without allocating anything.  Set
+*pos to 0 to start and pass it back unchanged to get the next
+chunk.
+
+Entities may be added or removed between chunks, but enough
+removals squeeze the holes out of the collection and renumber the
+positions.  A walk that lets the collection change should keep the
+value of qof_collection_get_layout() from when it started and
+compare it before each chunk: if it has moved on, *pos is stale and
+the walk has to start again from 0.
+
+@return The number of entities copied into ents, 0 at the end.
+*/
+guint
+qof_collection_get_chunk (QofCollection * col, guint * pos,
+						  QofEntity ** ents, guint max);
+
+/** A number that changes whenever the positions used by
+qof_collection_get_chunk() are renumbered.  It does not change
+while a qof_collection_foreach() is running. */
+guint
+qof_collection_get_layout (QofCollection * col);
+
 /** Store arbitrary object-defined data 
  *
  * XXX We need to add a callback for when the collection is being
@@ -204,6 +236,54 @@ qof_collection_get_data (QofCollection * col);
 void 
 qof_collection_set_data (QofCollection * col, gpointer user_data);
 
+/** @name Changes to a collection
+
+Each change to a collection moves its generation on by one, and the
+latest changes are kept in a journal, so that a backend, cache or
+query can find what changed since it last looked without walking the
+collection.  The changes are the entities added to and removed from
+the collection (::QOF_EVENT_ADD, ::QOF_EVENT_REMOVE) and the
+entities that were marked dirty or had a parameter change committed
+(::QOF_EVENT_MODIFY).
+ @{ */
+
+/** The number of changes a collection keeps in its journal, unless
+ * set otherwise with qof_collection_set_journal_size(). */
+#define QOF_COLLECTION_JOURNAL_SIZE 256
+
+/** One change in the journal of a collection. */
+typedef struct
+{
+	GUID guid;
+	gint event;					/* a QofEventId */
+	guint64 generation;
+} QofCollectionChange;
+
+typedef void (*QofCollectionChangeCB) (const QofCollectionChange * change,
+									   gpointer user_data);
+
+/** The number of changes made to the collection since it was
+ * created. */
+guint64 qof_collection_get_generation (QofCollection * col);
+
+/** Call the callback for each change made after the given
+ * generation, oldest first.  The collection must not change while
+ * this runs.
+
+@return TRUE if all the changes were still in the journal, FALSE if
+some of them have been dropped, in which case the callback is not
+called and the caller must walk the collection instead.
+*/
+gboolean
+qof_collection_changes_since (QofCollection * col, guint64 generation,
+							  QofCollectionChangeCB cb, gpointer user_data);
+
+/** Keep the latest size changes in the journal.  The changes
+ * already kept are dropped.  A size of 0 keeps no journal at all. */
+void qof_collection_set_journal_size (QofCollection * col, guint size);
+
+/** @} */
+
 /** Return value of 'dirty' flag on collection */
 gboolean 
 qof_collection_is_dirty (QofCollection * col);
@@ -258,6 +338,38 @@ not in the other.
 gint 
 qof_collection_compare (QofCollection * target, QofCollection * merge);
 
+/** \brief Do two collections hold the same entities?
+
+Entities are matched by GUID.  Unlike ::qof_collection_compare,
+this is a plain yes or no, for any two collections.
+*/
+gboolean
+qof_collection_equal (QofCollection * a, QofCollection * b);
+
+/** \brief The entities of either of two collections of the same type.
+
+The result is a new secondary collection: the entities stay in their
+own collections.  Entities of a come first, in their order, followed
+by those only in b.  The caller must destroy the result with
+::qof_collection_destroy.
+
+The GUIDs of large collections are looked up in the other collection
+from as many threads as ::qof_query_set_max_threads allows.  Neither
+collection may change until the result is back.
+*/
+QofCollection *
+qof_collection_union (QofCollection * a, QofCollection * b);
+
+/** \brief The entities of a whose GUID is also in b, as a new
+secondary collection, see ::qof_collection_union. */
+QofCollection *
+qof_collection_intersection (QofCollection * a, QofCollection * b);
+
+/** \brief The entities of a whose GUID is not in b, as a new
+secondary collection, see ::qof_collection_union. */
+QofCollection *
+qof_collection_difference (QofCollection * a, QofCollection * b);
+
 /** \brief Create a secondary collection from a GList
 
 @param type The QofIdType of the QofCollection \b and of 
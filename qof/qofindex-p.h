@@ -0,0 +1,74 @@
+/********************************************************************
+ * qofindex-p.h -- private interface to parameter indexes           *
+ *                                                                  *
+ * This program is free software; you can redistribute it and/or    *
+ * modify it under the terms of the GNU General Public License as   *
+ * published by the Free Software Foundation; either version 2 of   *
+ * the License, or (at your option) any later version.              *
+ *                                                                  *
+ * This program is distributed in the hope that it will be useful,  *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of   *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the    *
+ * GNU General Public License for more details.                     *
+ *                                                                  *
+ * You should have received a copy of the GNU General Public License*
+ * along with this program; if not, contact:                        *
+ *                                                                  *
+ * Free Software Foundation           Voice:  +1-617-542-5942       *
+ * 51 Franklin Street, Fifth Floor    Fax:    +1-617-542-2652       *
+ * Boston, MA  02110-1301,  USA       gnu@gnu.org                   *
+ *                                                                  *
+ ********************************************************************/
+
+#ifndef QOF_INDEX_P_H
+#define QOF_INDEX_P_H
+
+#include "qofindex.h"
+#include "qofclass.h"
+
+/* The index of one parameter in one collection. */
+typedef struct _QofIndex QofIndex;
+
+/* Create an empty index for a declared parameter, NULL if
+ * no index is declared for it. */
+QofIndex *qof_index_new (QofIdTypeConst type, const gchar * param_name);
+void qof_index_free (QofIndex * idx);
+
+/* The parameter the index was declared on. */
+const QofParam *qof_index_get_param (QofIndex * idx);
+
+/* File (or refile) an entity.  The value is only read when the
+ * index is next searched, so this is cheap to call for entities
+ * that are still being set up. */
+void qof_index_insert (QofIndex * idx, QofEntity * ent);
+void qof_index_remove (QofIndex * idx, QofEntity * ent);
+
+/* File the pending entities.  Must be called before searching. */
+void qof_index_flush (QofIndex * idx);
+
+void qof_index_range (QofIndex * idx,
+					  gconstpointer lower, gboolean lower_inclusive,
+					  gconstpointer upper, gboolean upper_inclusive,
+					  QofEntityForeachCB cb, gpointer user_data);
+
+/* Step through the index in order of value, from the lowest or the
+ * highest.  *pos is NULL to start with; returns NULL after the last
+ * entity.  Entities may be filed or removed between steps as long as
+ * the walk is bracketed by qof_index_walk_begin and _end. */
+QofEntity *qof_index_step (QofIndex * idx, gpointer * pos,
+						   gboolean increasing);
+
+/* While any walk is open, removed entities are only marked, so
+ * that no *pos is left pointing at a freed node. */
+void qof_index_walk_begin (QofIndex * idx);
+void qof_index_walk_end (QofIndex * idx);
+
+/* The index of a collection, built and up to date, or NULL if no
+ * index is declared for the parameter. */
+QofIndex *qof_collection_get_index (QofCollection * col,
+									const gchar * param_name);
+
+/* Release the table of declared indexes. */
+void qof_index_shutdown (void);
+
+#endif
@@ -0,0 +1,507 @@
+/***************************************************************************
+ *            qofindex.c
+ ****************************************************************************/
+/*
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
+ */
+
+#include "config.h"
+
+#include <string.h>
+#include <glib.h>
+
+#include "qof.h"
+#include "qofindex-p.h"
+
+static QofLogModule log_module = QOF_MOD_INDEX;
+
+/* object type -> (parameter name -> QofParam) */
+static GHashTable *indexTable = NULL;
+
+typedef enum
+{
+	INDEX_NONE = 0,
+	INDEX_INT32,
+	INDEX_INT64,
+	INDEX_BOOLEAN,
+	INDEX_DOUBLE,
+	INDEX_NUMERIC,
+	INDEX_TIME,
+	INDEX_GUID,
+} QofIndexType;
+
+/* The value is copied out of the entity when it is filed, so the
+ * order of the sequence cannot be upset by a change to the entity
+ * that has not been committed yet. */
+typedef union
+{
+	gint64 i;
+	double d;
+	QofNumeric n;
+	struct
+	{
+		QofTimeSecs secs;
+		glong nsecs;
+	} t;
+	GUID g;
+} QofIndexKey;
+
+typedef struct
+{
+	QofIndexKey key;
+	QofEntity *ent;
+	/* Only set in search probes: -1 sorts the probe before all
+	 * entries with an equal key, +1 after them. */
+	gint bias;
+	/* Removed while the index was being walked, see qof_index_remove */
+	gboolean dead;
+} QofIndexNode;
+
+struct _QofIndex
+{
+	const QofParam *param;
+	QofIndexType type;
+	GSequence *seq;				/* QofIndexNode, in order of value */
+	GHashTable *nodes;			/* QofEntity -> GSequenceIter */
+	GHashTable *pending;		/* entities waiting to be filed */
+	guint walking;				/* cursors stepping through seq */
+	GSList *dead;				/* GSequenceIters to remove after them */
+};
+
+typedef gint32 (*index_int32_getter) (gpointer, QofParam *);
+typedef gint64 (*index_int64_getter) (gpointer, QofParam *);
+typedef gboolean (*index_boolean_getter) (gpointer, QofParam *);
+typedef double (*index_double_getter) (gpointer, QofParam *);
+typedef QofNumeric (*index_numeric_getter) (gpointer, QofParam *);
+typedef QofTime *(*index_time_getter) (gpointer, QofParam *);
+typedef const GUID *(*index_guid_getter) (gpointer, QofParam *);
+
+static QofIndexType
+index_type_of (const QofParam * param)
+{
+	const gchar *type = param->param_type;
+
+	if (!safe_strcmp (type, QOF_TYPE_INT32))
+		return INDEX_INT32;
+	if (!safe_strcmp (type, QOF_TYPE_INT64))
+		return INDEX_INT64;
+	if (!safe_strcmp (type, QOF_TYPE_BOOLEAN))
+		return INDEX_BOOLEAN;
+	if (!safe_strcmp (type, QOF_TYPE_DOUBLE))
+		return INDEX_DOUBLE;
+	if (!safe_strcmp (type, QOF_TYPE_NUMERIC))
+		return INDEX_NUMERIC;
+	if (!safe_strcmp (type, QOF_TYPE_TIME))
+		return INDEX_TIME;
+	if (!safe_strcmp (type, QOF_TYPE_GUID))
+		return INDEX_GUID;
+	return INDEX_NONE;
+}
+
+static void
+index_time_key (const QofTime * qt, QofIndexKey * key)
+{
+	/* an entity without a time sorts first */
+	if (!qt)
+	{
+		key->t.secs = G_MININT64;
+		key->t.nsecs = 0;
+		return;
+	}
+	key->t.secs = qof_time_get_secs (qt);
+	key->t.nsecs = qof_time_get_nanosecs (qt);
+}
+
+/* read the key from the entity */
+static void
+index_entity_key (QofIndex * idx, QofEntity * ent, QofIndexKey * key)
+{
+	QofParam *param = (QofParam *) idx->param;
+	const GUID *guid;
+
+	memset (key, 0, sizeof (QofIndexKey));
+	switch (idx->type)
+	{
+	case INDEX_INT32:
+		key->i = ((index_int32_getter) param->param_getfcn) (ent, param);
+		break;
+	case INDEX_INT64:
+		key->i = ((index_int64_getter) param->param_getfcn) (ent, param);
+		break;
+	case INDEX_BOOLEAN:
+		key->i = ((index_boolean_getter) param->param_getfcn) (ent,
+			param) ? 1 : 0;
+		break;
+	case INDEX_DOUBLE:
+		key->d = ((index_double_getter) param->param_getfcn) (ent, param);
+		break;
+	case INDEX_NUMERIC:
+		key->n = qof_numeric_abs (((index_numeric_getter)
+				param->param_getfcn) (ent, param));
+		break;
+	case INDEX_TIME:
+		index_time_key (((index_time_getter) param->param_getfcn) (ent,
+				param), key);
+		break;
+	case INDEX_GUID:
+		guid = ((index_guid_getter) param->param_getfcn) (ent, param);
+		key->g = guid ? *guid : *guid_null ();
+		break;
+	default:
+		break;
+	}
+}
+
+/* convert a bound passed by the caller into a key */
+static void
+index_value_key (QofIndex * idx, gconstpointer value, QofIndexKey * key)
+{
+	memset (key, 0, sizeof (QofIndexKey));
+	switch (idx->type)
+	{
+	case INDEX_INT32:
+		key->i = *(const gint32 *) value;
+		break;
+	case INDEX_INT64:
+		key->i = *(const gint64 *) value;
+		break;
+	case INDEX_BOOLEAN:
+		key->i = *(const gboolean *) value ? 1 : 0;
+		break;
+	case INDEX_DOUBLE:
+		key->d = *(const double *) value;
+		break;
+	case INDEX_NUMERIC:
+		key->n = *(const QofNumeric *) value;
+		break;
+	case INDEX_TIME:
+		index_time_key ((const QofTime *) value, key);
+		break;
+	case INDEX_GUID:
+		key->g = *(const GUID *) value;
+		break;
+	default:
+		break;
+	}
+}
+
+static gint
+index_key_cmp (QofIndexType type, const QofIndexKey * a,
+	const QofIndexKey * b)
+{
+	switch (type)
+	{
+	case INDEX_INT32:
+	case INDEX_INT64:
+	case INDEX_BOOLEAN:
+		return (a->i < b->i) ? -1 : (a->i > b->i);
+	case INDEX_DOUBLE:
+		return (a->d < b->d) ? -1 : (a->d > b->d);
+	case INDEX_NUMERIC:
+		return qof_numeric_compare (a->n, b->n);
+	case INDEX_TIME:
+		if (a->t.secs != b->t.secs)
+			return (a->t.secs < b->t.secs) ? -1 : 1;
+		return (a->t.nsecs < b->t.nsecs) ? -1 : (a->t.nsecs > b->t.nsecs);
+	case INDEX_GUID:
+		return memcmp (a->g.data, b->g.data, GUID_DATA_SIZE);
+	default:
+		return 0;
+	}
+}
+
+static gint
+index_node_cmp (gconstpointer a, gconstpointer b, gpointer user_data)
+{
+	const QofIndexNode *na = a, *nb = b;
+	QofIndex *idx = user_data;
+	gint result;
+
+	result = index_key_cmp (idx->type, &na->key, &nb->key);
+	if (result != 0)
+		return result;
+	if (na->bias || nb->bias)
+		return na->bias - nb->bias;
+	/* equal values are kept in a stable, arbitrary order */
+	if (na->ent == nb->ent)
+		return 0;
+	return (na->ent < nb->ent) ? -1 : 1;
+}
+
+static gboolean
+index_file_cb (gpointer key, gpointer value __attribute__ ((unused)),
+	gpointer user_data)
+{
+	QofIndex *idx = user_data;
+	QofIndexNode *node;
+	GSequenceIter *iter;
+
+	node = g_new0 (QofIndexNode, 1);
+	node->ent = key;
+	index_entity_key (idx, node->ent, &node->key);
+	iter = g_sequence_insert_sorted (idx->seq, node, index_node_cmp, idx);
+	g_hash_table_insert (idx->nodes, node->ent, iter);
+	return TRUE;
+}
+
+void
+qof_index_flush (QofIndex * idx)
+{
+	if (g_hash_table_size (idx->pending) == 0)
+		return;
+	PINFO ("filing %d entities under %s",
+		g_hash_table_size (idx->pending), idx->param->param_name);
+	g_hash_table_foreach_remove (idx->pending, index_file_cb, idx);
+}
+
+/* ================================================================ */
+
+QofIndex *
+qof_index_new (QofIdTypeConst type, const gchar * param_name)
+{
+	const QofParam *param;
+	GHashTable *ht;
+	QofIndex *idx;
+
+	if (!indexTable || !type || !param_name)
+		return NULL;
+	ht = g_hash_table_lookup (indexTable, type);
+	if (!ht)
+		return NULL;
+	param = g_hash_table_lookup (ht, param_name);
+	if (!param)
+		return NULL;
+
+	idx = g_new0 (QofIndex, 1);
+	idx->param = param;
+	idx->type = index_type_of (param);
+	idx->seq = g_sequence_new (g_free);
+	idx->nodes = g_hash_table_new (g_direct_hash, g_direct_equal);
+	idx->pending = g_hash_table_new (g_direct_hash, g_direct_equal);
+	return idx;
+}
+
+void
+qof_index_free (QofIndex * idx)
+{
+	if (!idx)
+		return;
+	g_slist_free (idx->dead);
+	g_sequence_free (idx->seq);
+	g_hash_table_destroy (idx->nodes);
+	g_hash_table_destroy (idx->pending);
+	g_free (idx);
+}
+
+const QofParam *
+qof_index_get_param (QofIndex * idx)
+{
+	g_return_val_if_fail (idx, NULL);
+	return idx->param;
+}
+
+void
+qof_index_remove (QofIndex * idx, QofEntity * ent)
+{
+	GSequenceIter *iter;
+
+	g_return_if_fail (idx);
+	if (!ent)
+		return;
+	iter = g_hash_table_lookup (idx->nodes, ent);
+	if (iter)
+	{
+		g_hash_table_remove (idx->nodes, ent);
+		/* a walk may be standing on the node, so it stays in the
+		 * sequence, in its place, until the last walk has ended */
+		if (idx->walking)
+		{
+			((QofIndexNode *) g_sequence_get (iter))->dead = TRUE;
+			idx->dead = g_slist_prepend (idx->dead, iter);
+		}
+		else
+			g_sequence_remove (iter);
+	}
+	g_hash_table_remove (idx->pending, ent);
+}
+
+void
+qof_index_insert (QofIndex * idx, QofEntity * ent)
+{
+	g_return_if_fail (idx);
+	if (!ent)
+		return;
+	qof_index_remove (idx, ent);
+	g_hash_table_insert (idx->pending, ent, ent);
+}
+
+void
+qof_index_range (QofIndex * idx,
+	gconstpointer lower, gboolean lower_inclusive,
+	gconstpointer upper, gboolean upper_inclusive,
+	QofEntityForeachCB cb, gpointer user_data)
+{
+	GSequenceIter *iter, *end;
+	QofIndexNode probe;
+
+	g_return_if_fail (idx);
+	g_return_if_fail (cb);
+
+	memset (&probe, 0, sizeof (QofIndexNode));
+	if (lower)
+	{
+		index_value_key (idx, lower, &probe.key);
+		probe.bias = lower_inclusive ? -1 : 1;
+		iter = g_sequence_search (idx->seq, &probe, index_node_cmp, idx);
+	}
+	else
+		iter = g_sequence_get_begin_iter (idx->seq);
+	if (upper)
+	{
+		index_value_key (idx, upper, &probe.key);
+		probe.bias = upper_inclusive ? 1 : -1;
+		end = g_sequence_search (idx->seq, &probe, index_node_cmp, idx);
+	}
+	else
+		end = g_sequence_get_end_iter (idx->seq);
+
+	/* an empty range, or lower is above upper */
+	if (g_sequence_iter_compare (iter, end) >= 0)
+		return;
+	for (; iter != end; iter = g_sequence_iter_next (iter))
+	{
+		QofIndexNode *node = g_sequence_get (iter);
+		if (!node->dead)
+			cb (node->ent, user_data);
+	}
+}
+
+void
+qof_index_walk_begin (QofIndex * idx)
+{
+	g_return_if_fail (idx);
+	idx->walking++;
+}
+
+void
+qof_index_walk_end (QofIndex * idx)
+{
+	GSList *node;
+
+	g_return_if_fail (idx);
+	g_return_if_fail (idx->walking > 0);
+	if (--idx->walking)
+		return;
+	for (node = idx->dead; node; node = node->next)
+		g_sequence_remove (node->data);
+	g_slist_free (idx->dead);
+	idx->dead = NULL;
+}
+
+QofEntity *
+qof_index_step (QofIndex * idx, gpointer * pos, gboolean increasing)
+{
+	GSequenceIter *iter = *pos;
+	QofIndexNode *node;
+
+	g_return_val_if_fail (idx, NULL);
+	while (TRUE)
+	{
+		if (iter && g_sequence_iter_is_end (iter))
+			break;
+		if (increasing)
+			iter = iter ? g_sequence_iter_next (iter) :
+				g_sequence_get_begin_iter (idx->seq);
+		else if (!iter)
+			iter = g_sequence_iter_prev (g_sequence_get_end_iter (idx->seq));
+		else if (g_sequence_iter_is_begin (iter))
+			iter = g_sequence_get_end_iter (idx->seq);
+		else
+			iter = g_sequence_iter_prev (iter);
+		*pos = iter;
+		if (g_sequence_iter_is_end (iter))
+			break;
+		node = g_sequence_get (iter);
+		if (!node->dead)
+			return node->ent;
+	}
+	return NULL;
+}
+
+void
+qof_index_shutdown (void)
+{
+	if (!indexTable)
+		return;
+	g_hash_table_destroy (indexTable);
+	indexTable = NULL;
+}
+
+/* ================================================================ */
+
+gboolean
+qof_index_declare (QofIdTypeConst type, const gchar * param_name)
+{
+	const QofParam *param;
+	GHashTable *ht;
+
+	g_return_val_if_fail (type, FALSE);
+	g_return_val_if_fail (param_name, FALSE);
+	param = qof_class_get_parameter (type, param_name);
+	if (!param || !param->param_getfcn)
+	{
+		PWARN ("no parameter %s registered for %s", param_name, type);
+		return FALSE;
+	}
+	if (index_type_of (param) == INDEX_NONE)
+	{
+		PWARN ("cannot index %s, type %s", param_name, param->param_type);
+		return FALSE;
+	}
+	if (!indexTable)
+		indexTable = g_hash_table_new_full (g_str_hash, g_str_equal,
+			g_free, (GDestroyNotify) g_hash_table_destroy);
+	ht = g_hash_table_lookup (indexTable, type);
+	if (!ht)
+	{
+		ht = g_hash_table_new (g_str_hash, g_str_equal);
+		g_hash_table_insert (indexTable, g_strdup (type), ht);
+	}
+	g_hash_table_insert (ht, (gchar *) param->param_name, (gpointer) param);
+	return TRUE;
+}
+
+void
+qof_index_drop (QofIdTypeConst type, const gchar * param_name)
+{
+	GHashTable *ht;
+
+	if (!indexTable || !type || !param_name)
+		return;
+	ht = g_hash_table_lookup (indexTable, type);
+	if (ht)
+		g_hash_table_remove (ht, param_name);
+}
+
+gboolean
+qof_index_exists (QofIdTypeConst type, const gchar * param_name)
+{
+	GHashTable *ht;
+
+	if (!indexTable || !type || !param_name)
+		return FALSE;
+	ht = g_hash_table_lookup (indexTable, type);
+	return (ht && g_hash_table_lookup (ht, param_name));
+}
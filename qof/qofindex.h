@@ -0,0 +1,113 @@
+/***************************************************************************
+ *            qofindex.h
+ ****************************************************************************/
+/*
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
+ */
+
+#ifndef _QOFINDEX_H
+#define _QOFINDEX_H
+
+/** @addtogroup Index
+
+A secondary index keeps the entities of a collection ordered by the
+value of one registered parameter, so that a range of values can be
+found without walking every entity in the collection.
+
+An index is declared once for an object type and a parameter name
+and then applies to the collections of that type in every book. The
+index of a collection is built the first time it is used and is kept
+up to date as entities are added to or removed from the collection.
+
+Changes to the value of an indexed parameter are picked up when the
+change is committed with ::qof_util_param_commit, or the setter calls
+::qof_instance_set_dirty after changing the value. Code that changes
+an indexed value any other way must call
+::qof_collection_reindex_entity itself: ::qof_query_run trusts the
+index, and an entity still filed under its old value is not found
+by a query that matches its new value.
+
+Only the collections of objects that use ::qof_collection_foreach
+are searched through an index. An object with a foreach of its own
+may skip some entities, so its queries always test every entity
+that foreach hands out.
+
+Indexes can be declared for parameters of these types:
+::QOF_TYPE_INT32, ::QOF_TYPE_INT64, ::QOF_TYPE_DOUBLE,
+::QOF_TYPE_BOOLEAN, ::QOF_TYPE_NUMERIC, ::QOF_TYPE_TIME and
+::QOF_TYPE_GUID. To match the numeric query predicates,
+::QOF_TYPE_NUMERIC values are ordered by their absolute value.
+
+ @{
+*/
+
+/** @file qofindex.h
+	@brief Ordered secondary indexes on entity parameters.
+*/
+
+#include "qofid.h"
+
+#define QOF_MOD_INDEX "qof-index"
+
+/** \brief Declare an index on a parameter of an object.
+
+The object and the parameter must already be registered with
+::qof_class_register.
+
+@return TRUE if the index is declared, FALSE if the parameter is
+unknown or its type cannot be indexed.
+*/
+gboolean
+qof_index_declare (QofIdTypeConst type, const gchar * param_name);
+
+/** \brief Remove a previously declared index.
+
+Collections release their copy of the index the next time it
+would have been used.
+*/
+void qof_index_drop (QofIdTypeConst type, const gchar * param_name);
+
+/** \brief Has an index been declared for this parameter? */
+gboolean
+qof_index_exists (QofIdTypeConst type, const gchar * param_name);
+
+/** \brief Find the entities with a parameter value in a range.
+
+Calls the callback for each entity of the collection with a
+value of the indexed parameter between lower and upper, in
+ascending order of the value.
+
+lower and upper point to a value of the type of the parameter:
+a gint32, gint64, double, gboolean, QofNumeric, QofTime or GUID.
+Either can be NULL for an open-ended range.
+
+@return FALSE if no index is declared for this parameter, in which
+case the callback is never called, otherwise TRUE.
+*/
+gboolean
+qof_collection_index_range (QofCollection * col, const gchar * param_name,
+							gconstpointer lower, gboolean lower_inclusive,
+							gconstpointer upper, gboolean upper_inclusive,
+							QofEntityForeachCB cb, gpointer user_data);
+
+/** \brief Refile an entity after an indexed value has changed.
+
+Only needed if the value was changed without using
+::qof_util_param_commit.
+*/
+void qof_collection_reindex_entity (QofEntity * ent);
+
+/** @} */
+#endif /* _QOFINDEX_H */
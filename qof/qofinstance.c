@@ -34,6 +34,7 @@
 #include "qofbook-p.h"
 #include "qofid-p.h"
 #include "qofinstance-p.h"
+#include "qofsnapshot-p.h"
 
 static QofLogModule log_module = QOF_MOD_ENGINE;
 
@@ -53,6 +54,7 @@ void
 qof_instance_init (QofInstance * inst, QofIdType type, QofBook * book)
 {
 	QofCollection *col;
+	gint type_id;
 
 	inst->book = book;
 	inst->kvp_data = kvp_frame_new ();
@@ -61,18 +63,25 @@ qof_instance_init (QofInstance * inst, QofIdType type, QofBook * book)
 	inst->do_free = FALSE;
 	inst->dirty = FALSE;
 
-	col = qof_book_get_collection (book, type);
+	type_id = qof_object_get_type_id (type);
+	if (type_id >= 0)
+		col = qof_book_get_collection_by_id (book, type_id);
+	else
+		col = qof_book_get_collection (book, type);
 	qof_entity_init (&inst->entity, type, col);
+	qof_book_mark_changed (book);
 }
 
 void
 qof_instance_release (QofInstance * inst)
 {
+	qof_snapshot_note_change (inst);
 	kvp_frame_delete (inst->kvp_data);
 	inst->editlevel = 0;
 	inst->do_free = FALSE;
 	inst->dirty = FALSE;
 	qof_entity_release (&inst->entity);
+	qof_book_mark_changed (inst->book);
 }
 
 const GUID *
@@ -150,6 +159,10 @@ qof_instance_set_dirty (QofInstance * inst)
 	inst->dirty = TRUE;
 	coll = inst->entity.collection;
 	qof_collection_mark_dirty (coll);
+	/* the setter may have changed an indexed value */
+	qof_collection_reindex_entity (&inst->entity);
+	qof_collection_note_change (coll, &inst->entity.guid, QOF_EVENT_MODIFY);
+	qof_book_mark_changed (inst->book);
 }
 
 gboolean
@@ -190,6 +203,7 @@ qof_instance_set_slots (QofInstance * inst, KvpFrame * frm)
 {
 	if (!inst)
 		return;
+	qof_snapshot_note_change (inst);
 	if (inst->kvp_data && (inst->kvp_data != frm))
 	{
 		kvp_frame_delete (inst->kvp_data);
@@ -197,6 +211,9 @@ qof_instance_set_slots (QofInstance * inst, KvpFrame * frm)
 
 	inst->dirty = TRUE;
 	inst->kvp_data = frm;
+	qof_collection_note_change (inst->entity.collection, &inst->entity.guid,
+		QOF_EVENT_MODIFY);
+	qof_book_mark_changed (inst->book);
 }
 
 void
@@ -228,6 +245,8 @@ qof_instance_gemini (QofInstance * to, QofInstance * from)
 		"book_guid", &to->book->inst.entity.guid, NULL);
 
 	to->dirty = TRUE;
+	qof_book_mark_changed (to->book);
+	qof_book_mark_changed (from->book);
 }
 
 QofInstance *
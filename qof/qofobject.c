@@ -37,6 +37,12 @@ static gboolean object_is_initialized = FALSE;
 static GList *object_modules = NULL;
 static GList *book_list = NULL;
 static GHashTable *backend_data = NULL;
+/* type name -> type id + 1, and the type names in order of id */
+static GHashTable *type_ids = NULL;
+static GPtrArray *type_names = NULL;
+/* The same, keyed by the address of the name, as the e_type of the
+ * QofObject is usually the very string passed back in. */
+static GHashTable *type_id_ptrs = NULL;
 
 gpointer
 qof_object_new_instance (QofIdTypeConst type_name, QofBook * book)
@@ -250,6 +256,9 @@ qof_object_initialize (void)
 	if (object_is_initialized)
 		return;
 	backend_data = g_hash_table_new (g_str_hash, g_str_equal);
+	type_ids = g_hash_table_new (g_str_hash, g_str_equal);
+	type_id_ptrs = g_hash_table_new (g_direct_hash, g_direct_equal);
+	type_names = g_ptr_array_new ();
 	object_is_initialized = TRUE;
 }
 
@@ -266,6 +275,13 @@ qof_object_shutdown (void)
 	object_modules = NULL;
 	g_list_free (book_list);
 	book_list = NULL;
+	g_hash_table_destroy (type_ids);
+	type_ids = NULL;
+	g_hash_table_destroy (type_id_ptrs);
+	type_id_ptrs = NULL;
+	g_ptr_array_foreach (type_names, (GFunc) g_free, NULL);
+	g_ptr_array_free (type_names, TRUE);
+	type_names = NULL;
 	object_is_initialized = FALSE;
 }
 
@@ -290,6 +306,19 @@ qof_object_register (const QofObject * object)
 	else
 		return FALSE;
 
+	/* an id, once given, stays with the type name */
+	if (object->e_type && !g_hash_table_lookup (type_ids, object->e_type))
+	{
+		gchar *name = g_strdup (object->e_type);
+
+		g_ptr_array_add (type_names, name);
+		g_hash_table_insert (type_ids, name,
+			GINT_TO_POINTER (type_names->len));
+	}
+	if (object->e_type)
+		g_hash_table_insert (type_id_ptrs, (gpointer) object->e_type,
+			g_hash_table_lookup (type_ids, object->e_type));
+
 	/* Now initialize all the known books */
 	if (object->book_begin && book_list)
 	{
@@ -301,6 +330,29 @@ qof_object_register (const QofObject * object)
 	return TRUE;
 }
 
+gint
+qof_object_get_type_id (QofIdTypeConst type_name)
+{
+	gint id;
+
+	if (!type_ids || !type_name)
+		return -1;
+	/* the string at that address may since have been replaced */
+	id = GPOINTER_TO_INT (g_hash_table_lookup (type_id_ptrs, type_name));
+	if (id &&
+		!safe_strcmp (g_ptr_array_index (type_names, id - 1), type_name))
+		return id - 1;
+	return GPOINTER_TO_INT (g_hash_table_lookup (type_ids, type_name)) - 1;
+}
+
+QofIdTypeConst
+qof_object_get_type_name (gint type_id)
+{
+	if (!type_names || type_id < 0 || (guint) type_id >= type_names->len)
+		return NULL;
+	return g_ptr_array_index (type_names, type_id);
+}
+
 const QofObject *
 qof_object_lookup (QofIdTypeConst name)
 {
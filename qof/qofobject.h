@@ -130,6 +130,20 @@ void qof_object_shutdown (void);
 /** Register new types of object objects */
 gboolean qof_object_register (const QofObject * object);
 
+/** \brief The number given to a registered type.
+
+Each type gets a small number, counting up from 0, when it is first
+registered, and keeps it until ::qof_object_shutdown.  Code that looks
+up the collections of a type often can ask for the number once and
+use ::qof_book_get_collection_by_id from then on.
+
+@return -1 if the type has not been registered.
+*/
+gint qof_object_get_type_id (QofIdTypeConst type_name);
+
+/** The type with the number, NULL if there is none. */
+QofIdTypeConst qof_object_get_type_name (gint type_id);
+
 /** Lookup an object definition */
 const QofObject *qof_object_lookup (QofIdTypeConst type_name);
 
@@ -34,11 +34,36 @@
 #include "qofbackend-p.h"
 #include "qofbook-p.h"
 #include "qofclass-p.h"
+#include "qofevent-p.h"
+#include "qofid-p.h"
+#include "qofindex-p.h"
 #include "qofquery-p.h"
 #include "qofquerycore-p.h"
 
 static QofLogModule log_module = QOF_MOD_QUERY;
 
+/* Threads used to test the objects of a large collection when no
+ * index applies.  One thread means "scan in the calling thread". */
+static gint query_max_threads = 1;
+
+/* The results of recent queries, see qof_query_set_cache_size. */
+static GHashTable *query_cache = NULL;
+static GQueue *query_cache_lru = NULL;	/* most recently used first */
+static GHashTable *query_cache_books = NULL;	/* told to clear the cache */
+static guint query_cache_size = 0;
+G_LOCK_DEFINE_STATIC (query_cache);
+
+#define QUERY_CACHE_BOOK_DATA "qof-query-cache"
+
+/* Collections smaller than this are not worth handing out to
+ * threads, and no thread gets less than a chunk of this size. */
+#define QUERY_PARALLEL_MIN 4096
+#define QUERY_CHUNK_MIN    1024
+
+/* How many tests the guessed pass rate of a term is worth when it
+ * is blended with the pass rate seen in earlier runs. */
+#define QUERY_STATS_WEIGHT 16
+
 struct _QofQueryTerm
 {
 	GSList *param_list;
@@ -52,6 +77,11 @@ struct _QofQueryTerm
 	 */
 	GSList *param_fcns;
 	QofQueryPredicateFunc pred_fcn;
+
+	/* How often the term was tested, and passed, in earlier runs of
+	 * the query.  Used to order the AND-terms. */
+	guint64 n_tested;
+	guint64 n_passed;
 };
 
 struct _QofQuerySort
@@ -71,11 +101,36 @@ struct _QofQuerySort
 	QofCompareFunc comp_fcn;	/* When you are comparing core types */
 };
 
+/* A term compiled for the inner loop of the search: the chain of
+ * parameter getters is flattened into an array and the predicate is,
+ * where possible, specialized on the type and the comparison. */
+typedef struct _QofQueryStep
+{
+	QofParam **getters;			/* conversions, then the parameter getter */
+	gint n_getters;
+	QofQueryPredicateFunc pred_fcn;
+	QofQueryPredData *pdata;
+	gboolean invert;
+
+	QofQueryTerm *term;			/* the term the step was compiled from */
+	gdouble cost;				/* guessed cost of one test */
+	gdouble rank;				/* steps run in increasing rank */
+	gint order;					/* position of the term in its AND-term */
+} QofQueryStep;
+
+/* Tests and passes of each step during one run of the query. */
+typedef struct _QofQueryCount
+{
+	guint tested;
+	guint passed;
+} QofQueryCount;
+
 /* The QUERY structure */
 struct _QofQuery
 {
 	/* The object type that we're searching for */
 	QofIdType search_for;
+	gint search_id;				/* its type id, set when compiled */
 
 	/* terms is a list of the OR-terms in a sum-of-products 
 	 * logical expression. */
@@ -102,15 +157,60 @@ struct _QofQuery
 	gint changed;
 
 	GList *results;
+
+	/* The compiled terms: the steps of all the OR-terms in a row,
+	 * with the number of steps of each OR-term in clause_len. */
+	QofQueryStep *steps;
+	gint n_steps;
+	gint *clause_len;
+	gint n_clauses;
+	QofParam **getter_pool;		/* storage for the getters of all steps */
+
+	/* Incremental runs: the results are patched up from the events
+	 * of the objects that changed since the last run. */
+	gint handler_id;			/* 0 unless incremental */
+	gboolean delta_ok;			/* the results can be patched */
+	gboolean chained;			/* a term or sort reads another object */
+	guint missed;				/* qof_event_get_missed at the last run */
+	GHashTable *matched;		/* object -> its node in results */
+	GHashTable *dirty;			/* objects to test again */
+	GHashTable *gone;			/* objects destroyed since the last run */
 };
 
+/* When only the last max_results objects of a sorted query are
+ * wanted, the matches are kept in a bounded heap instead of a list. */
+typedef struct _QofQueryHeapItem
+{
+	gpointer object;
+	gint seq;					/* order of arrival, keeps ties stable */
+} QofQueryHeapItem;
+
 typedef struct _QofQueryCB
 {
 	QofQuery *query;
 	GList *list;
 	gint count;
+	QofQueryCount *counts;
+
+	QofQueryHeapItem *heap;
+	gint heap_len;
+	gint heap_alloc;
+	gint heap_max;
 } QofQueryCB;
 
+static void
+free_program (QofQuery * q)
+{
+	g_free (q->steps);
+	g_free (q->clause_len);
+	g_free (q->getter_pool);
+	q->steps = NULL;
+	q->clause_len = NULL;
+	q->getter_pool = NULL;
+	q->n_steps = 0;
+	q->n_clauses = 0;
+}
+
 /* initial_term will be owned by the new Query */
 static void
 query_init (QofQuery * q, QofQueryTerm * initial_term)
@@ -141,6 +241,9 @@ query_init (QofQuery * q, QofQueryTerm * initial_term)
 	g_slist_free (q->secondary_sort.param_fcns);
 	g_slist_free (q->tertiary_sort.param_fcns);
 
+	free_program (q);
+	qof_query_set_incremental (q, FALSE);
+
 	ht = q->be_compiled;
 	memset (q, 0, sizeof (*q));
 	q->be_compiled = ht;
@@ -148,6 +251,7 @@ query_init (QofQuery * q, QofQueryTerm * initial_term)
 	q->terms = or;
 	q->changed = 1;
 	q->max_results = -1;
+	q->search_id = -1;
 
 	q->primary_sort.param_list =
 		g_slist_prepend (NULL, QUERY_DEFAULT_SORT);
@@ -283,6 +387,9 @@ free_members (QofQuery * q)
 
 	g_list_free (q->results);
 	q->results = NULL;
+
+	free_program (q);
+	qof_query_set_incremental (q, FALSE);
 }
 
 static gint
@@ -338,99 +445,129 @@ cmp_func (QofQuerySort * sort, QofSortFunc default_sort,
 	return sort->obj_cmp (conva, convb);
 }
 
-static QofQuery *sortQuery = NULL;
-
 static gint
-sort_func (gconstpointer a, gconstpointer b)
+query_sort_cmp (QofQuery * q, gconstpointer a, gconstpointer b)
 {
 	gint retval;
 
-	g_return_val_if_fail (sortQuery, 0);
-
 	retval =
-		cmp_func (&(sortQuery->primary_sort), sortQuery->defaultSort, a,
-		b);
+		cmp_func (&(q->primary_sort), q->defaultSort, a, b);
 	if (retval == 0)
 	{
 		retval =
-			cmp_func (&(sortQuery->secondary_sort), 
-			sortQuery->defaultSort,
-			a, b);
+			cmp_func (&(q->secondary_sort), q->defaultSort, a, b);
 		if (retval == 0)
 		{
 			retval =
-				cmp_func (&(sortQuery->tertiary_sort),
-				sortQuery->defaultSort, a, b);
-			return sortQuery->tertiary_sort.increasing ? 
-				retval : -retval;
+				cmp_func (&(q->tertiary_sort), q->defaultSort, a, b);
+			return q->tertiary_sort.increasing ? retval : -retval;
 		}
 		else
 		{
-			return sortQuery->secondary_sort.increasing ? 
-				retval : -retval;
+			return q->secondary_sort.increasing ? retval : -retval;
 		}
 	}
 	else
 	{
-		return sortQuery->primary_sort.increasing ? retval : -retval;
+		return q->primary_sort.increasing ? retval : -retval;
 	}
 }
 
-/* ==================================================================== */
-/* This is the main workhorse for performing the query.  For each
- * object, it walks over all of the query terms to see if the 
- * object passes the seive.
- */
-
 static gint
-check_object (QofQuery * q, gpointer object)
+sort_func (gconstpointer a, gconstpointer b, gpointer user_data)
 {
-	GList *and_ptr;
-	GList *or_ptr;
-	QofQueryTerm *qt;
-	gint and_terms_ok = 1;
+	g_return_val_if_fail (user_data, 0);
 
-	for (or_ptr = q->terms; or_ptr; or_ptr = or_ptr->next)
-	{
-		and_terms_ok = 1;
-		for (and_ptr = or_ptr->data; and_ptr; and_ptr = and_ptr->next)
-		{
-			qt = (QofQueryTerm *) (and_ptr->data);
-			if (qt->param_fcns && qt->pred_fcn)
-			{
-				GSList *node;
-				QofParam *param = NULL;
-				gpointer conv_obj = object;
+	return query_sort_cmp (user_data, a, b);
+}
 
-				/* iterate through the conversions */
-				for (node = qt->param_fcns; node; node = node->next)
-				{
-					param = node->data;
+/* Order heap items as the stable list sort would: ties go
+ * to the object that arrived first. */
+static gint
+heap_item_cmp (gconstpointer a, gconstpointer b, gpointer user_data)
+{
+	const QofQueryHeapItem *ia = a, *ib = b;
+	gint retval;
 
-					/* The last term is the actual parameter getter */
-					if (!node->next)
-						break;
+	retval = query_sort_cmp (user_data, ia->object, ib->object);
+	if (retval != 0)
+		return retval;
+	return (ia->seq < ib->seq) ? -1 : (ia->seq > ib->seq);
+}
 
-					conv_obj = param->param_getfcn (conv_obj, param);
-				}
+/* The heap is a min-heap: the root is the object that would be
+ * cropped first, so a new object only gets in if it sorts after
+ * the root. */
+static void
+heap_push (QofQueryCB * qcb, gpointer object)
+{
+	QofQueryHeapItem item, *heap = qcb->heap;
+	gint i, child;
 
-				if (((qt->pred_fcn) (conv_obj, param,
-							qt->pdata)) == qt->invert)
-				{
-					and_terms_ok = 0;
-					break;
-				}
-			}
-			else
-			{
-				/* XXX: Don't know how to do this conversion -- do we care? */
-			}
+	item.object = object;
+	item.seq = qcb->count;
+	if (qcb->heap_len < qcb->heap_max)
+	{
+		/* max_results can be far more than the number of matches */
+		if (qcb->heap_len == qcb->heap_alloc)
+		{
+			qcb->heap_alloc = MIN (2 * qcb->heap_alloc, qcb->heap_max);
+			qcb->heap = g_renew (QofQueryHeapItem, qcb->heap,
+				qcb->heap_alloc);
+			heap = qcb->heap;
 		}
-		if (and_terms_ok)
+		/* sift up */
+		for (i = qcb->heap_len++; i > 0; i = (i - 1) / 2)
 		{
-			return 1;
+			if (heap_item_cmp (&heap[(i - 1) / 2], &item, qcb->query) <= 0)
+				break;
+			heap[i] = heap[(i - 1) / 2];
 		}
+		heap[i] = item;
+		return;
+	}
+	if (heap_item_cmp (&item, &heap[0], qcb->query) <= 0)
+		return;
+	/* replace the root and sift down */
+	for (i = 0; (child = 2 * i + 1) < qcb->heap_len; i = child)
+	{
+		if (child + 1 < qcb->heap_len &&
+			heap_item_cmp (&heap[child + 1], &heap[child], qcb->query) < 0)
+			child++;
+		if (heap_item_cmp (&item, &heap[child], qcb->query) <= 0)
+			break;
+		heap[i] = heap[child];
 	}
+	heap[i] = item;
+}
+
+/* Sort what is left in the heap into the result list. */
+static GList *
+heap_to_list (QofQueryCB * qcb)
+{
+	GList *list = NULL;
+	gint i;
+
+	g_qsort_with_data (qcb->heap, qcb->heap_len, sizeof (QofQueryHeapItem),
+		heap_item_cmp, qcb->query);
+	for (i = qcb->heap_len - 1; i >= 0; i--)
+		list = g_list_prepend (list, qcb->heap[i].object);
+	return list;
+}
+
+/* ==================================================================== */
+/* This is the main workhorse for performing the query.  For each
+ * object, it walks over all of the query terms to see if the 
+ * object passes the seive.
+ */
+
+static gint
+check_object (QofQuery * q, gpointer object, QofQueryCount * counts)
+{
+	QofQueryStep *step, *end;
+	gpointer conv_obj;
+	gboolean failed;
+	gint c, g;
 
 	/* If there are no terms, assume a "match any" applies.
 	 * A query with no terms is still meaningful, since the user
@@ -439,6 +576,36 @@ check_object (QofQuery * q, gpointer object)
 	 */
 	if (NULL == q->terms)
 		return 1;
+
+	step = q->steps;
+	for (c = 0; c < q->n_clauses; c++)
+	{
+		end = step + q->clause_len[c];
+		for (; step < end; step++)
+		{
+			/* iterate through the conversions; the last
+			 * getter is the actual parameter getter */
+			conv_obj = object;
+			for (g = 0; g < step->n_getters - 1; g++)
+				conv_obj = step->getters[g]->param_getfcn (conv_obj,
+					step->getters[g]);
+
+			failed = ((step->pred_fcn (conv_obj, step->getters[g],
+						step->pdata)) == step->invert);
+			if (counts)
+			{
+				counts[step - q->steps].tested++;
+				if (!failed)
+					counts[step - q->steps].passed++;
+			}
+			if (failed)
+				break;
+		}
+		if (step == end)
+			return 1;
+		/* skip the rest of the failed AND-term */
+		step = end;
+	}
 	return 0;
 }
 
@@ -460,145 +627,1175 @@ compile_params (GSList * param_list, QofIdType start_obj,
 	g_return_val_if_fail (start_obj, NULL);
 	g_return_val_if_fail (final, NULL);
 
-	for (; param_list; param_list = param_list->next)
-	{
-		QofIdType param_name = param_list->data;
-		objDef = qof_class_get_parameter (start_obj, param_name);
+	for (; param_list; param_list = param_list->next)
+	{
+		QofIdType param_name = param_list->data;
+		objDef = qof_class_get_parameter (start_obj, param_name);
+
+		/* If it doesn't exist, then we've reached the end */
+		if (!objDef)
+			break;
+
+		/* Save off this parameter */
+		fcns = g_slist_prepend (fcns, (gpointer) objDef);
+
+		/* Save this off, just in case */
+		*final = objDef;
+
+		/* And reset for the next parameter */
+		start_obj = (QofIdType) objDef->param_type;
+	}
+
+	LEAVE ("fcns=%p", fcns);
+	return (g_slist_reverse (fcns));
+}
+
+/* The collection searched in the book, found by type id once the
+ * query has been compiled. */
+static QofCollection *
+query_collection (QofQuery * q, QofBook * book)
+{
+	if (q->search_id >= 0)
+		return qof_book_get_collection_by_id (book, q->search_id);
+	return qof_book_get_collection (book, q->search_for);
+}
+
+/* Whether the getters read another object, whose changes are not
+ * seen by an incremental query.  The GUID of the book the object
+ * is in, as matched by qof_query_set_book, only changes when the
+ * object itself is moved. */
+static gboolean
+param_chain_leaves_object (GSList * fcns)
+{
+	const QofParam *first, *second;
+
+	if (!fcns || !fcns->next)
+		return FALSE;
+	first = fcns->data;
+	second = fcns->next->data;
+	if (!fcns->next->next &&
+		!safe_strcmp (first->param_name, QOF_PARAM_BOOK) &&
+		!safe_strcmp (second->param_name, QOF_PARAM_GUID))
+		return FALSE;
+	return TRUE;
+}
+
+static void
+compile_sort (QofQuerySort * sort, QofIdType obj)
+{
+	const QofParam *resObj = NULL;
+
+	ENTER ("sort=%p id=%s params=%p", sort, obj, sort->param_list);
+	sort->use_default = FALSE;
+
+	g_slist_free (sort->param_fcns);
+	sort->param_fcns = NULL;
+	sort->comp_fcn = NULL;
+	sort->obj_cmp = NULL;
+
+	/* An empty param_list implies "no sort" */
+	if (!sort->param_list)
+	{
+		LEAVE (" ");
+		return;
+	}
+
+	/* Walk the parameter list of obtain the parameter functions */
+	sort->param_fcns = compile_params (sort->param_list, obj, &resObj);
+
+	/* If we have valid parameters, grab the compare function,
+	 * If not, check if this is the default sort.
+	 */
+	if (sort->param_fcns)
+	{
+		sort->comp_fcn = qof_query_core_get_compare (resObj->param_type);
+
+		/* Hrm, perhaps this is an object compare, not a core compare? */
+		if (sort->comp_fcn == NULL)
+		{
+			sort->obj_cmp =
+				qof_class_get_default_sort (resObj->param_type);
+		}
+	}
+	else if (!safe_strcmp (sort->param_list->data, QUERY_DEFAULT_SORT))
+	{
+		sort->use_default = TRUE;
+	}
+	LEAVE ("sort=%p id=%s", sort, obj);
+}
+
+/* A guess at the cost of testing a term: a call for each getter in
+ * the chain plus the price of the comparison itself. */
+static gdouble
+step_cost (QofQueryStep * step)
+{
+	QofType type = step->pdata->type_name;
+	gdouble cost = step->n_getters;
+
+	if (!safe_strcmp (type, QOF_TYPE_GUID) ||
+		!safe_strcmp (type, QOF_TYPE_BOOLEAN) ||
+		!safe_strcmp (type, QOF_TYPE_INT32) ||
+		!safe_strcmp (type, QOF_TYPE_INT64) ||
+		!safe_strcmp (type, QOF_TYPE_DOUBLE) ||
+		!safe_strcmp (type, QOF_TYPE_CHAR) ||
+		!safe_strcmp (type, QOF_TYPE_TIME))
+		return cost + 1;
+	if (!safe_strcmp (type, QOF_TYPE_NUMERIC) ||
+		!safe_strcmp (type, QOF_TYPE_DEBCRED))
+		return cost + 2;
+	if (!safe_strcmp (type, QOF_TYPE_STRING))
+		return cost + (((query_string_t) step->pdata)->is_regex ? 16 : 4);
+	if (!safe_strcmp (type, QOF_TYPE_KVP))
+		return cost + 16;
+	return cost + 8;
+}
+
+/* A guess at how often a term passes, until the query has been run. */
+static gdouble
+step_guess (QofQueryStep * step)
+{
+	QofQueryPredData *pd = step->pdata;
+	gdouble guess;
+
+	if (!safe_strcmp (pd->type_name, QOF_TYPE_GUID))
+		guess = (((query_guid_t) pd)->options == QOF_GUID_MATCH_ANY) ?
+			0.1 : 0.5;
+	else if (pd->how == QOF_COMPARE_EQUAL)
+		guess = 0.1;
+	else if (pd->how == QOF_COMPARE_NEQ)
+		guess = 0.9;
+	else
+		guess = 0.5;
+	return step->invert ? 1.0 - guess : guess;
+}
+
+static gint
+step_cmp (gconstpointer a, gconstpointer b,
+	gpointer user_data __attribute__ ((unused)))
+{
+	const QofQueryStep *sa = a, *sb = b;
+
+	if (sa->rank != sb->rank)
+		return (sa->rank < sb->rank) ? -1 : 1;
+	return sa->order - sb->order;
+}
+
+/* Put the steps of each AND-term in the order that is expected to
+ * reject an object for the least work: a step that costs c and
+ * passes a fraction p of the objects is worth c / (1 - p).  The pass
+ * rate is seen from earlier runs of the query, the guess only counts
+ * for as long as few objects have been tested.  A step only sees the
+ * objects that passed the steps before it, so the rates are those of
+ * the order the query last ran in, which is close enough. */
+static void
+order_program (QofQuery * q)
+{
+	QofQueryStep *step;
+	gdouble pass;
+	gint c, i;
+
+	for (i = 0; i < q->n_steps; i++)
+	{
+		step = &q->steps[i];
+		pass = (step->term->n_passed + QUERY_STATS_WEIGHT * step_guess (step))
+			/ (step->term->n_tested + QUERY_STATS_WEIGHT);
+		step->rank = step->cost / (1.0 - MIN (pass, 0.99));
+	}
+	step = q->steps;
+	for (c = 0; c < q->n_clauses; c++)
+	{
+		g_qsort_with_data (step, q->clause_len[c], sizeof (QofQueryStep),
+			step_cmp, NULL);
+		step += q->clause_len[c];
+	}
+}
+
+/* Keep the counts of this run for ordering the next one. */
+static void
+save_counts (QofQuery * q, QofQueryCount * counts)
+{
+	gint i;
+
+	for (i = 0; i < q->n_steps; i++)
+	{
+		q->steps[i].term->n_tested += counts[i].tested;
+		q->steps[i].term->n_passed += counts[i].passed;
+	}
+}
+
+/* Flatten the compiled terms into the steps run by check_object.
+ * Terms that could not be compiled are left out, which is the same
+ * as letting them pass. */
+static void
+compile_program (QofQuery * q)
+{
+	GList *or_ptr, *and_ptr;
+	GSList *node;
+	QofParam **getter;
+	gint n_steps, n_getters, c;
+	QofQueryStep *step;
+
+	free_program (q);
+	n_steps = n_getters = 0;
+	for (or_ptr = q->terms; or_ptr; or_ptr = or_ptr->next)
+	{
+		for (and_ptr = or_ptr->data; and_ptr; and_ptr = and_ptr->next)
+		{
+			QofQueryTerm *qt = and_ptr->data;
+
+			if (qt->param_fcns && qt->pred_fcn)
+			{
+				n_steps++;
+				n_getters += g_slist_length (qt->param_fcns);
+			}
+		}
+	}
+	q->n_steps = n_steps;
+	q->n_clauses = g_list_length (q->terms);
+	q->clause_len = g_new0 (gint, q->n_clauses);
+	q->steps = g_new0 (QofQueryStep, n_steps);
+	q->getter_pool = g_new0 (QofParam *, n_getters);
+
+	step = q->steps;
+	getter = q->getter_pool;
+	for (c = 0, or_ptr = q->terms; or_ptr; c++, or_ptr = or_ptr->next)
+	{
+		for (and_ptr = or_ptr->data; and_ptr; and_ptr = and_ptr->next)
+		{
+			QofQueryTerm *qt = and_ptr->data;
+			QofParam *param;
+
+			if (!qt->param_fcns || !qt->pred_fcn)
+				continue;
+			step->getters = getter;
+			for (node = qt->param_fcns; node; node = node->next)
+				*getter++ = node->data;
+			step->n_getters = getter - step->getters;
+			step->pdata = qt->pdata;
+			step->invert = qt->invert;
+			param = step->getters[step->n_getters - 1];
+			step->pred_fcn = qof_query_core_get_specialized
+				(param->param_type, qt->pdata);
+			if (!step->pred_fcn)
+				step->pred_fcn = qt->pred_fcn;
+			step->term = qt;
+			step->order = q->clause_len[c];
+			step->cost = step_cost (step);
+			q->clause_len[c]++;
+			step++;
+		}
+	}
+}
+
+static void
+compile_terms (QofQuery * q)
+{
+	GList *or_ptr, *and_ptr, *node;
+
+	ENTER (" query=%p", q);
+	q->search_id = qof_object_get_type_id (q->search_for);
+	q->chained = FALSE;
+	/* Find the specific functions for this Query.  Note that the
+	 * Query's search_for should now be set to the new type.
+	 */
+	for (or_ptr = q->terms; or_ptr; or_ptr = or_ptr->next)
+	{
+		for (and_ptr = or_ptr->data; and_ptr; and_ptr = and_ptr->next)
+		{
+			QofQueryTerm *qt = and_ptr->data;
+			const QofParam *resObj = NULL;
+
+			g_slist_free (qt->param_fcns);
+			qt->param_fcns = NULL;
+
+			/* Walk the parameter list of obtain the parameter functions */
+			qt->param_fcns = compile_params (qt->param_list, q->search_for,
+				&resObj);
+
+			/* If we have valid parameters, grab the predicate function,
+			 * If not, see if this is the default sort.
+			 */
+
+			if (qt->param_fcns)
+				qt->pred_fcn =
+					qof_query_core_get_predicate (resObj->param_type);
+			else
+				qt->pred_fcn = NULL;
+			if (param_chain_leaves_object (qt->param_fcns))
+				q->chained = TRUE;
+		}
+	}
+
+	compile_program (q);
+
+	/* Update the sort functions */
+	compile_sort (&(q->primary_sort), q->search_for);
+	compile_sort (&(q->secondary_sort), q->search_for);
+	compile_sort (&(q->tertiary_sort), q->search_for);
+	if (param_chain_leaves_object (q->primary_sort.param_fcns) ||
+		param_chain_leaves_object (q->secondary_sort.param_fcns) ||
+		param_chain_leaves_object (q->tertiary_sort.param_fcns))
+		q->chained = TRUE;
+
+	q->defaultSort = qof_class_get_default_sort (q->search_for);
+
+	/* Now compile the backend instances */
+	for (node = q->books; node; node = node->next)
+	{
+		QofBook *book = node->data;
+		QofBackend *be = book->backend;
+
+		if (be && be->compile_query)
+		{
+			gpointer result = (be->compile_query) (be, q);
+			if (result)
+				g_hash_table_insert (q->be_compiled, book, result);
+		}
+	}
+	LEAVE (" query=%p", q);
+}
+
+static void
+query_add_match (QofQueryCB * ql, gpointer object)
+{
+	if (ql->heap)
+		heap_push (ql, object);
+	else
+		ql->list = g_list_prepend (ql->list, object);
+	ql->count++;
+}
+
+static void
+check_item_cb (gpointer object, gpointer user_data)
+{
+	QofQueryCB *ql = user_data;
+
+	if (!object || !ql)
+		return;
+
+	if (check_object (ql->query, object, ql->counts))
+		query_add_match (ql, object);
+	return;
+}
+
+/* ==================================================================== */
+/* Testing a large collection on several threads.  The objects are
+ * gathered into an array which is cut into chunks; each chunk is
+ * tested on a pool thread and its matches are handed back in chunk
+ * order, so the result is the same as that of a single thread.
+ * check_object only reads the query and the objects, and each chunk
+ * keeps its own counts of the steps.
+ */
+
+typedef struct _QofQueryChunk
+{
+	QofQuery *query;
+	gpointer *objects;
+	guint len;
+	GList *matches;				/* in reverse order */
+	QofQueryCount *counts;
+} QofQueryChunk;
+
+static void
+gather_item_cb (QofEntity * ent, gpointer user_data)
+{
+	g_ptr_array_add (user_data, ent);
+}
+
+static void
+check_chunk (gpointer data, gpointer user_data __attribute__ ((unused)))
+{
+	QofQueryChunk *chunk = data;
+	guint i;
+
+	for (i = 0; i < chunk->len; i++)
+	{
+		if (check_object (chunk->query, chunk->objects[i], chunk->counts))
+			chunk->matches = g_list_prepend (chunk->matches,
+				chunk->objects[i]);
+	}
+}
+
+/* Returns FALSE if the book is better scanned in this thread. */
+static gboolean
+query_run_parallel (QofQuery * q, QofBook * book, QofQueryCB * qcb)
+{
+	QofCollection *col;
+	QofQueryChunk *chunks;
+	GThreadPool *pool;
+	GPtrArray *objects;
+	GError *error = NULL;
+	GList *node;
+	guint size, n_chunks, i;
+	gint j;
+
+	/* without terms, everything matches: nothing to share out */
+	if (query_max_threads < 2 || !q->terms)
+		return FALSE;
+	col = query_collection (q, book);
+	if (!col || qof_collection_count (col) < QUERY_PARALLEL_MIN)
+		return FALSE;
+
+	objects = g_ptr_array_sized_new (qof_collection_count (col));
+	qof_object_foreach (q->search_for, book, gather_item_cb, objects);
+	size = MAX (objects->len / (query_max_threads * 4), QUERY_CHUNK_MIN);
+	n_chunks = (objects->len + size - 1) / size;
+	PINFO ("testing %d objects in %d chunks", objects->len, n_chunks);
+
+	pool = g_thread_pool_new (check_chunk, NULL, query_max_threads,
+		FALSE, &error);
+	if (!pool)
+	{
+		PWARN ("no thread pool: %s", error->message);
+		g_error_free (error);
+	}
+	chunks = g_new0 (QofQueryChunk, n_chunks);
+	for (i = 0; i < n_chunks; i++)
+	{
+		chunks[i].query = q;
+		chunks[i].objects = objects->pdata + i * size;
+		chunks[i].len = MIN (size, objects->len - i * size);
+		chunks[i].counts = g_new0 (QofQueryCount, q->n_steps);
+		if (pool)
+			g_thread_pool_push (pool, &chunks[i], NULL);
+		else
+			check_chunk (&chunks[i], NULL);
+	}
+	/* wait for the pool to finish all chunks */
+	if (pool)
+		g_thread_pool_free (pool, FALSE, TRUE);
+
+	for (i = 0; i < n_chunks; i++)
+	{
+		chunks[i].matches = g_list_reverse (chunks[i].matches);
+		for (node = chunks[i].matches; node; node = node->next)
+			query_add_match (qcb, node->data);
+		g_list_free (chunks[i].matches);
+		for (j = 0; j < q->n_steps; j++)
+		{
+			qcb->counts[j].tested += chunks[i].counts[j].tested;
+			qcb->counts[j].passed += chunks[i].counts[j].passed;
+		}
+		g_free (chunks[i].counts);
+	}
+	g_free (chunks);
+	g_ptr_array_free (objects, TRUE);
+	return TRUE;
+}
+
+/* ==================================================================== */
+/* The query planner.  Rather than scanning every object in the book,
+ * look for an index that can hand over a superset of the objects that
+ * could possibly match.  Every OR-term needs at least one AND-term
+ * that can be answered from an index, otherwise a full scan is needed
+ * anyway.  The candidates are still run through check_object, so an
+ * index may over-approximate but must never miss a match.
+ */
+
+typedef struct _QofQueryPlanCB
+{
+	QofQueryCB *qcb;
+	GHashTable *seen;
+} QofQueryPlanCB;
+
+static void
+plan_item_cb (QofEntity * ent, gpointer user_data)
+{
+	QofQueryPlanCB *plan = user_data;
+
+	if (!ent || !plan)
+		return;
+	/* the same object can come from more than one OR-term */
+	if (g_hash_table_lookup (plan->seen, ent))
+		return;
+	g_hash_table_insert (plan->seen, ent, ent);
+	check_item_cb (ent, plan->qcb);
+}
+
+static void
+index_range (QofCollection * col, const gchar * param_name,
+	QofQueryCompare how, gconstpointer value,
+	QofEntityForeachCB cb, gpointer user_data)
+{
+	switch (how)
+	{
+	case QOF_COMPARE_LT:
+		qof_collection_index_range (col, param_name, NULL, FALSE,
+			value, FALSE, cb, user_data);
+		break;
+	case QOF_COMPARE_LTE:
+		qof_collection_index_range (col, param_name, NULL, FALSE,
+			value, TRUE, cb, user_data);
+		break;
+	case QOF_COMPARE_EQUAL:
+		qof_collection_index_range (col, param_name, value, TRUE,
+			value, TRUE, cb, user_data);
+		break;
+	case QOF_COMPARE_GT:
+		qof_collection_index_range (col, param_name, value, FALSE,
+			NULL, FALSE, cb, user_data);
+		break;
+	case QOF_COMPARE_GTE:
+		qof_collection_index_range (col, param_name, value, TRUE,
+			NULL, FALSE, cb, user_data);
+		break;
+	default:
+		break;
+	}
+}
+
+/* Use an index declared on the parameter with qof_index_declare.
+ * Only comparisons that select a range of values can be served;
+ * NEQ, for example, always needs a scan.
+ */
+static gboolean
+index_term_range (QofQueryTerm * qt, QofCollection * col,
+	QofEntityForeachCB cb, gpointer user_data)
+{
+	QofQueryPredData *pd = qt->pdata;
+	QofParam *param = qt->param_fcns->data;
+	gconstpointer value = NULL;
+
+	if (safe_strcmp (pd->type_name, param->param_type))
+		return FALSE;
+	if (pd->how == QOF_COMPARE_NEQ)
+		return FALSE;
+	if (!qof_index_exists (qof_collection_get_type (col),
+			param->param_name))
+		return FALSE;
+
+	if (!safe_strcmp (pd->type_name, QOF_TYPE_INT64))
+		value = &((query_int64_t) pd)->val;
+	else if (!safe_strcmp (pd->type_name, QOF_TYPE_INT32))
+		value = &((query_int32_t) pd)->val;
+	else if (!safe_strcmp (pd->type_name, QOF_TYPE_DOUBLE))
+		value = &((query_double_t) pd)->val;
+	else if (!safe_strcmp (pd->type_name, QOF_TYPE_BOOLEAN))
+		value = &((query_boolean_t) pd)->val;
+	else if (!safe_strcmp (pd->type_name, QOF_TYPE_TIME))
+	{
+		query_time_t pdata = (query_time_t) pd;
+
+		/* matching by day compares rounded times */
+		if (pdata->options != QOF_DATE_MATCH_NORMAL || !pdata->qt)
+			return FALSE;
+		value = pdata->qt;
+	}
+	else if (!safe_strcmp (pd->type_name, QOF_TYPE_NUMERIC))
+	{
+		query_numeric_t pdata = (query_numeric_t) pd;
+		QofNumeric lower, upper, slop;
+
+		/* The numeric predicate compares the absolute value, and
+		 * calls amounts equal when they match to four decimal
+		 * places, so widen an equal match to cover that. */
+		if (pd->how != QOF_COMPARE_EQUAL)
+			value = &pdata->amount;
+		else
+		{
+			slop = qof_numeric_create (2, 10000);
+			lower = qof_numeric_sub (qof_numeric_abs (pdata->amount), slop,
+				QOF_DENOM_AUTO, QOF_HOW_DENOM_LCD);
+			upper = qof_numeric_add (qof_numeric_abs (pdata->amount), slop,
+				QOF_DENOM_AUTO, QOF_HOW_DENOM_LCD);
+			if (qof_numeric_check (lower) != QOF_ERROR_OK ||
+				qof_numeric_check (upper) != QOF_ERROR_OK)
+				return FALSE;
+			if (cb)
+				qof_collection_index_range (col, param->param_name,
+					&lower, TRUE, &upper, TRUE, cb, user_data);
+			return TRUE;
+		}
+	}
+	else if (!safe_strcmp (pd->type_name, QOF_TYPE_GUID))
+	{
+		query_guid_t pdata = (query_guid_t) pd;
+		GList *node;
+
+		if (pdata->options != QOF_GUID_MATCH_ANY ||
+			pd->how != QOF_COMPARE_EQUAL)
+			return FALSE;
+		if (!cb)
+			return TRUE;
+		for (node = pdata->guids; node; node = node->next)
+			index_range (col, param->param_name, QOF_COMPARE_EQUAL,
+				node->data, cb, user_data);
+		return TRUE;
+	}
+	else
+		return FALSE;
+
+	if (cb)
+		index_range (col, param->param_name, pd->how, value, cb, user_data);
+	return TRUE;
+}
+
+/* Find the candidates for a single term.  Returns FALSE if no index
+ * applies to this term.  If cb is NULL, only check that the term can
+ * be served from an index.
+ */
+static gboolean
+index_term_foreach (QofQueryTerm * qt, QofCollection * col,
+	QofEntityForeachCB cb, gpointer user_data)
+{
+	QofParam *param;
+
+	/* An inverted term matches "everything else" and chained
+	 * parameters are about some other object: scan those. */
+	if (!qt->pred_fcn || !qt->param_fcns || qt->param_fcns->next
+		|| qt->invert)
+		return FALSE;
+	param = qt->param_fcns->data;
+
+	/* The entity table of the collection is the primary index. */
+	if (!safe_strcmp (param->param_name, QOF_PARAM_GUID) &&
+		!safe_strcmp (param->param_type, QOF_TYPE_GUID) &&
+		!safe_strcmp (qt->pdata->type_name, QOF_TYPE_GUID))
+	{
+		query_guid_t pdata = (query_guid_t) qt->pdata;
+		GList *node;
+
+		if (pdata->options != QOF_GUID_MATCH_ANY)
+			return FALSE;
+		if (!cb)
+			return TRUE;
+		for (node = pdata->guids; node; node = node->next)
+		{
+			QofEntity *ent;
+
+			ent = qof_collection_lookup_entity (col, node->data);
+			if (ent)
+				cb (ent, user_data);
+		}
+		return TRUE;
+	}
+	return index_term_range (qt, col, cb, user_data);
+}
+
+/* Returns TRUE if the candidates in this book were produced
+ * from indexes, FALSE if the caller has to scan. */
+static gboolean
+query_run_indexed (QofQuery * q, QofBook * book, QofQueryCB * qcb)
+{
+	QofQueryPlanCB plan;
+	const QofObject *obj;
+	QofCollection *col;
+	GList *or_ptr, *and_ptr, *picks, *node;
+
+	if (!q->terms)
+		return FALSE;
+	/* objects with a foreach of their own may skip some entities,
+	 * which the index would hand out anyway */
+	obj = qof_object_lookup (q->search_for);
+	if (!obj || obj->foreach != qof_collection_foreach)
+		return FALSE;
+	col = query_collection (q, book);
+	if (!col)
+		return FALSE;
+
+	picks = NULL;
+	for (or_ptr = q->terms; or_ptr; or_ptr = or_ptr->next)
+	{
+		for (and_ptr = or_ptr->data; and_ptr; and_ptr = and_ptr->next)
+		{
+			if (index_term_foreach (and_ptr->data, col, NULL, NULL))
+				break;
+		}
+		if (!and_ptr)
+		{
+			g_list_free (picks);
+			return FALSE;
+		}
+		picks = g_list_prepend (picks, and_ptr->data);
+	}
+	PINFO ("using %d index lookups for %s", g_list_length (picks),
+		q->search_for);
+
+	plan.qcb = qcb;
+	plan.seen = g_hash_table_new (g_direct_hash, g_direct_equal);
+	for (node = picks; node; node = node->next)
+		index_term_foreach (node->data, col, plan_item_cb, &plan);
+	g_hash_table_destroy (plan.seen);
+	g_list_free (picks);
+	return TRUE;
+}
+
+/* ==================================================================== */
+/* Incremental runs.  After a full run, the events of the objects that
+ * the query searches mark them to be tested again, and the next run
+ * only tests those objects and patches up the results.  The event
+ * handler does no more than note the object: a MODIFY event comes
+ * before the change is made, and the caller may still be walking the
+ * results of the last run.
+ */
+
+typedef struct _QofQueryDelta
+{
+	QofQuery *query;
+	gboolean sorted;
+	GList *added;
+} QofQueryDelta;
+
+static gboolean
+query_sorted (QofQuery * q)
+{
+	return (q->primary_sort.comp_fcn || q->primary_sort.obj_cmp ||
+		(q->primary_sort.use_default && q->defaultSort));
+}
+
+/* The object behind an event, if it is in one of the books searched.
+ * The object is looked up rather than trusted, because the deprecated
+ * qof_event_generate passes a copy of the entity. */
+static QofEntity *
+query_event_entity (QofQuery * q, QofEntity * ent)
+{
+	GList *node;
+
+	for (node = q->books; node; node = node->next)
+	{
+		QofCollection *col;
+		QofEntity *found;
+
+		col = query_collection (q, node->data);
+		found = qof_collection_lookup_entity (col, &ent->guid);
+		if (found)
+			return found;
+	}
+	return NULL;
+}
+
+static void
+query_event_cb (QofEntity * ent, QofEventId event_type,
+	gpointer handler_data, gpointer event_data __attribute__ ((unused)))
+{
+	QofQuery *q = handler_data;
+	QofEntity *found;
+
+	if (!q->delta_ok)
+		return;
+	if (event_type == QOF_EVENT_DESTROY && g_list_find (q->books, ent))
+	{
+		/* the results are about to point at freed objects */
+		q->delta_ok = FALSE;
+		return;
+	}
+	if (safe_strcmp (ent->e_type, q->search_for))
+		return;
+
+	found = query_event_entity (q, ent);
+	switch (event_type)
+	{
+	case QOF_EVENT_CREATE:
+	case QOF_EVENT_MODIFY:
+	case QOF_EVENT_COMMIT:
+	case QOF_EVENT_ADD:
+		if (found)
+			g_hash_table_insert (q->dirty, found, found);
+		break;
+	case QOF_EVENT_REMOVE:
+		/* may be added back to another book */
+		if (found)
+			g_hash_table_insert (q->dirty, found, found);
+		g_hash_table_insert (q->gone, found ? found : ent, ent);
+		break;
+	case QOF_EVENT_DESTROY:
+		if (!found)
+			found = ent;
+		g_hash_table_remove (q->dirty, found);
+		g_hash_table_insert (q->gone, found, found);
+		break;
+	default:
+		break;
+	}
+}
+
+static void
+delta_drop (QofQuery * q, gpointer object)
+{
+	GList *node;
+
+	node = g_hash_table_lookup (q->matched, object);
+	if (!node)
+		return;
+	q->results = g_list_delete_link (q->results, node);
+	g_hash_table_remove (q->matched, object);
+}
+
+static gboolean
+delta_gone_cb (gpointer key, gpointer value __attribute__ ((unused)),
+	gpointer user_data)
+{
+	delta_drop (user_data, key);
+	return TRUE;
+}
+
+static gboolean
+delta_dirty_cb (gpointer key, gpointer value __attribute__ ((unused)),
+	gpointer user_data)
+{
+	QofQueryDelta *delta = user_data;
+	QofQuery *q = delta->query;
+
+	if (!check_object (q, key, NULL))
+		delta_drop (q, key);
+	else if (!g_hash_table_lookup (q->matched, key))
+		delta->added = g_list_prepend (delta->added, key);
+	else if (delta->sorted)
+	{
+		/* the sort key may have changed: file it again */
+		delta_drop (q, key);
+		delta->added = g_list_prepend (delta->added, key);
+	}
+	return TRUE;
+}
+
+/* Merge two sorted lists, keeping their nodes. */
+static GList *
+delta_merge (QofQuery * q, GList * a, GList * b)
+{
+	GList head = { NULL, NULL, NULL };
+	GList *tail = &head;
+	GList *next;
+
+	while (a && b)
+	{
+		if (query_sort_cmp (q, a->data, b->data) <= 0)
+		{
+			next = a;
+			a = a->next;
+		}
+		else
+		{
+			next = b;
+			b = b->next;
+		}
+		tail->next = next;
+		next->prev = tail;
+		tail = next;
+	}
+	tail->next = a ? a : b;
+	if (tail->next)
+		tail->next->prev = tail;
+	if (head.next)
+		head.next->prev = NULL;
+	return head.next;
+}
+
+/* Returns FALSE if the query has to be run in full. */
+static gboolean
+query_run_delta (QofQuery * q)
+{
+	QofQueryDelta delta;
+	GList *node;
+
+	if (!q->handler_id || !q->delta_ok || q->changed ||
+		q->missed != qof_event_get_missed ())
+		return FALSE;
+
+	g_hash_table_foreach_remove (q->gone, delta_gone_cb, q);
+	delta.query = q;
+	delta.sorted = query_sorted (q);
+	delta.added = NULL;
+	g_hash_table_foreach_remove (q->dirty, delta_dirty_cb, &delta);
+	PINFO ("adding %d objects", g_list_length (delta.added));
+
+	if (delta.sorted)
+		delta.added = g_list_sort_with_data (delta.added, sort_func, q);
+	for (node = delta.added; node; node = node->next)
+		g_hash_table_insert (q->matched, node->data, node);
+	if (delta.sorted)
+		q->results = delta_merge (q, q->results, delta.added);
+	else
+		q->results = g_list_concat (delta.added, q->results);
+	return TRUE;
+}
+
+/* ==================================================================== */
+/* The result cache.  Queries that are qof_query_equal, for the same
+ * type and the same books, give the same results until one of the
+ * books changes, so the results of recent queries are kept with the
+ * generations of their books.  The key of an entry is a copy of the
+ * query that was run, which also holds the results.
+ */
+
+typedef struct _QofQueryCacheEntry
+{
+	QofQuery *query;
+	guint64 *generations;		/* of query->books, in order */
+	GList *link;				/* in query_cache_lru */
+} QofQueryCacheEntry;
+
+/* Only covers what is cheap to hash; query_cache_equal sorts out
+ * the rest. */
+static guint
+query_cache_hash (gconstpointer key)
+{
+	const QofQuery *q = key;
+	GList *or_ptr, *and_ptr, *node;
+	GSList *param;
+	guint h;
+
+	h = g_str_hash (q->search_for) * 31 + q->max_results;
+	for (node = q->books; node; node = node->next)
+		h = h * 31 + g_direct_hash (node->data);
+	for (or_ptr = q->terms; or_ptr; or_ptr = or_ptr->next)
+	{
+		h = h * 31 + 1;
+		for (and_ptr = or_ptr->data; and_ptr; and_ptr = and_ptr->next)
+		{
+			QofQueryTerm *qt = and_ptr->data;
+
+			h = h * 31 + qt->invert;
+			for (param = qt->param_list; param; param = param->next)
+				h = h * 31 + g_str_hash (param->data);
+			h = h * 31 + g_str_hash (qt->pdata->type_name) + qt->pdata->how;
+		}
+	}
+	return h;
+}
+
+static gboolean
+query_cache_equal (gconstpointer a, gconstpointer b)
+{
+	const QofQuery *q1 = a;
+	const QofQuery *q2 = b;
+	GList *n1, *n2;
+
+	if (safe_strcmp (q1->search_for, q2->search_for))
+		return FALSE;
+	for (n1 = q1->books, n2 = q2->books; n1 && n2;
+		n1 = n1->next, n2 = n2->next)
+	{
+		if (n1->data != n2->data)
+			return FALSE;
+	}
+	if (n1 || n2)
+		return FALSE;
+	return qof_query_equal ((QofQuery *) q1, (QofQuery *) q2);
+}
+
+static void
+query_cache_entry_free (gpointer data)
+{
+	QofQueryCacheEntry *entry = data;
 
-		/* If it doesn't exist, then we've reached the end */
-		if (!objDef)
-			break;
+	g_queue_delete_link (query_cache_lru, entry->link);
+	qof_query_destroy (entry->query);
+	g_free (entry->generations);
+	g_free (entry);
+}
 
-		/* Save off this parameter */
-		fcns = g_slist_prepend (fcns, (gpointer) objDef);
+static gboolean
+query_cache_usable (QofQuery * q)
+{
+	GList *node;
 
-		/* Save this off, just in case */
-		*final = objDef;
+	if (!query_cache_size || q->handler_id)
+		return FALSE;
+	for (node = q->books; node; node = node->next)
+	{
+		QofBackend *be = ((QofBook *) node->data)->backend;
 
-		/* And reset for the next parameter */
-		start_obj = (QofIdType) objDef->param_type;
+		/* the backend may know of objects the book has not seen */
+		if (be && be->run_query)
+			return FALSE;
 	}
+	return TRUE;
+}
 
-	LEAVE ("fcns=%p", fcns);
-	return (g_slist_reverse (fcns));
+/* Drop the entries of a book that is being destroyed, before its
+ * address can be reused. */
+static gboolean
+query_cache_book_cb (gpointer key, gpointer value __attribute__ ((unused)),
+	gpointer user_data)
+{
+	return (g_list_find (((QofQuery *) key)->books, user_data) != NULL);
 }
 
 static void
-compile_sort (QofQuerySort * sort, QofIdType obj)
+query_cache_book_final (QofBook * book,
+	gpointer key __attribute__ ((unused)),
+	gpointer user_data __attribute__ ((unused)))
 {
-	const QofParam *resObj = NULL;
-
-	ENTER ("sort=%p id=%s params=%p", sort, obj, sort->param_list);
-	sort->use_default = FALSE;
-
-	g_slist_free (sort->param_fcns);
-	sort->param_fcns = NULL;
-	sort->comp_fcn = NULL;
-	sort->obj_cmp = NULL;
+	G_LOCK (query_cache);
+	if (query_cache)
+		g_hash_table_foreach_remove (query_cache, query_cache_book_cb, book);
+	if (query_cache_books)
+		g_hash_table_remove (query_cache_books, book);
+	G_UNLOCK (query_cache);
+}
 
-	/* An empty param_list implies "no sort" */
-	if (!sort->param_list)
-	{
-		LEAVE (" ");
+/* Have the book clear its entries when it goes.  The book data is
+ * only written the first time, and under the lock, as queries on
+ * other threads may be storing results for the same book. */
+static void
+query_cache_watch_book (QofBook * book)
+{
+	if (!query_cache_books)
+		query_cache_books = g_hash_table_new (g_direct_hash, g_direct_equal);
+	if (g_hash_table_lookup (query_cache_books, book))
 		return;
-	}
+	g_hash_table_insert (query_cache_books, book, book);
+	qof_book_set_data_fin (book, QUERY_CACHE_BOOK_DATA, NULL,
+		query_cache_book_final);
+}
 
-	/* Walk the parameter list of obtain the parameter functions */
-	sort->param_fcns = compile_params (sort->param_list, obj, &resObj);
+/* Returns TRUE if q->results were taken from the cache. */
+static gboolean
+query_cache_lookup (QofQuery * q)
+{
+	QofQueryCacheEntry *entry;
+	GList *node;
+	gint i;
 
-	/* If we have valid parameters, grab the compare function,
-	 * If not, check if this is the default sort.
-	 */
-	if (sort->param_fcns)
+	if (!query_cache_usable (q))
+		return FALSE;
+	G_LOCK (query_cache);
+	entry = query_cache ? g_hash_table_lookup (query_cache, q) : NULL;
+	if (entry)
 	{
-		sort->comp_fcn = qof_query_core_get_compare (resObj->param_type);
-
-		/* Hrm, perhaps this is an object compare, not a core compare? */
-		if (sort->comp_fcn == NULL)
+		for (i = 0, node = entry->query->books; node; i++, node = node->next)
 		{
-			sort->obj_cmp =
-				qof_class_get_default_sort (resObj->param_type);
+			if (qof_book_get_generation (node->data) !=
+				entry->generations[i])
+				break;
+		}
+		if (node)
+		{
+			g_hash_table_remove (query_cache, entry->query);
+			entry = NULL;
 		}
 	}
-	else if (!safe_strcmp (sort->param_list->data, QUERY_DEFAULT_SORT))
+	if (entry)
 	{
-		sort->use_default = TRUE;
+		g_queue_unlink (query_cache_lru, entry->link);
+		g_queue_push_head_link (query_cache_lru, entry->link);
+		g_list_free (q->results);
+		q->results = g_list_copy (entry->query->results);
 	}
-	LEAVE ("sort=%p id=%s", sort, obj);
+	G_UNLOCK (query_cache);
+	PINFO ("cache %s", entry ? "hit" : "miss");
+	return (entry != NULL);
 }
 
 static void
-compile_terms (QofQuery * q)
+query_cache_store (QofQuery * q)
 {
-	GList *or_ptr, *and_ptr, *node;
+	QofQueryCacheEntry *entry;
+	GList *node;
+	gint i;
 
-	ENTER (" query=%p", q);
-	/* Find the specific functions for this Query.  Note that the
-	 * Query's search_for should now be set to the new type.
-	 */
-	for (or_ptr = q->terms; or_ptr; or_ptr = or_ptr->next)
+	if (!query_cache_usable (q))
+		return;
+	entry = g_new0 (QofQueryCacheEntry, 1);
+	entry->query = qof_query_copy (q);
+	entry->generations = g_new (guint64, g_list_length (q->books));
+	for (i = 0, node = q->books; node; i++, node = node->next)
+		entry->generations[i] = qof_book_get_generation (node->data);
+
+	G_LOCK (query_cache);
+	if (!query_cache)
 	{
-		for (and_ptr = or_ptr->data; and_ptr; and_ptr = and_ptr->next)
-		{
-			QofQueryTerm *qt = and_ptr->data;
-			const QofParam *resObj = NULL;
-
-			g_slist_free (qt->param_fcns);
-			qt->param_fcns = NULL;
-
-			/* Walk the parameter list of obtain the parameter functions */
-			qt->param_fcns = compile_params (qt->param_list, q->search_for,
-				&resObj);
-
-			/* If we have valid parameters, grab the predicate function,
-			 * If not, see if this is the default sort.
-			 */
-
-			if (qt->param_fcns)
-				qt->pred_fcn =
-					qof_query_core_get_predicate (resObj->param_type);
-			else
-				qt->pred_fcn = NULL;
-		}
+		query_cache = g_hash_table_new_full (query_cache_hash,
+			query_cache_equal, NULL, query_cache_entry_free);
+		query_cache_lru = g_queue_new ();
 	}
+	for (node = q->books; node; node = node->next)
+		query_cache_watch_book (node->data);
+	g_queue_push_head (query_cache_lru, entry);
+	entry->link = query_cache_lru->head;
+	g_hash_table_replace (query_cache, entry->query, entry);
+	while (query_cache_lru->length > query_cache_size)
+	{
+		QofQueryCacheEntry *last = query_cache_lru->tail->data;
 
-	/* Update the sort functions */
-	compile_sort (&(q->primary_sort), q->search_for);
-	compile_sort (&(q->secondary_sort), q->search_for);
-	compile_sort (&(q->tertiary_sort), q->search_for);
-
-	q->defaultSort = qof_class_get_default_sort (q->search_for);
+		g_hash_table_remove (query_cache, last->query);
+	}
+	G_UNLOCK (query_cache);
+}
 
-	/* Now compile the backend instances */
-	for (node = q->books; node; node = node->next)
+void
+qof_query_set_cache_size (guint n)
+{
+	G_LOCK (query_cache);
+	query_cache_size = n;
+	if (query_cache && n == 0)
 	{
-		QofBook *book = node->data;
-		QofBackend *be = book->backend;
+		g_hash_table_destroy (query_cache);
+		g_queue_free (query_cache_lru);
+		query_cache = NULL;
+		query_cache_lru = NULL;
+	}
+	while (query_cache && query_cache_lru->length > query_cache_size)
+	{
+		QofQueryCacheEntry *last = query_cache_lru->tail->data;
 
-		if (be && be->compile_query)
-		{
-			gpointer result = (be->compile_query) (be, q);
-			if (result)
-				g_hash_table_insert (q->be_compiled, book, result);
-		}
+		g_hash_table_remove (query_cache, last->query);
 	}
-	LEAVE (" query=%p", q);
+	G_UNLOCK (query_cache);
+}
+
+guint
+qof_query_get_cache_size (void)
+{
+	return query_cache_size;
 }
 
+/* Start keeping track of changes from the results of a full run. */
 static void
-check_item_cb (gpointer object, gpointer user_data)
+query_delta_reset (QofQuery * q)
 {
-	QofQueryCB *ql = user_data;
+	GList *node;
 
-	if (!object || !ql)
+	if (!q->handler_id)
+		return;
+	g_hash_table_remove_all (q->matched);
+	g_hash_table_remove_all (q->dirty);
+	g_hash_table_remove_all (q->gone);
+	q->missed = qof_event_get_missed ();
+
+	/* A cropped list can not be patched: the objects that would
+	 * move up into it are not known.  Nor can the results of terms
+	 * or sorts that follow a parameter into another object, as only
+	 * the events of the objects searched for are followed. */
+	q->delta_ok = (q->max_results < 0 && !q->chained);
+	if (!q->delta_ok)
 		return;
+	for (node = q->results; node; node = node->next)
+		g_hash_table_insert (q->matched, node->data, node);
+}
 
-	if (check_object (ql->query, object))
+void
+qof_query_set_incremental (QofQuery * q, gboolean incremental)
+{
+	if (!q)
+		return;
+	if (incremental && !q->handler_id)
 	{
-		ql->list = g_list_prepend (ql->list, object);
-		ql->count++;
+		q->matched = g_hash_table_new (g_direct_hash, g_direct_equal);
+		q->dirty = g_hash_table_new (g_direct_hash, g_direct_equal);
+		q->gone = g_hash_table_new (g_direct_hash, g_direct_equal);
+		q->delta_ok = FALSE;
+		q->handler_id = qof_event_register_handler (query_event_cb, q);
 	}
-	return;
+	else if (!incremental && q->handler_id)
+	{
+		qof_event_unregister_handler (q->handler_id);
+		g_hash_table_destroy (q->matched);
+		g_hash_table_destroy (q->dirty);
+		g_hash_table_destroy (q->gone);
+		q->matched = q->dirty = q->gone = NULL;
+		q->delta_ok = FALSE;
+		q->handler_id = 0;
+	}
+}
+
+gboolean
+qof_query_get_incremental (QofQuery * q)
+{
+	if (!q)
+		return FALSE;
+	return (q->handler_id != 0);
 }
 
 static int
@@ -753,12 +1950,30 @@ qof_query_purge_terms (QofQuery * q, GSList * param_list)
 	}
 }
 
+/* Let the backend bring the objects the query may find into the book */
+static void
+query_run_backend (QofQuery * q, QofBook * book)
+{
+	QofBackend *be = book->backend;
+
+	if (be)
+	{
+		gpointer compiled_query = g_hash_table_lookup (q->be_compiled, book);
+
+		if (compiled_query && be->run_query)
+		{
+			(be->run_query) (be, compiled_query);
+		}
+	}
+}
+
 GList *
 qof_query_run (QofQuery * q)
 {
 	GList *matching_objects = NULL;
 	GList *node;
 	gint object_count = 0;
+	gboolean sorted;
 
 	if (!q)
 		return NULL;
@@ -766,73 +1981,99 @@ qof_query_run (QofQuery * q)
 	g_return_val_if_fail (q->books, NULL);
 	ENTER (" q=%p", q);
 
-	/* XXX: Prioritize the query terms? */
-
 	/* prepare the Query for processing */
 	if (q->changed)
 	{
 		query_clear_compiles (q);
 		compile_terms (q);
 	}
+	order_program (q);
+
+	/* patch up the last results if only a few objects changed */
+	if (query_run_delta (q))
+	{
+		LEAVE (" q=%p delta", q);
+		return q->results;
+	}
+
+	/* or take the results of an equal query on unchanged books */
+	if (query_cache_lookup (q))
+	{
+		q->changed = 0;
+		LEAVE (" q=%p cached", q);
+		return q->results;
+	}
 
 	/* Maybe log this sucker */
 	if (qof_log_check (log_module, QOF_LOG_DETAIL))
 		qof_query_print (q);
 
+	sorted = query_sorted (q);
+
 	/* Now run the query over all the objects and save the results */
 	{
 		QofQueryCB qcb;
 
 		memset (&qcb, 0, sizeof (qcb));
 		qcb.query = q;
+		qcb.counts = g_new0 (QofQueryCount, q->n_steps);
+
+		/* If the sorted list is going to be cropped anyway, only
+		 * hold on to the objects that will survive the crop. */
+		if (sorted && q->max_results > 0)
+		{
+			qcb.heap_max = q->max_results;
+			qcb.heap_alloc = MIN (q->max_results, 64);
+			qcb.heap = g_new (QofQueryHeapItem, qcb.heap_alloc);
+		}
 
 		/* For each book */
 		for (node = q->books; node; node = node->next)
 		{
 			QofBook *book = node->data;
-			QofBackend *be = book->backend;
-
-			/* run the query in the backend */
-			if (be)
-			{
-				gpointer compiled_query =
-					g_hash_table_lookup (q->be_compiled, book);
 
-				if (compiled_query && be->run_query)
-				{
-					(be->run_query) (be, compiled_query);
-				}
-			}
+			query_run_backend (q, book);
 
-			/* And then iterate over all the objects */
-			qof_object_foreach (q->search_for, book,
-				(QofEntityForeachCB) check_item_cb, &qcb);
+			/* And then iterate over all the objects, unless an
+			 * index can narrow down the candidates */
+			if (!query_run_indexed (q, book, &qcb) &&
+				!query_run_parallel (q, book, &qcb))
+				qof_object_foreach (q->search_for, book,
+					(QofEntityForeachCB) check_item_cb, &qcb);
 		}
+		save_counts (q, qcb.counts);
+		g_free (qcb.counts);
 
-		matching_objects = qcb.list;
-		object_count = qcb.count;
+		if (qcb.heap)
+		{
+			/* already sorted and cropped */
+			matching_objects = heap_to_list (&qcb);
+			object_count = qcb.heap_len;
+			g_free (qcb.heap);
+			sorted = FALSE;
+		}
+		else
+		{
+			/* There is no absolute need to reverse this list, since
+			 * it's being sorted below. However, in the common case, we
+			 * will be searching in a confined location where the
+			 * objects are already in order, thus reversing will put us
+			 * in the correct order we want and make the sorting go
+			 * much faster.
+			 */
+			matching_objects = g_list_reverse (qcb.list);
+			object_count = qcb.count;
+		}
 	}
 	PINFO ("matching objects=%p count=%d", matching_objects, object_count);
 
-	/* There is no absolute need to reverse this list, since it's being
-	 * sorted below. However, in the common case, we will be searching
-	 * in a confined location where the objects are already in order,
-	 * thus reversing will put us in the correct order we want and make
-	 * the sorting go much faster.
-	 */
-	matching_objects = g_list_reverse (matching_objects);
-
-	/* Now sort the matching objects based on the search criteria
-	 * sortQuery is an unforgivable use of static global data...  
-	 * I just can't figure out how else to do this sanely.
+	/* Now sort the matching objects based on the search criteria.
+	 * The query travels with the sort, so queries can run in
+	 * parallel on different threads.
 	 */
-	if (q->primary_sort.comp_fcn || q->primary_sort.obj_cmp ||
-		(q->primary_sort.use_default && q->defaultSort))
-	{
-		sortQuery = q;
-		matching_objects = g_list_sort (matching_objects, sort_func);
-		sortQuery = NULL;
-	}
+	if (sorted)
+		matching_objects = g_list_sort_with_data (matching_objects,
+			sort_func, q);
 
 	/* Crop the list to limit the number of splits. */
 	if ((object_count > q->max_results) && (q->max_results > -1))
@@ -868,6 +2109,8 @@ qof_query_run (QofQuery * q)
 
 	g_list_free (q->results);
 	q->results = matching_objects;
+	query_delta_reset (q);
+	query_cache_store (q);
 
 	LEAVE (" q=%p", q);
 	return matching_objects;
@@ -879,9 +2122,178 @@ qof_query_last_run (QofQuery * query)
 	if (!query)
 		return NULL;
 
+	query_run_delta (query);
 	return query->results;
 }
 
+/* ==================================================================== */
+/* Cursors.  An unsorted query walks the collections of its books, a
+ * query sorted on one indexed parameter walks the index; either way
+ * each object is only tested when the next match is asked for.  The
+ * cursor counts as a walker of the collection or index it is on, so
+ * objects removed while it is open leave it standing where it was.
+ */
+
+struct _QofQueryCursor
+{
+	QofQuery *query;
+
+	/* walking the collections */
+	GList *book;
+	QofCollectionIter iter;
+
+	/* walking an index */
+	QofIndex *index;
+	gpointer pos;
+	gboolean increasing;
+
+	/* walking the results of a full run */
+	gboolean full_run;
+	GList *results;
+	GList *next;
+};
+
+/* The index that gives the sort order of the query, if there is one */
+static QofIndex *
+cursor_sort_index (QofQuery * q)
+{
+	QofQuerySort *sort = &q->primary_sort;
+	QofParam *param;
+	QofType type;
+
+	if (!sort->param_fcns || sort->param_fcns->next || !sort->comp_fcn ||
+		q->secondary_sort.param_list || q->tertiary_sort.param_list ||
+		!q->books || q->books->next)
+		return NULL;
+	param = sort->param_fcns->data;
+	type = param->param_type;
+	/* numeric indexes are ordered by absolute value */
+	if (safe_strcmp (type, QOF_TYPE_INT32) &&
+		safe_strcmp (type, QOF_TYPE_INT64) &&
+		safe_strcmp (type, QOF_TYPE_DOUBLE) &&
+		safe_strcmp (type, QOF_TYPE_BOOLEAN) &&
+		safe_strcmp (type, QOF_TYPE_TIME))
+		return NULL;
+	return qof_collection_get_index (query_collection (q, q->books->data),
+		param->param_name);
+}
+
+QofQueryCursor *
+qof_query_cursor_new (QofQuery * q)
+{
+	QofQueryCursor *cursor;
+	const QofObject *obj;
+	GList *node;
+
+	g_return_val_if_fail (q, NULL);
+	g_return_val_if_fail (q->search_for, NULL);
+	g_return_val_if_fail (q->books, NULL);
+	ENTER (" q=%p", q);
+
+	cursor = g_new0 (QofQueryCursor, 1);
+	cursor->query = q;
+
+	/* Objects with a foreach of their own may skip some entities.
+	 * max_results keeps the last matches, which are only known once
+	 * the whole book has been searched. */
+	obj = qof_object_lookup (q->search_for);
+	if (!obj || obj->foreach != qof_collection_foreach ||
+		q->max_results >= 0)
+	{
+		cursor->full_run = TRUE;
+		cursor->results = g_list_copy (qof_query_run (q));
+		cursor->next = cursor->results;
+		LEAVE (" full run");
+		return cursor;
+	}
+
+	/* q->changed stays set: the last results are still those of
+	 * the old terms */
+	if (q->changed)
+	{
+		query_clear_compiles (q);
+		compile_terms (q);
+	}
+	order_program (q);
+	for (node = q->books; node; node = node->next)
+		query_run_backend (q, node->data);
+
+	if (!query_sorted (q))
+	{
+		cursor->book = q->books;
+		qof_collection_iter_init (&cursor->iter,
+			query_collection (q, cursor->book->data));
+		LEAVE (" scan");
+		return cursor;
+	}
+	cursor->index = cursor_sort_index (q);
+	if (cursor->index)
+	{
+		cursor->increasing = q->primary_sort.increasing;
+		qof_index_walk_begin (cursor->index);
+		LEAVE (" index");
+		return cursor;
+	}
+	cursor->full_run = TRUE;
+	cursor->results = g_list_copy (qof_query_run (q));
+	cursor->next = cursor->results;
+	LEAVE (" full run");
+	return cursor;
+}
+
+gpointer
+qof_query_cursor_next (QofQueryCursor * cursor)
+{
+	QofQuery *q;
+	QofEntity *ent;
+
+	g_return_val_if_fail (cursor, NULL);
+	q = cursor->query;
+	if (cursor->full_run)
+	{
+		if (!cursor->next)
+			return NULL;
+		ent = cursor->next->data;
+		cursor->next = cursor->next->next;
+		return ent;
+	}
+
+	do
+	{
+		if (cursor->index)
+			ent = qof_index_step (cursor->index, &cursor->pos,
+				cursor->increasing);
+		else
+		{
+			while (cursor->book &&
+				!(ent = qof_collection_iter_next (&cursor->iter)))
+			{
+				qof_collection_iter_end (&cursor->iter);
+				cursor->book = cursor->book->next;
+				if (cursor->book)
+					qof_collection_iter_init (&cursor->iter,
+						query_collection (q, cursor->book->data));
+			}
+			if (!cursor->book)
+				ent = NULL;
+		}
+	}
+	while (ent && !check_object (q, ent, NULL));
+	return ent;
+}
+
+void
+qof_query_cursor_free (QofQueryCursor * cursor)
+{
+	if (!cursor)
+		return;
+	if (cursor->index)
+		qof_index_walk_end (cursor->index);
+	qof_collection_iter_end (&cursor->iter);
+	g_list_free (cursor->results);
+	g_free (cursor);
+}
+
 void
 qof_query_clear (QofQuery * query)
 {
@@ -1020,6 +2432,16 @@ qof_query_copy (QofQuery * q)
 	memcpy (copy, q, sizeof (QofQuery));
 
 	copy->be_compiled = ht;
+	/* the copy compiles its own terms */
+	copy->steps = NULL;
+	copy->clause_len = NULL;
+	copy->getter_pool = NULL;
+	copy->n_steps = 0;
+	copy->n_clauses = 0;
+	/* nor is it incremental */
+	copy->handler_id = 0;
+	copy->delta_ok = FALSE;
+	copy->matched = copy->dirty = copy->gone = NULL;
 	copy->terms = copy_or_terms (q->terms);
 	copy->books = g_list_copy (q->books);
 	copy->results = g_list_copy (q->results);
@@ -1276,6 +2698,7 @@ qof_query_set_sort_options (QofQuery * q, gint prim_op, gint sec_op,
 	q->primary_sort.options = prim_op;
 	q->secondary_sort.options = sec_op;
 	q->tertiary_sort.options = tert_op;
+	q->delta_ok = FALSE;
 }
 
 void
@@ -1287,6 +2710,7 @@ qof_query_set_sort_increasing (QofQuery * q, gboolean prim_inc,
 	q->primary_sort.increasing = prim_inc;
 	q->secondary_sort.increasing = sec_inc;
 	q->tertiary_sort.increasing = tert_inc;
+	q->delta_ok = FALSE;
 }
 
 void
@@ -1295,6 +2719,7 @@ qof_query_set_max_results (QofQuery * q, gint n)
 	if (!q)
 		return;
 	q->max_results = n;
+	q->delta_ok = FALSE;
 }
 
 void
@@ -1384,10 +2809,27 @@ qof_query_init (void)
 void
 qof_query_shutdown (void)
 {
+	qof_query_set_cache_size (0);
 	qof_class_shutdown ();
 	qof_query_core_shutdown ();
 }
 
+void
+qof_query_set_max_threads (gint n)
+{
+#if !GLIB_CHECK_VERSION(2,32,0)
+	if (n > 1 && !g_thread_supported ())
+		g_thread_init (NULL);
+#endif
+	query_max_threads = MAX (n, 1);
+}
+
+gint
+qof_query_get_max_threads (void)
+{
+	return query_max_threads;
+}
+
 gint
 qof_query_get_max_results (QofQuery * q)
 {
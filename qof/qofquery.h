@@ -84,6 +84,9 @@ probably optimize.
 /** A Query */
 typedef struct _QofQuery QofQuery;
 
+/** A position in the results of a query, see qof_query_cursor_new() */
+typedef struct _QofQueryCursor QofQueryCursor;
+
 /** Query Term Operators, for combining Query Terms */
 typedef enum
 {
@@ -216,6 +219,11 @@ void qof_query_add_boolean_match (QofQuery * q,
  *
  *  Do NOT free the resulting list.  This list is managed internally
  *  by QofQuery.
+ *
+ *  Different QofQuery objects can be run at the same time from
+ *  different threads, provided no thread is changing the books
+ *  being searched.  A single QofQuery must only be run from one
+ *  thread at a time.
  */
 GList *
 qof_query_run (QofQuery * query);
@@ -223,10 +231,54 @@ qof_query_run (QofQuery * query);
 /** Return the results of the last query, without causing the query to
  *  be re-run.  Do NOT free the resulting list.  This list is managed
  *  internally by QofQuery.
+ *
+ *  The results of an incremental query are brought up to date with
+ *  the objects that changed since the last run.
  */
 GList *
 qof_query_last_run (QofQuery * query);
 
+/** Keep the results of the query up to date from the events of the
+ *  objects it searches.
+ *
+ *  After one full run, an incremental query only tests the objects
+ *  that were created, changed or destroyed since, so re-running it
+ *  costs in proportion to the changes rather than to the book.  The
+ *  query relies on the events being generated as described for
+ *  qof_event_gen(): objects changed without an event are not seen.
+ *  The query runs in full again when its terms, sort order or book
+ *  list change, when events were missed while suspended, and always
+ *  when max_results is set.
+ */
+void qof_query_set_incremental (QofQuery * q, gboolean incremental);
+
+/** Has qof_query_set_incremental() been set for this query? */
+gboolean qof_query_get_incremental (QofQuery * q);
+
+/** Start going through the results of a query one at a time.
+ *
+ *  Unsorted queries, and queries sorted on a single parameter of a
+ *  single book for which an index is declared (see qof_index_declare),
+ *  find each match only when qof_query_cursor_next() asks for it, so
+ *  no list of all the matches is built and stopping early saves the
+ *  rest of the search.  Any other query, and any query with a limit
+ *  set by qof_query_set_max_results(), is run in full by this call
+ *  and the cursor walks its results, so that it gives the same
+ *  matches as qof_query_run().
+ *
+ *  Objects may be added to and removed from the books while the
+ *  cursor is open: a removed object is not returned after it has
+ *  gone, an added one may or may not be.  The query itself, and the
+ *  indexes declared, must not change while the cursor is in use.
+ *  Free the cursor with qof_query_cursor_free().
+ */
+QofQueryCursor *qof_query_cursor_new (QofQuery * query);
+
+/** Return the next match, or NULL after the last one. */
+gpointer qof_query_cursor_next (QofQueryCursor * cursor);
+
+void qof_query_cursor_free (QofQueryCursor * cursor);
+
 /** Remove all query terms from query.  query matches nothing 
  *  after qof_query_clear().
  */
@@ -351,6 +403,39 @@ qof_query_set_sort_increasing (QofQuery * q, gboolean prim_inc,
  */
 void qof_query_set_max_results (QofQuery * q, gint n);
 
+/**
+ * Set the number of threads used to test the objects of a large
+ * collection when none of the query terms can be answered from an
+ * index.  The default, 1, tests every object in the calling thread.
+ * Results do not depend on the number of threads.
+ *
+ * Only use more than one thread if the parameter getters of the
+ * objects being searched are safe to call from several threads at
+ * once.  This setting applies to all queries, and to the set
+ * operations on large collections, such as qof_collection_union(),
+ * which only look at the GUIDs.
+ */
+void qof_query_set_max_threads (gint n);
+
+/** Return the number of threads set with qof_query_set_max_threads(). */
+gint qof_query_get_max_threads (void);
+
+/**
+ * Keep the results of up to n queries.  A query that is
+ * qof_query_equal() to one run before, for the same type and the
+ * same books, gets a copy of the earlier results for as long as
+ * qof_book_get_generation() says none of the books changed.  The
+ * default, 0, keeps no results; setting 0 empties the cache.
+ *
+ * Changes that QOF does not see (see qof_book_get_generation) are
+ * not picked up by cached results.  Incremental queries and books
+ * whose backend runs queries itself are never cached.
+ */
+void qof_query_set_cache_size (guint n);
+
+/** Return the number of queries set with qof_query_set_cache_size(). */
+guint qof_query_get_cache_size (void);
+
 /** Compare two queries for equality. 
  * Query terms are compared each to each.
  * This is a simplistic
@@ -55,6 +55,12 @@ typedef gint (*QofCompareFunc) (gpointer a, gpointer b,
 
 /* Lookup functions */
 QofQueryPredicateFunc qof_query_core_get_predicate (gchar const *type);
+
+/* A predicate for the type that only handles the comparison (and
+ * options) given in pd, or NULL if there is none.  These predicates
+ * do not check the type of pd: the caller has to be sure of it. */
+QofQueryPredicateFunc
+qof_query_core_get_specialized (gchar const *type, QofQueryPredData * pd);
 QofCompareFunc qof_query_core_get_compare (gchar const *type);
 
 /* Compare two predicates */
@@ -136,6 +142,7 @@ typedef struct
 {
 	QofQueryPredData pd;
 	GSList *path;
+	KvpPath *kpath;				/* the path, split up for matching */
 	KvpValue *value;
 } query_kvp_def, *query_kvp_t;
 
@@ -272,15 +272,30 @@ string_to_string (gpointer object, QofParam * getter)
 
 /* QOF_TYPE_TIME */
 
+/* The times belong to the object and to the predicate, which other
+ * threads may be testing at the same time, so the day starts are
+ * worked out on copies. */
 static gint
 time_compare (QofTime *ta, QofTime *tb, QofDateMatch options)
 {
-	if (options == QOF_DATE_MATCH_DAY)
+	QofTime *da, *db;
+	gint result;
+
+	if (options != QOF_DATE_MATCH_DAY || !ta || !tb)
+		return qof_time_cmp (ta, tb);
+	da = qof_time_copy (ta);
+	db = qof_time_copy (tb);
+	if (!da || !db)
+		result = qof_time_cmp (ta, tb);
+	else
 	{
-		qof_time_set_day_start (ta);
-		qof_time_set_day_start (tb);
+		qof_time_set_day_start (da);
+		qof_time_set_day_start (db);
+		result = qof_time_cmp (da, db);
 	}
-	return qof_time_cmp (ta, tb);
+	qof_time_free (da);
+	qof_time_free (db);
+	return result;
 }
 
 static int
@@ -1196,7 +1211,7 @@ kvp_match_predicate (gpointer object, QofParam * getter,
 {
 	int compare;
 	KvpFrame *kvp;
-	KvpValue *value;
+	const KvpValue *value;
 	query_kvp_t pdata = (query_kvp_t) pd;
 
 	VERIFY_PREDICATE (query_kvp_type);
@@ -1205,7 +1220,7 @@ kvp_match_predicate (gpointer object, QofParam * getter,
 	if (!kvp)
 		return 0;
 
-	value = kvp_frame_get_slot_path_gslist (kvp, pdata->path);
+	value = kvp_frame_get_value_path (kvp, pdata->kpath);
 	if (!value)
 		return 0;
 
@@ -1242,6 +1257,7 @@ kvp_free_pdata (QofQueryPredData * pd)
 
 	VERIFY_PDATA (query_kvp_type);
 	kvp_value_delete (pdata->value);
+	kvp_path_free (pdata->kpath);
 	for (node = pdata->path; node; node = node->next)
 	{
 		g_free (node->data);
@@ -1297,6 +1313,7 @@ qof_query_kvp_predicate (QofQueryCompare how,
 	pdata->path = g_slist_copy (path);
 	for (node = pdata->path; node; node = node->next)
 		node->data = g_strdup (node->data);
+	pdata->kpath = kvp_path_new_gslist (pdata->path);
 
 	return ((QofQueryPredData *) pdata);
 }
@@ -1874,6 +1891,101 @@ qof_query_core_shutdown (void)
 	g_hash_table_destroy (predEqualTable);
 }
 
+/* ================================================================ */
+/* Predicates specialized on the type and the comparison of a term.
+ * The query compiler has already checked the type of the predicate
+ * data, so these skip the checks and the switch on 'how' that the
+ * general predicates make for every object.
+ */
+
+#define SPECIAL_PREDICATE(name, getter_t, pdata_t, OP) \
+static gint \
+name (gpointer object, QofParam * getter, QofQueryPredData * pd) \
+{ \
+	return ((getter_t) getter->param_getfcn) (object, getter) \
+		OP ((pdata_t) pd)->val; \
+}
+
+#define SPECIAL_PREDICATES(type) \
+SPECIAL_PREDICATE (type##_lt_predicate, query_##type##_getter, \
+	query_##type##_t, <) \
+SPECIAL_PREDICATE (type##_lte_predicate, query_##type##_getter, \
+	query_##type##_t, <=) \
+SPECIAL_PREDICATE (type##_eq_predicate, query_##type##_getter, \
+	query_##type##_t, ==) \
+SPECIAL_PREDICATE (type##_gt_predicate, query_##type##_getter, \
+	query_##type##_t, >) \
+SPECIAL_PREDICATE (type##_gte_predicate, query_##type##_getter, \
+	query_##type##_t, >=) \
+SPECIAL_PREDICATE (type##_neq_predicate, query_##type##_getter, \
+	query_##type##_t, !=)
+
+SPECIAL_PREDICATES (int32)
+SPECIAL_PREDICATES (int64)
+SPECIAL_PREDICATES (double)
+SPECIAL_PREDICATE (boolean_eq_predicate, query_boolean_getter,
+	query_boolean_t, ==)
+SPECIAL_PREDICATE (boolean_neq_predicate, query_boolean_getter,
+	query_boolean_t, !=)
+
+#define SPECIAL_TIME_PREDICATE(name, OP) \
+static gint \
+name (gpointer object, QofParam * getter, QofQueryPredData * pd) \
+{ \
+	return qof_time_cmp (((query_time_getter) getter->param_getfcn) \
+		(object, getter), ((query_time_t) pd)->qt) OP 0; \
+}
+
+SPECIAL_TIME_PREDICATE (time_lt_predicate, <)
+SPECIAL_TIME_PREDICATE (time_lte_predicate, <=)
+SPECIAL_TIME_PREDICATE (time_eq_predicate, ==)
+SPECIAL_TIME_PREDICATE (time_gt_predicate, >)
+SPECIAL_TIME_PREDICATE (time_gte_predicate, >=)
+SPECIAL_TIME_PREDICATE (time_neq_predicate, !=)
+
+#define SPECIAL_CASES(type) \
+	switch (pd->how) \
+	{ \
+	case QOF_COMPARE_LT: return type##_lt_predicate; \
+	case QOF_COMPARE_LTE: return type##_lte_predicate; \
+	case QOF_COMPARE_EQUAL: return type##_eq_predicate; \
+	case QOF_COMPARE_GT: return type##_gt_predicate; \
+	case QOF_COMPARE_GTE: return type##_gte_predicate; \
+	case QOF_COMPARE_NEQ: return type##_neq_predicate; \
+	default: return NULL; \
+	}
+
+QofQueryPredicateFunc
+qof_query_core_get_specialized (QofType type, QofQueryPredData * pd)
+{
+	QofQueryPredicateFunc pred;
+
+	g_return_val_if_fail (type, NULL);
+	g_return_val_if_fail (pd, NULL);
+	if (safe_strcmp (type, pd->type_name))
+		return NULL;
+	/* a predicate registered by the application always wins */
+	pred = g_hash_table_lookup (predTable, type);
+
+	if (pred == int32_match_predicate)
+		SPECIAL_CASES (int32);
+	if (pred == int64_match_predicate)
+		SPECIAL_CASES (int64);
+	if (pred == double_match_predicate)
+		SPECIAL_CASES (double);
+	if (pred == time_match_predicate &&
+		((query_time_t) pd)->options == QOF_DATE_MATCH_NORMAL)
+		SPECIAL_CASES (time);
+	if (pred == boolean_match_predicate)
+	{
+		if (pd->how == QOF_COMPARE_EQUAL)
+			return boolean_eq_predicate;
+		if (pd->how == QOF_COMPARE_NEQ)
+			return boolean_neq_predicate;
+	}
+	return NULL;
+}
+
 QofQueryPredicateFunc
 qof_query_core_get_predicate (QofType type)
 {
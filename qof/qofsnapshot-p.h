@@ -0,0 +1,37 @@
+/********************************************************************
+ * qofsnapshot-p.h -- private interface to book snapshots           *
+ *                                                                  *
+ * This program is free software; you can redistribute it and/or    *
+ * modify it under the terms of the GNU General Public License as   *
+ * published by the Free Software Foundation; either version 2 of   *
+ * the License, or (at your option) any later version.              *
+ *                                                                  *
+ * This program is distributed in the hope that it will be useful,  *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of   *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the    *
+ * GNU General Public License for more details.                     *
+ *                                                                  *
+ * You should have received a copy of the GNU General Public License*
+ * along with this program; if not, contact:                        *
+ *                                                                  *
+ * Free Software Foundation           Voice:  +1-617-542-5942       *
+ * 51 Franklin Street, Fifth Floor    Fax:    +1-617-542-2652       *
+ * Boston, MA  02110-1301,  USA       gnu@gnu.org                   *
+ *                                                                  *
+ ********************************************************************/
+
+#ifndef QOF_SNAPSHOT_P_H
+#define QOF_SNAPSHOT_P_H
+
+#include "qofsnapshot.h"
+#include "qofinstance.h"
+
+/* Copy the values of the instance into the snapshots of its book
+ * that still read it live.  Called before the instance changes or
+ * goes away. */
+void qof_snapshot_note_change (QofInstance * inst);
+
+/* The book is going: copy everything the snapshots still read live. */
+void qof_snapshot_book_destroyed (QofBook * book);
+
+#endif
@@ -0,0 +1,673 @@
+/***************************************************************************
+ *            qofsnapshot.c
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
+ */
+
+#include "config.h"
+
+#include <glib.h>
+
+#include "qof.h"
+#include "qofbook-p.h"
+#include "qofquery-p.h"
+#include "qofquerycore-p.h"
+#include "qofsnapshot-p.h"
+
+static QofLogModule log_module = QOF_MOD_SNAPSHOT;
+
+/* GStaticMutex is deprecated from GLib 2.32, where a GMutex can be
+ * embedded and initialised in place. */
+#if GLIB_CHECK_VERSION(2,32,0)
+typedef GMutex SnapMutex;
+#define snap_mutex_init(m)		g_mutex_init (m)
+#define snap_mutex_clear(m)		g_mutex_clear (m)
+#define snap_mutex_lock(m)		g_mutex_lock (m)
+#define snap_mutex_unlock(m)	g_mutex_unlock (m)
+#else
+typedef GStaticMutex SnapMutex;
+#define snap_mutex_init(m)		g_static_mutex_init (m)
+#define snap_mutex_clear(m)		g_static_mutex_free (m)
+#define snap_mutex_lock(m)		g_static_mutex_lock (m)
+#define snap_mutex_unlock(m)	g_static_mutex_unlock (m)
+#endif
+
+/* A value copied out of an entity before it changed.  Values of the
+ * core types are kept as they are, so that the query predicates and
+ * qof_util_param_to_string can read them back through the snap_get_
+ * getters below; anything else is kept as a string. */
+typedef struct
+{
+	QofType type;
+	union
+	{
+		gchar *str;
+		QofTime *time;
+		QofNumeric numeric;
+		GUID *guid;
+		gint32 i32;
+		gint64 i64;
+		gdouble d;
+		gboolean b;
+		gchar c;
+		KvpFrame *kvp;
+	} v;
+	gchar *string;				/* other types */
+} SnapValue;
+
+typedef struct
+{
+	GUID guid;
+	QofEntity *ent;				/* NULL once the values are copied */
+	GHashTable *saved;			/* param name -> SnapValue */
+} SnapEntity;
+
+typedef struct
+{
+	QofIdType type;
+	SnapEntity *ents;
+	guint n_ents;
+	GHashTable *by_guid;		/* GUID -> SnapEntity */
+} SnapCollection;
+
+/* Readers look at live entities, and the writer copies them before
+ * changing them, under the lock of the snapshot. */
+struct _QofSnapshot
+{
+	QofBook *book;				/* NULL once the book is gone */
+	GUID book_guid;
+	SnapMutex lock;
+	GHashTable *collections;	/* type -> SnapCollection */
+};
+
+typedef const gchar *(*snap_string_getter) (gpointer, const QofParam *);
+typedef QofTime *(*snap_time_getter) (gpointer, const QofParam *);
+typedef QofNumeric (*snap_numeric_getter) (gpointer, const QofParam *);
+typedef const GUID *(*snap_guid_getter) (gpointer, const QofParam *);
+typedef gint32 (*snap_int32_getter) (gpointer, const QofParam *);
+typedef gint64 (*snap_int64_getter) (gpointer, const QofParam *);
+typedef gdouble (*snap_double_getter) (gpointer, const QofParam *);
+typedef gboolean (*snap_boolean_getter) (gpointer, const QofParam *);
+typedef gchar (*snap_char_getter) (gpointer, const QofParam *);
+typedef KvpFrame *(*snap_kvp_getter) (gpointer, const QofParam *);
+
+static void
+snap_value_free (gpointer data)
+{
+	SnapValue *sv = data;
+
+	if (!safe_strcmp (sv->type, QOF_TYPE_STRING))
+		g_free (sv->v.str);
+	else if (!safe_strcmp (sv->type, QOF_TYPE_TIME))
+		qof_time_free (sv->v.time);
+	else if (!safe_strcmp (sv->type, QOF_TYPE_GUID))
+		guid_free (sv->v.guid);
+	else if (!safe_strcmp (sv->type, QOF_TYPE_KVP))
+		kvp_frame_delete (sv->v.kvp);
+	g_free (sv->string);
+	g_slice_free (SnapValue, sv);
+}
+
+static void
+snap_collection_free (gpointer data)
+{
+	SnapCollection *sc = data;
+	guint i;
+
+	for (i = 0; i < sc->n_ents; i++)
+	{
+		if (sc->ents[i].saved)
+			g_hash_table_destroy (sc->ents[i].saved);
+	}
+	g_hash_table_destroy (sc->by_guid);
+	g_free (sc->ents);
+	qof_util_string_cache_remove (sc->type);
+	g_free (sc);
+}
+
+#define SNAP_CHUNK 64
+
+static void
+snap_collection_cb (QofCollection * col, gpointer user_data)
+{
+	QofSnapshot *snap = user_data;
+	SnapCollection *sc;
+	QofEntity *chunk[SNAP_CHUNK];
+	guint pos, n, i;
+
+	if (!qof_collection_count (col))
+		return;
+	sc = g_new0 (SnapCollection, 1);
+	sc->type = qof_util_string_cache_insert (qof_collection_get_type (col));
+	sc->ents = g_new0 (SnapEntity, qof_collection_count (col));
+	sc->by_guid = guid_hash_table_new ();
+	pos = 0;
+	while ((n = qof_collection_get_chunk (col, &pos, chunk, SNAP_CHUNK)) > 0)
+	{
+		for (i = 0; i < n; i++)
+		{
+			SnapEntity *se = &sc->ents[sc->n_ents++];
+
+			se->guid = chunk[i]->guid;
+			se->ent = chunk[i];
+			g_hash_table_insert (sc->by_guid, &se->guid, se);
+		}
+	}
+	g_hash_table_insert (snap->collections, (gpointer) sc->type, sc);
+}
+
+QofSnapshot *
+qof_book_snapshot (QofBook * book)
+{
+	QofSnapshot *snap;
+
+	g_return_val_if_fail (book, NULL);
+	ENTER ("book=%p", book);
+	snap = g_new0 (QofSnapshot, 1);
+	snap->book = book;
+	snap->book_guid = *qof_entity_get_guid (QOF_ENTITY (book));
+	snap_mutex_init (&snap->lock);
+	snap->collections = g_hash_table_new_full (g_str_hash, g_str_equal,
+		NULL, snap_collection_free);
+	qof_book_foreach_collection (book, snap_collection_cb, snap);
+	/* only the writer walks the list */
+	book->snapshots = g_list_prepend (book->snapshots, snap);
+	LEAVE ("snap=%p", snap);
+	return snap;
+}
+
+void
+qof_snapshot_free (QofSnapshot * snap)
+{
+	if (!snap)
+		return;
+	if (snap->book)
+		snap->book->snapshots = g_list_remove (snap->book->snapshots, snap);
+	g_hash_table_destroy (snap->collections);
+	snap_mutex_clear (&snap->lock);
+	g_free (snap);
+}
+
+static SnapEntity *
+snap_lookup (QofSnapshot * snap, QofIdTypeConst type, const GUID * guid)
+{
+	SnapCollection *sc;
+
+	sc = g_hash_table_lookup (snap->collections, type);
+	if (!sc)
+		return NULL;
+	return g_hash_table_lookup (sc->by_guid, guid);
+}
+
+/* ============================================================= */
+/* Getters that read the values copied into a SnapEntity, in place
+ * of the getters of the object. */
+
+static SnapValue *
+snap_value (gpointer se, const QofParam * param)
+{
+	return g_hash_table_lookup (((SnapEntity *) se)->saved,
+		param->param_name);
+}
+
+static const gchar *
+snap_get_string (gpointer se, const QofParam * param)
+{
+	SnapValue *sv = snap_value (se, param);
+	return sv ? sv->v.str : NULL;
+}
+
+static QofTime *
+snap_get_time (gpointer se, const QofParam * param)
+{
+	SnapValue *sv = snap_value (se, param);
+	return sv ? sv->v.time : NULL;
+}
+
+static QofNumeric
+snap_get_numeric (gpointer se, const QofParam * param)
+{
+	SnapValue *sv = snap_value (se, param);
+	return sv ? sv->v.numeric : qof_numeric_zero ();
+}
+
+static const GUID *
+snap_get_guid (gpointer se, const QofParam * param)
+{
+	SnapValue *sv = snap_value (se, param);
+	return sv ? sv->v.guid : NULL;
+}
+
+static gint32
+snap_get_int32 (gpointer se, const QofParam * param)
+{
+	SnapValue *sv = snap_value (se, param);
+	return sv ? sv->v.i32 : 0;
+}
+
+static gint64
+snap_get_int64 (gpointer se, const QofParam * param)
+{
+	SnapValue *sv = snap_value (se, param);
+	return sv ? sv->v.i64 : 0;
+}
+
+static gdouble
+snap_get_double (gpointer se, const QofParam * param)
+{
+	SnapValue *sv = snap_value (se, param);
+	return sv ? sv->v.d : 0.0;
+}
+
+static gboolean
+snap_get_boolean (gpointer se, const QofParam * param)
+{
+	SnapValue *sv = snap_value (se, param);
+	return sv ? sv->v.b : FALSE;
+}
+
+static gchar
+snap_get_char (gpointer se, const QofParam * param)
+{
+	SnapValue *sv = snap_value (se, param);
+	return sv ? sv->v.c : '\0';
+}
+
+static KvpFrame *
+snap_get_kvp (gpointer se, const QofParam * param)
+{
+	SnapValue *sv = snap_value (se, param);
+	return sv ? sv->v.kvp : NULL;
+}
+
+/* For the term of qof_query_set_book: the object is the snapshot. */
+static const GUID *
+snap_get_book_guid (gpointer snap,
+	const QofParam * param __attribute__ ((unused)))
+{
+	return &((QofSnapshot *) snap)->book_guid;
+}
+
+/* The getter that reads a copied value of the type, or NULL if
+ * values of the type are copied as strings. */
+static QofAccessFunc
+snap_getter (QofType type)
+{
+	if (!safe_strcmp (type, QOF_TYPE_STRING))
+		return (QofAccessFunc) snap_get_string;
+	if (!safe_strcmp (type, QOF_TYPE_TIME))
+		return (QofAccessFunc) snap_get_time;
+	if (!safe_strcmp (type, QOF_TYPE_NUMERIC) ||
+		!safe_strcmp (type, QOF_TYPE_DEBCRED))
+		return (QofAccessFunc) snap_get_numeric;
+	if (!safe_strcmp (type, QOF_TYPE_GUID))
+		return (QofAccessFunc) snap_get_guid;
+	if (!safe_strcmp (type, QOF_TYPE_INT32))
+		return (QofAccessFunc) snap_get_int32;
+	if (!safe_strcmp (type, QOF_TYPE_INT64))
+		return (QofAccessFunc) snap_get_int64;
+	if (!safe_strcmp (type, QOF_TYPE_DOUBLE))
+		return (QofAccessFunc) snap_get_double;
+	if (!safe_strcmp (type, QOF_TYPE_BOOLEAN))
+		return (QofAccessFunc) snap_get_boolean;
+	if (!safe_strcmp (type, QOF_TYPE_CHAR))
+		return (QofAccessFunc) snap_get_char;
+	if (!safe_strcmp (type, QOF_TYPE_KVP))
+		return (QofAccessFunc) snap_get_kvp;
+	return NULL;
+}
+
+/* ============================================================= */
+/* the writer side, called with the lock of the snapshot held */
+
+static void
+snap_save_param (QofParam * param, gpointer user_data)
+{
+	SnapEntity *se = user_data;
+	gpointer ent = se->ent;
+	QofType type = param->param_type;
+	SnapValue *sv;
+
+	if (!param->param_getfcn)
+		return;
+	sv = g_slice_new0 (SnapValue);
+	if (!snap_getter (type))
+	{
+		sv->string = qof_util_param_to_string (ent, param);
+	}
+	else if (!safe_strcmp (type, QOF_TYPE_STRING))
+	{
+		sv->v.str = g_strdup (((snap_string_getter) param->param_getfcn)
+			(ent, param));
+	}
+	else if (!safe_strcmp (type, QOF_TYPE_TIME))
+	{
+		QofTime *qt = ((snap_time_getter) param->param_getfcn) (ent, param);
+		sv->v.time = qt ? qof_time_copy (qt) : NULL;
+	}
+	else if (!safe_strcmp (type, QOF_TYPE_GUID))
+	{
+		const GUID *guid;
+
+		guid = ((snap_guid_getter) param->param_getfcn) (ent, param);
+		if (guid)
+		{
+			sv->v.guid = guid_malloc ();
+			*sv->v.guid = *guid;
+		}
+	}
+	else if (!safe_strcmp (type, QOF_TYPE_KVP))
+	{
+		KvpFrame *frame = ((snap_kvp_getter) param->param_getfcn)
+			(ent, param);
+		sv->v.kvp = frame ? kvp_frame_copy (frame) : NULL;
+	}
+	else if (!safe_strcmp (type, QOF_TYPE_INT32))
+		sv->v.i32 = ((snap_int32_getter) param->param_getfcn) (ent, param);
+	else if (!safe_strcmp (type, QOF_TYPE_INT64))
+		sv->v.i64 = ((snap_int64_getter) param->param_getfcn) (ent, param);
+	else if (!safe_strcmp (type, QOF_TYPE_DOUBLE))
+		sv->v.d = ((snap_double_getter) param->param_getfcn) (ent, param);
+	else if (!safe_strcmp (type, QOF_TYPE_BOOLEAN))
+		sv->v.b = ((snap_boolean_getter) param->param_getfcn) (ent, param);
+	else if (!safe_strcmp (type, QOF_TYPE_CHAR))
+		sv->v.c = ((snap_char_getter) param->param_getfcn) (ent, param);
+	else
+		sv->v.numeric = ((snap_numeric_getter) param->param_getfcn)
+			(ent, param);
+	/* the type is only set once the value is there to be freed */
+	sv->type = type;
+	g_hash_table_insert (se->saved, (gpointer) param->param_name, sv);
+}
+
+static void
+snap_save (SnapEntity * se)
+{
+	se->saved = g_hash_table_new_full (g_str_hash, g_str_equal, NULL,
+		snap_value_free);
+	qof_class_param_foreach (se->ent->e_type, snap_save_param, se);
+	se->ent = NULL;
+}
+
+static void
+snap_save_all (gpointer key __attribute__ ((unused)), gpointer value,
+	gpointer user_data __attribute__ ((unused)))
+{
+	SnapCollection *sc = value;
+	guint i;
+
+	for (i = 0; i < sc->n_ents; i++)
+	{
+		if (sc->ents[i].ent)
+			snap_save (&sc->ents[i]);
+	}
+}
+
+void
+qof_snapshot_note_change (QofInstance * inst)
+{
+	QofEntity *ent;
+	QofBook *book;
+	GList *node;
+
+	book = qof_instance_get_book (inst);
+	/* Only the writer adds snapshots, so if it sees none there are
+	 * none. */
+	if (!book || !book->snapshots)
+		return;
+	ent = &inst->entity;
+	if (!ent->e_type)
+		return;
+	for (node = book->snapshots; node; node = node->next)
+	{
+		QofSnapshot *snap = node->data;
+		SnapEntity *se;
+
+		/* the readers of other snapshots are not held up */
+		snap_mutex_lock (&snap->lock);
+		se = snap_lookup (snap, ent->e_type, &ent->guid);
+		if (se && se->ent == ent)
+			snap_save (se);
+		snap_mutex_unlock (&snap->lock);
+	}
+}
+
+void
+qof_snapshot_book_destroyed (QofBook * book)
+{
+	GList *node;
+
+	if (!book->snapshots)
+		return;
+	PINFO ("book=%p destroyed with %d snapshots", book,
+		g_list_length (book->snapshots));
+	for (node = book->snapshots; node; node = node->next)
+	{
+		QofSnapshot *snap = node->data;
+
+		snap_mutex_lock (&snap->lock);
+		g_hash_table_foreach (snap->collections, snap_save_all, NULL);
+		snap_mutex_unlock (&snap->lock);
+		snap->book = NULL;
+	}
+	g_list_free (book->snapshots);
+	book->snapshots = NULL;
+}
+
+/* ============================================================= */
+/* the reader side */
+
+guint
+qof_snapshot_count (QofSnapshot * snap, QofIdTypeConst type)
+{
+	SnapCollection *sc;
+
+	g_return_val_if_fail (snap, 0);
+	sc = g_hash_table_lookup (snap->collections, type);
+	return sc ? sc->n_ents : 0;
+}
+
+void
+qof_snapshot_foreach (QofSnapshot * snap, QofIdTypeConst type,
+	QofSnapshotForeachCB cb, gpointer user_data)
+{
+	SnapCollection *sc;
+	guint i;
+
+	g_return_if_fail (snap);
+	g_return_if_fail (cb);
+	sc = g_hash_table_lookup (snap->collections, type);
+	if (!sc)
+		return;
+	for (i = 0; i < sc->n_ents; i++)
+		cb (&sc->ents[i].guid, user_data);
+}
+
+gboolean
+qof_snapshot_contains (QofSnapshot * snap, QofIdTypeConst type,
+	const GUID * guid)
+{
+	g_return_val_if_fail (snap, FALSE);
+	if (!type || !guid)
+		return FALSE;
+	return snap_lookup (snap, type, guid) != NULL;
+}
+
+gchar *
+qof_snapshot_param_to_string (QofSnapshot * snap, QofIdTypeConst type,
+	const GUID * guid, const gchar * param_name)
+{
+	SnapEntity *se;
+	SnapValue *sv;
+	const QofParam *param;
+	QofParam saved;
+	gchar *result;
+
+	g_return_val_if_fail (snap, NULL);
+	if (!type || !guid || !param_name)
+		return NULL;
+	se = snap_lookup (snap, type, guid);
+	param = qof_class_get_parameter (type, param_name);
+	if (!se || !param || !param->param_getfcn)
+		return NULL;
+	result = NULL;
+	snap_mutex_lock (&snap->lock);
+	if (se->ent)
+	{
+		/* the writer cannot start on the entity while we read it */
+		result = qof_util_param_to_string (se->ent, param);
+	}
+	else if ((sv = g_hash_table_lookup (se->saved, param_name)))
+	{
+		if (sv->string)
+			result = g_strdup (sv->string);
+		else
+		{
+			saved = *param;
+			saved.param_getfcn = snap_getter (param->param_type);
+			result = qof_util_param_to_string ((QofEntity *) se, &saved);
+		}
+	}
+	snap_mutex_unlock (&snap->lock);
+	return result;
+}
+
+/* A query term made ready to test the entities of a snapshot. */
+typedef struct
+{
+	QofQueryPredicateFunc pred;
+	QofQueryPredData *pdata;
+	gboolean invert;
+	const QofParam *param;		/* NULL for the book term */
+	QofParam saved;				/* reads the copied value instead */
+} SnapTerm;
+
+static gboolean
+snap_term_init (SnapTerm * st, QofIdTypeConst type, QofQueryTerm * qt)
+{
+	const QofParam *param;
+	GSList *path;
+
+	path = qof_query_term_get_param_path (qt);
+	st->pdata = qof_query_term_get_pred_data (qt);
+	st->invert = qof_query_term_is_inverted (qt);
+	if (!path)
+		return FALSE;
+	if (path->next)
+	{
+		/* the one term that can look past the entity: every entity
+		 * in the snapshot is in the same book */
+		if (path->next->next || safe_strcmp (path->data, QOF_PARAM_BOOK) ||
+			safe_strcmp (path->next->data, QOF_PARAM_GUID))
+			return FALSE;
+		st->param = NULL;
+		st->saved.param_name = QOF_PARAM_GUID;
+		st->saved.param_type = QOF_TYPE_GUID;
+		st->saved.param_getfcn = (QofAccessFunc) snap_get_book_guid;
+		st->pred = qof_query_core_get_predicate (QOF_TYPE_GUID);
+		return (st->pred != NULL);
+	}
+	param = qof_class_get_parameter (type, path->data);
+	if (!param || !param->param_getfcn || !snap_getter (param->param_type))
+		return FALSE;
+	st->param = param;
+	st->saved = *param;
+	st->saved.param_getfcn = snap_getter (param->param_type);
+	st->pred = qof_query_core_get_predicate (param->param_type);
+	return (st->pred != NULL);
+}
+
+/* Called with the lock held, as the entity may still be live. */
+static gboolean
+snap_term_test (QofSnapshot * snap, SnapTerm * st, SnapEntity * se)
+{
+	gint res;
+
+	if (!st->param)
+		res = st->pred (snap, &st->saved, st->pdata);
+	else if (se->ent)
+		res = st->pred (se->ent, (QofParam *) st->param, st->pdata);
+	else
+		res = st->pred (se, &st->saved, st->pdata);
+	return st->invert ? !res : (res != 0);
+}
+
+GList *
+qof_snapshot_run_query (QofSnapshot * snap, QofQuery * q)
+{
+	SnapCollection *sc;
+	SnapTerm *terms;
+	GList *or_ptr, *and_ptr, *results;
+	gint *clause_len;
+	gint n_clauses, n_terms, t, c, i;
+	guint e;
+
+	g_return_val_if_fail (snap, NULL);
+	g_return_val_if_fail (q, NULL);
+	sc = g_hash_table_lookup (snap->collections,
+		qof_query_get_search_for (q));
+	if (!sc)
+		return NULL;
+	ENTER ("snap=%p q=%p", snap, q);
+
+	or_ptr = qof_query_get_terms (q);
+	n_clauses = g_list_length (or_ptr);
+	for (n_terms = 0; or_ptr; or_ptr = or_ptr->next)
+		n_terms += g_list_length (or_ptr->data);
+	terms = g_new0 (SnapTerm, n_terms);
+	clause_len = g_new0 (gint, n_clauses);
+	t = 0;
+	c = 0;
+	for (or_ptr = qof_query_get_terms (q); or_ptr; or_ptr = or_ptr->next)
+	{
+		for (and_ptr = or_ptr->data; and_ptr; and_ptr = and_ptr->next)
+		{
+			if (!snap_term_init (&terms[t++], sc->type, and_ptr->data))
+			{
+				PERR ("a term of the query can not be tested in a snapshot");
+				g_free (terms);
+				g_free (clause_len);
+				LEAVE (" ");
+				return NULL;
+			}
+		}
+		clause_len[c++] = g_list_length (or_ptr->data);
+	}
+
+	results = NULL;
+	for (e = 0; e < sc->n_ents; e++)
+	{
+		SnapEntity *se = &sc->ents[e];
+		gboolean match = (n_clauses == 0);
+
+		snap_mutex_lock (&snap->lock);
+		for (c = 0, t = 0; c < n_clauses && !match; t += clause_len[c++])
+		{
+			for (i = 0; i < clause_len[c]; i++)
+			{
+				if (!snap_term_test (snap, &terms[t + i], se))
+					break;
+			}
+			match = (i == clause_len[c]);
+		}
+		snap_mutex_unlock (&snap->lock);
+		if (match)
+			results = g_list_prepend (results, &se->guid);
+	}
+	g_free (terms);
+	g_free (clause_len);
+	LEAVE ("%d matches", g_list_length (results));
+	return g_list_reverse (results);
+}
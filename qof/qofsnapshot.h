@@ -0,0 +1,119 @@
+/***************************************************************************
+ *            qofsnapshot.h
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
+ */
+
+#ifndef _QOFSNAPSHOT_H
+#define _QOFSNAPSHOT_H
+
+/** @addtogroup Snapshot
+
+A snapshot is a read-only view of a book as it was when the snapshot
+was taken.  Readers on other threads can go through a snapshot while
+the thread that owns the book goes on changing it.
+
+Taking a snapshot only records which entities the book holds.  The
+values of an entity are copied into the snapshot the first time the
+entity is changed or released after the snapshot was taken.  Until
+then, readers read the live entity, taking turns with the writer.
+Each snapshot has its own lock, held for one entity at a time, so
+readers of different snapshots do not wait for each other and the
+writer only waits for a reader that is on the entity it changes.
+
+Values of the core types (strings, dates, numerics, GUIDs, numbers,
+booleans, characters and KVP frames) are copied as they are, so that
+a query can still test them.  Values of other types, such as
+references to other entities and collections, are only kept as
+strings in the format of ::qof_util_param_to_string.
+
+Only changes that go through ::qof_util_param_edit, and entities
+released with ::qof_instance_release, are seen this way: the
+parameter setters must be called between ::qof_util_param_edit and
+::qof_util_param_commit, as the undo support already requires.
+Entities added to the book after the snapshot are not part of it.
+
+Snapshots must be taken and freed by the thread that changes the
+book.  Destroying a book copies all the values into its remaining
+snapshots, which stay usable until they are freed.
+
+ @{
+*/
+
+/** @file qofsnapshot.h
+	@brief Read-only views of a book for concurrent readers.
+*/
+
+#include "qofbook.h"
+
+#define QOF_MOD_SNAPSHOT "qof-snapshot"
+
+typedef struct _QofSnapshot QofSnapshot;
+
+/** Callback for ::qof_snapshot_foreach */
+typedef void (*QofSnapshotForeachCB) (const GUID * guid, gpointer user_data);
+
+/** \brief Take a snapshot of the book.
+
+Costs a copy of the GUID of each entity, not of the entities.
+*/
+QofSnapshot *qof_book_snapshot (QofBook * book);
+
+/** \brief Release a snapshot and the values copied into it. */
+void qof_snapshot_free (QofSnapshot * snap);
+
+/** \brief The number of entities of a type in the snapshot. */
+guint qof_snapshot_count (QofSnapshot * snap, QofIdTypeConst type);
+
+/** \brief Call the callback for the GUID of each entity of a type
+in the snapshot, in the order of the collection at the time. */
+void qof_snapshot_foreach (QofSnapshot * snap, QofIdTypeConst type,
+						   QofSnapshotForeachCB cb, gpointer user_data);
+
+/** \brief Was the entity in the book when the snapshot was taken? */
+gboolean qof_snapshot_contains (QofSnapshot * snap, QofIdTypeConst type,
+								const GUID * guid);
+
+/** \brief A parameter of an entity, as it was when the snapshot was
+taken.
+
+@return The value as a newly allocated string, in the format of
+::qof_util_param_to_string, or NULL if the entity or the parameter
+are not in the snapshot.
+*/
+gchar *qof_snapshot_param_to_string (QofSnapshot * snap,
+									 QofIdTypeConst type,
+									 const GUID * guid,
+									 const gchar * param_name);
+
+/** \brief Run a query over the snapshot.
+
+The entities of the type the query searches for are tested against
+the terms of the query with the values they had when the snapshot was
+taken.  Terms must be on a single parameter of one of the core types
+listed above, except for the term added by ::qof_query_set_book,
+which matches the book of the snapshot.
+
+The sort order and the maximum number of results of the query are not
+applied: matches come in the order of ::qof_snapshot_foreach.
+
+@return A list of the GUIDs of the matching entities, or NULL if none
+match or a term can not be tested in a snapshot.  The GUIDs belong to
+the snapshot, free the list with g_list_free.
+*/
+GList *qof_snapshot_run_query (QofSnapshot * snap, QofQuery * q);
+
+/** @} */
+#endif /* _QOFSNAPSHOT_H */
@@ -43,10 +43,13 @@ typedef enum
 	UNDO_MODIFY
 } QofUndoAction;
 
+/* The records of a book are allocated from the book.  An entity
+ * record can be listed in more than one operation, so none of them
+ * owns it: they all go when the book does. */
 struct QofUndoEntity_t
 {
 	const QofParam *param;		/* static anyway so only store a pointer */
-	const GUID *guid;			/* enable re-creation of this entity */
+	QofHandle handle;			/* enable re-creation of this entity */
 	QofIdType type;				/* ditto param, static. */
 	gchar *value;				/* cached string? */
 	gchar *path;				/* for KVP */
@@ -211,8 +214,10 @@ qof_prepare_undo (QofEntity * ent, const QofParam * param)
 	KvpFrame *undo_frame;
 
 	undo_frame = NULL;
-	undo_entity = g_new0 (QofUndoEntity, 1);
-	undo_entity->guid = qof_entity_get_guid (ent);
+	undo_entity = qof_book_alloc (QOF_INSTANCE (ent)->book,
+		sizeof (QofUndoEntity));
+	undo_entity->handle = qof_book_get_handle (QOF_INSTANCE (ent)->book,
+		qof_entity_get_guid (ent));
 	undo_entity->param = param;
 	undo_entity->how = UNDO_MODIFY;
 	undo_entity->type = ent->e_type;
@@ -241,7 +246,8 @@ qof_reinstate_entity (QofUndoEntity * undo_entity, QofBook * book)
 	coll = qof_book_get_collection (book, undo_entity->type);
 	if (!coll)
 		return;
-	ent = qof_collection_lookup_entity (coll, undo_entity->guid);
+	ent = qof_collection_lookup_entity (coll,
+		qof_book_handle_to_guid (book, undo_entity->handle));
 	if (!ent)
 		return;
 	PINFO (" undoing %s %s", undo_param->param_name, undo_entity->value);
@@ -256,7 +262,7 @@ qof_recreate_entity (QofUndoEntity * undo_entity, QofBook * book)
 	QofIdType type;
 	QofInstance *inst;
 
-	guid = undo_entity->guid;
+	guid = qof_book_handle_to_guid (book, undo_entity->handle);
 	type = undo_entity->type;
 	g_return_if_fail (guid || type);
 	inst = (QofInstance *) qof_object_new_instance (type, book);
@@ -273,7 +279,7 @@ qof_dump_entity (QofUndoEntity * undo_entity, QofBook * book)
 	QofIdType type;
 
 	type = undo_entity->type;
-	guid = undo_entity->guid;
+	guid = qof_book_handle_to_guid (book, undo_entity->handle);
 	g_return_if_fail (type || book);
 	coll = qof_book_get_collection (book, type);
 	ent = qof_collection_lookup_entity (coll, guid);
@@ -388,19 +394,23 @@ qof_book_clear_undo (QofBook * book)
 {
 	QofUndoOperation *operation;
 	QofUndo *book_undo;
+	GList *node;
 
 	if (!book)
 		return;
 	book_undo = book->undo_data;
-	while (book_undo != NULL)
+	for (node = book_undo->undo_list; node; node = node->next)
 	{
-		operation = (QofUndoOperation *) book_undo->undo_list->data;
-		if(operation->entity_list)
-			g_list_free (operation->entity_list);
-		book_undo->undo_list = g_list_next (book_undo->undo_list);
+		operation = (QofUndoOperation *) node->data;
+		g_list_free (operation->entity_list);
+		qof_time_free (operation->qt);
+		qof_book_free (book, operation, sizeof (QofUndoOperation));
 	}
+	g_list_free (book_undo->undo_list);
+	book_undo->undo_list = NULL;
 	book_undo->index_position = 0;
 	g_free (book_undo->undo_label);
+	book_undo->undo_label = NULL;
 }
 
 gboolean
@@ -437,7 +447,7 @@ qof_undo_new_operation (QofBook * book, gchar * label)
 
 	undo_operation = NULL;
 	book_undo = book->undo_data;
-	undo_operation = g_new0 (QofUndoOperation, 1);
+	undo_operation = qof_book_alloc (book, sizeof (QofUndoOperation));
 	undo_operation->label = label;
 	undo_operation->qt = qof_time_get_current();
 	undo_operation->entity_list = NULL;
@@ -471,10 +481,11 @@ qof_undo_create (QofInstance * instance)
 		return;
 	book = instance->book;
 	book_undo = book->undo_data;
-	undo_entity = g_new0 (QofUndoEntity, 1);
+	undo_entity = qof_book_alloc (book, sizeof (QofUndoEntity));
 	// to undo a create, use a delete.
 	undo_entity->how = UNDO_DELETE;
-	undo_entity->guid = qof_instance_get_guid (instance);
+	undo_entity->handle = qof_book_get_handle (book,
+		qof_instance_get_guid (instance));
 	undo_entity->type = instance->entity.e_type;
 	book_undo->undo_cache =
 		g_list_prepend (book_undo->undo_cache, undo_entity);
@@ -512,10 +523,11 @@ qof_undo_delete (QofInstance * instance)
 	// now need to store each parameter in a second entity, MODIFY.
 	type = instance->entity.e_type;
 	qof_class_param_foreach (type, undo_get_entity, instance);
-	undo_entity = g_new0 (QofUndoEntity, 1);
+	undo_entity = qof_book_alloc (book, sizeof (QofUndoEntity));
 	// to undo a delete, use a create.
 	undo_entity->how = UNDO_CREATE;
-	undo_entity->guid = qof_instance_get_guid (instance);
+	undo_entity->handle = qof_book_get_handle (book,
+		qof_instance_get_guid (instance));
 	undo_entity->type = type;
 	book_undo->undo_cache =
 		g_list_prepend (book_undo->undo_cache, undo_entity);
@@ -570,6 +582,7 @@ qof_book_start_operation (QofBook * book, gchar * label)
 	if (book_undo->undo_operation_open && book_undo->undo_cache)
 	{
 		g_list_free (book_undo->undo_cache);
+		book_undo->undo_cache = NULL;
 		book_undo->undo_operation_open = FALSE;
 		if (book_undo->undo_label)
 			g_free (book_undo->undo_label);
@@ -588,6 +601,7 @@ qof_book_end_operation (QofBook * book)
 		qof_undo_new_operation (book, book_undo->undo_label));
 	book_undo->index_position++;
 	g_list_free (book_undo->undo_cache);
+	book_undo->undo_cache = NULL;
 	book_undo->undo_operation_open = FALSE;
 }
 
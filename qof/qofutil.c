@@ -36,6 +36,8 @@
 #include "qof.h"
 #include "qofundo-p.h"
 #include "qofbook-p.h"
+#include "qofindex-p.h"
+#include "qofsnapshot-p.h"
 
 static QofLogModule log_module = QOF_MOD_UTIL;
 
@@ -285,6 +287,8 @@ qof_util_param_edit (QofInstance * inst, const QofParam *param)
 
 	if (!inst)
 		return FALSE;
+	/* before anything changes */
+	qof_snapshot_note_change (inst);
 	(inst->editlevel)++;
 	if (1 < inst->editlevel)
 		return FALSE;
@@ -320,6 +324,11 @@ qof_util_param_commit (QofInstance * inst, const QofParam * param)
 	inst->param = param;
 	if (be && qof_backend_commit_exists (be))
 		qof_backend_run_commit (be, inst);
+	/* the committed value may be an indexed one */
+	qof_collection_reindex_entity (&inst->entity);
+	qof_collection_note_change (inst->entity.collection, &inst->entity.guid,
+		QOF_EVENT_MODIFY);
+	qof_book_mark_changed (inst->book);
 	if (param != NULL)
 	{
 		undo_data = inst->book->undo_data;
@@ -359,103 +368,109 @@ qof_util_make_utf8 (gchar * string)
 /* The QOF string cache - reimplements a limited GCache for strings    */
 /* =================================================================== */
 
-typedef struct {
-	GHashTable *key_table;
-	GHashTable *value_table;
-}QStrCache;
-
-static QStrCache *qof_string_cache = NULL;
+/* The strings are spread over a number of shards by hash, each with
+ * its own lock, so that threads loading different books rarely wait
+ * for each other.  The locks are only held for a table lookup, so
+ * they spin rather than sleep. */
+#define QSTR_CACHE_SHARDS 16
 
 typedef struct {
-	gpointer value;
 	gint ref_count;
+	gchar str[1];			/* the cached string, allocated to fit */
 } QStrCacheNode;
 
-static inline QStrCacheNode* g_cache_node_new (gpointer value) {
-	QStrCacheNode *node = g_slice_new (QStrCacheNode);
-	node->value = value;
-	node->ref_count = 1;
-	return node;
-}
+typedef struct {
+	volatile gint lock;
+	GHashTable *table;		/* node->str -> node */
+} QStrCacheShard;
 
-static inline void g_cache_node_destroy (QStrCacheNode *node) {
-	g_slice_free (QStrCacheNode, node);
-}
+static QStrCacheShard qof_string_cache[QSTR_CACHE_SHARDS];
 
-static QStrCache* qof_cache_new (void) {
-	QStrCache *cache;
-	cache = g_slice_new (QStrCache);
-	cache->key_table = g_hash_table_new (g_str_hash, g_str_equal);
-	cache->value_table = g_hash_table_new (g_str_hash, NULL);
-	return cache;
+static inline QStrCacheShard *
+qof_cache_shard_lock (gconstpointer str)
+{
+	QStrCacheShard *shard;
+
+	shard = &qof_string_cache[g_str_hash (str) % QSTR_CACHE_SHARDS];
+	while (!g_atomic_int_compare_and_exchange (&shard->lock, 0, 1))
+		g_thread_yield ();
+	if (!shard->table)
+		shard->table = g_hash_table_new (g_str_hash, g_str_equal);
+	return shard;
 }
 
-static void qof_cache_destroy (QStrCache *cache) {
-	g_return_if_fail (cache != NULL);
-	g_hash_table_destroy (cache->key_table);
-	g_hash_table_destroy (cache->value_table);
-	g_slice_free (QStrCache, cache);
+static inline void
+qof_cache_shard_unlock (QStrCacheShard *shard)
+{
+	g_atomic_int_set (&shard->lock, 0);
 }
 
-static gpointer qof_cache_insert (QStrCache *cache, gpointer key) {
+static gpointer qof_cache_insert (gconstpointer key) {
+	QStrCacheShard *shard;
 	QStrCacheNode *node;
-	gpointer value;
+	gsize len;
 
-	g_return_val_if_fail (cache != NULL, NULL);
-	node = g_hash_table_lookup (cache->key_table, key);
+	shard = qof_cache_shard_lock (key);
+	node = g_hash_table_lookup (shard->table, key);
 	if (node) {
 		node->ref_count += 1;
-		return node->value;
-	}
-	key = g_strdup (key);
-	value = g_strdup (key);
-	node = g_cache_node_new (value);
-	g_hash_table_insert (cache->key_table, key, node);
-	g_hash_table_insert (cache->value_table, value, key);
-	return node->value;
+	} else {
+		len = strlen (key);
+		node = g_malloc (G_STRUCT_OFFSET (QStrCacheNode, str) + len + 1);
+		node->ref_count = 1;
+		memcpy (node->str, key, len + 1);
+		g_hash_table_insert (shard->table, node->str, node);
+	}
+	qof_cache_shard_unlock (shard);
+	return node->str;
 }
 
-static void qof_cache_remove (QStrCache *cache, gconstpointer value) {
+static void qof_cache_remove (gconstpointer value) {
+	QStrCacheShard *shard;
 	QStrCacheNode *node;
-	gpointer key;
 
-	g_return_if_fail (cache != NULL);
-	key = g_hash_table_lookup (cache->value_table, value);
-	node = g_hash_table_lookup (cache->key_table, key);
-	g_return_if_fail (node != NULL);
+	shard = qof_cache_shard_lock (value);
+	node = g_hash_table_lookup (shard->table, value);
+	/* only the cached copy can be removed */
+	if (!node || node->str != value) {
+		qof_cache_shard_unlock (shard);
+		g_return_if_fail (node != NULL && node->str == value);
+		return;
+	}
 	node->ref_count -= 1;
 	if (node->ref_count == 0) {
-		g_hash_table_remove (cache->value_table, value);
-		g_hash_table_remove (cache->key_table, key);
-		g_free (key);
-		g_free (node->value);
-		g_cache_node_destroy (node);
-	}
-}
-
-static QStrCache * qof_util_get_string_cache (void) {
-	if (!qof_string_cache) {
-		qof_string_cache = qof_cache_new ();
+		g_hash_table_remove (shard->table, value);
+		g_free (node);
 	}
-	return qof_string_cache;
+	qof_cache_shard_unlock (shard);
 }
 
 void qof_util_string_cache_destroy (void) {
-	if (qof_string_cache) {
-		qof_cache_destroy (qof_string_cache);
+	QStrCacheShard *shard;
+	gint i;
+
+	/* The strings themselves are left alone, as they may still be
+	 * held after the cache is gone. */
+	for (i = 0; i < QSTR_CACHE_SHARDS; i++) {
+		shard = &qof_string_cache[i];
+		while (!g_atomic_int_compare_and_exchange (&shard->lock, 0, 1))
+			g_thread_yield ();
+		if (shard->table)
+			g_hash_table_destroy (shard->table);
+		shard->table = NULL;
+		qof_cache_shard_unlock (shard);
 	}
-	qof_string_cache = NULL;
 }
 
 void qof_util_string_cache_remove (gconstpointer key) {
 	if (key) {
-		qof_cache_remove (qof_util_get_string_cache (), key);
+		qof_cache_remove (key);
 	}
 }
 
 gpointer qof_util_string_cache_insert (gconstpointer key) {
 	if (key) {
-		return qof_cache_insert(qof_util_get_string_cache(), (gpointer)key);
+		return qof_cache_insert (key);
 	}
 	return NULL;
 }
@@ -565,9 +580,8 @@ qof_util_param_to_string (QofEntity * ent, const QofParam * param)
 		known_type = TRUE;
 		if (!kvp_frame_is_empty (frame))
 		{
-			GHashTable *hash = kvp_frame_get_hash (frame);
 			param_string = g_strdup_printf ("%s(%d)", QOF_TYPE_KVP,
-				g_hash_table_size (hash));
+				kvp_frame_get_count (frame));
 		}
 		/* ensure a newly allocated string is returned, even
 		if the frame is empty. */
@@ -828,7 +842,6 @@ qof_util_param_set_string (QofEntity * ent, const QofParam * param,
 void
 qof_init (void)
 {
-	qof_util_get_string_cache ();
 	guid_init ();
 	qof_date_init ();
 	qof_object_initialize ();
@@ -841,6 +854,7 @@ qof_close (void)
 {
 	qof_query_shutdown ();
 	qof_object_shutdown ();
+	qof_index_shutdown ();
 	guid_shutdown ();
 	qof_date_close ();
 	qof_util_string_cache_destroy ();
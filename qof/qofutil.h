@@ -296,7 +296,10 @@ qof_util_make_utf8 (gchar * string);
  * Note that all the work is done when inserting or removing.  Once
  * cached the strings are just plain C strings.
  *
- * The string cache is demand-created on first use.
+ * The string cache is demand-created on first use.  Strings can be
+ * inserted and removed from more than one thread at a time.  Two
+ * cached copies of the same string are the same pointer, so cached
+ * strings can be compared with ==.
  *
  **/
 /** Destroy the qof_util_string_cache */
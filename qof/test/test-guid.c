@@ -32,6 +32,7 @@
 #include "qofid-p.h"
 #include "qofsession.h"
 #include "guid.h"
+#include "guid-p.h"
 
 static void
 test_null_guid (void)
@@ -47,6 +48,371 @@ test_null_guid (void)
 	do_test (!guid_equal (&g, gp), "two guids equal");
 }
 
+static void
+test_random_guid (void)
+{
+	GHashTable *seen;
+	GUID *g;
+	GUID back;
+	gint i, bad = 0;
+
+	guid_init_with_source (GUID_SOURCE_RANDOM);
+	seen = g_hash_table_new_full (guid_hash_to_guint, (GEqualFunc) guid_equal,
+		(GDestroyNotify) guid_free, NULL);
+	/* more than one batch */
+	for (i = 0; i < 1000; i++)
+	{
+		g = guid_malloc ();
+		guid_new (g);
+		if ((g->data[6] & 0xF0) != 0x40 || (g->data[8] & 0xC0) != 0x80)
+			bad++;
+		do_test (!g_hash_table_lookup (seen, g), "duplicate random guid");
+		string_to_guid (guid_to_string (g), &back);
+		do_test (guid_equal (g, &back), "random guid string round trip");
+		g_hash_table_insert (seen, g, g);
+	}
+	do_test (bad == 0, "random guids are version 4");
+	g_hash_table_destroy (seen);
+	guid_init_with_source (GUID_SOURCE_MD5);
+}
+
+static void
+test_guid_strings (void)
+{
+	GUID g[4], back[4];
+	gchar buff[4 * (GUID_ENCODING_LENGTH + 1)];
+	gchar slow[GUID_ENCODING_LENGTH + 1];
+	const gchar *strs[4];
+	GUID zero;
+	gint i, j;
+
+	for (i = 0; i < 4; i++)
+		guid_new (&g[i]);
+	memset (g[3].data, 0xff, GUID_DATA_SIZE);
+	guids_to_strings (g, buff, 4);
+	for (i = 0; i < 4; i++)
+	{
+		strs[i] = buff + i * (GUID_ENCODING_LENGTH + 1);
+		for (j = 0; j < GUID_DATA_SIZE; j++)
+			sprintf (slow + 2 * j, "%02x", g[i].data[j]);
+		do_test (0 == strcmp (strs[i], slow), "batch encoding");
+		do_test (0 == strcmp (strs[i], guid_to_string (&g[i])),
+			"batch encoding same as single");
+	}
+	do_test (strings_to_guids (strs, back, 4) == 4, "batch decoding");
+	for (i = 0; i < 4; i++)
+		do_test (guid_equal (&g[i], &back[i]), "batch round trip");
+
+	memset (&zero, 0, sizeof (zero));
+	do_test (string_to_guid ("0123456789ABCDEFabcdef0123456789", &back[0]),
+		"mixed case decodes");
+	do_test (0 == strcmp (guid_to_string (&back[0]),
+			"0123456789abcdefabcdef0123456789"), "mixed case value");
+	do_test (!string_to_guid ("0123456789abcdefabcdef012345678", &back[0]),
+		"short string rejected");
+	do_test (guid_equal (&back[0], &zero), "rejected string zeroes");
+	do_test (!string_to_guid ("0123456789abcdefabcdef012345678g", &back[0]),
+		"non hex digit rejected");
+	do_test (!string_to_guid ("0123456789abcdef" "\xe1" "bcdef0123456789", &back[0]),
+		"high byte rejected");
+	do_test (!string_to_guid ("0123456789abcdef:bcdef0123456789", &back[0]),
+		"character after 9 rejected");
+	do_test (!string_to_guid ("0123456789abcdef`bcdef0123456789", &back[0]),
+		"character before a rejected");
+	strs[1] = "nonsense";
+	do_test (strings_to_guids (strs, back, 4) == 3, "batch counts bad string");
+	do_test (guid_equal (&back[1], &zero), "batch zeroes bad string");
+}
+
+/* the SSE2 encoding, where it is built, agrees with the portable one */
+static void
+test_guid_paths (void)
+{
+	GUID g, fast, slow;
+	gchar buff[GUID_ENCODING_LENGTH + 1], str[GUID_ENCODING_LENGTH + 1];
+	gboolean same, fast_ok, slow_ok;
+	gint i, pos, c;
+
+	same = TRUE;
+	for (i = 0; i < 1000; i++)
+	{
+		guid_new (&g);
+		if (i == 0)
+			memset (g.data, 0, GUID_DATA_SIZE);
+		else if (i == 1)
+			memset (g.data, 0xff, GUID_DATA_SIZE);
+		guid_to_string_buff (&g, buff);
+		memset (str, 0, sizeof (str));
+		guid_encode_scalar (g.data, str);
+		if (strcmp (buff, str))
+			same = FALSE;
+	}
+	do_test (same, "encodings agree");
+
+	/* every byte in a few places, the end of the string included */
+	same = TRUE;
+	for (pos = 0; pos < GUID_ENCODING_LENGTH; pos += 7)
+	{
+		for (c = 0; c < 256; c++)
+		{
+			memcpy (str, buff, sizeof (str));
+			str[pos] = (gchar) c;
+			fast_ok = string_to_guid (str, &fast);
+			memset (slow.data, 0, GUID_DATA_SIZE);
+			slow_ok = guid_decode_scalar ((const guchar *) str, slow.data);
+			if (fast_ok != slow_ok || (fast_ok && !guid_equal (&fast, &slow)))
+				same = FALSE;
+		}
+	}
+	do_test (same, "decodings agree");
+}
+
+#define NORDER 1000
+static QofEntity *order_seen[NORDER];
+static gint order_n = 0;
+
+static void
+order_cb (QofEntity * ent, gpointer user_data)
+{
+	if (order_n < NORDER)
+		order_seen[order_n] = ent;
+	order_n++;
+}
+
+static void
+test_collection_order (void)
+{
+	QofCollection *col;
+	QofEntity *ents, *chunk[7];
+	guint pos, n;
+	gint i, j, bad;
+
+	col = qof_collection_new ("asdf");
+	ents = g_new0 (QofEntity, NORDER);
+	for (i = 0; i < NORDER; i++)
+		qof_entity_init (&ents[i], "asdf", col);
+	/* enough holes to squeeze them out */
+	for (i = 0; i < NORDER; i++)
+	{
+		if (i % 4)
+			qof_entity_release (&ents[i]);
+	}
+	do_test (qof_collection_count (col) == NORDER / 4, "count after release");
+	order_n = 0;
+	qof_collection_foreach (col, order_cb, NULL);
+	do_test (order_n == NORDER / 4, "foreach visits all");
+	for (i = 0, bad = 0; i < NORDER / 4; i++)
+	{
+		if (order_seen[i] != &ents[i * 4])
+			bad++;
+	}
+	do_test (bad == 0, "foreach in order of insertion");
+
+	pos = 0;
+	j = 0;
+	bad = 0;
+	while ((n = qof_collection_get_chunk (col, &pos, chunk, 7)) > 0)
+	{
+		for (i = 0; i < (gint) n; i++, j++)
+		{
+			if (chunk[i] != order_seen[j])
+				bad++;
+		}
+	}
+	do_test (j == NORDER / 4 && bad == 0, "chunks in order of insertion");
+
+	for (i = 0, bad = 0; i < NORDER; i += 4)
+	{
+		if (qof_collection_lookup_entity (col, &ents[i].guid) != &ents[i])
+			bad++;
+	}
+	do_test (bad == 0, "lookup after squeezing out holes");
+
+	/* a moved entity goes to the end */
+	{
+		GUID g;
+
+		guid_new (&g);
+		qof_entity_set_guid (&ents[0], &g);
+	}
+	order_n = 0;
+	qof_collection_foreach (col, order_cb, NULL);
+	do_test (order_seen[order_n - 1] == &ents[0], "changed guid goes last");
+
+	/* a walk in chunks sees when its position has gone stale */
+	{
+		guint layout;
+
+		layout = qof_collection_get_layout (col);
+		pos = 0;
+		n = qof_collection_get_chunk (col, &pos, chunk, 7);
+		qof_entity_release (&ents[4]);
+		do_test (n == 7 && qof_collection_get_layout (col) == layout,
+			"a hole keeps the layout");
+		for (i = 8; i < NORDER; i += 4)
+			qof_entity_release (&ents[i]);
+		do_test (qof_collection_get_layout (col) != layout,
+			"squeezing out holes changes the layout");
+		pos = 0;
+		n = qof_collection_get_chunk (col, &pos, chunk, 7);
+		do_test (n == 1 && chunk[0] == &ents[0], "walk started again");
+	}
+
+	for (i = 0; i < NORDER; i += 4)
+		qof_entity_release (&ents[i]);
+	do_test (qof_collection_count (col) == 0, "collection empty");
+	qof_collection_destroy (col);
+	g_free (ents);
+}
+
+static GList *journal_seen = NULL;
+
+static void
+journal_cb (const QofCollectionChange * change, gpointer user_data)
+{
+	journal_seen = g_list_append (journal_seen, (gpointer) change);
+}
+
+static void
+test_collection_journal (void)
+{
+	QofCollection *col;
+	QofEntity ents[10];
+	const QofCollectionChange *change;
+	guint64 gen;
+	gint i;
+
+	col = qof_collection_new ("asdf");
+	qof_collection_set_journal_size (col, 8);
+	memset (ents, 0, sizeof (ents));
+	for (i = 0; i < 5; i++)
+		qof_entity_init (&ents[i], "asdf", col);
+	gen = qof_collection_get_generation (col);
+	do_test (gen == 5, "one generation for each entity added");
+	do_test (qof_collection_changes_since (col, gen, journal_cb, NULL),
+		"no changes since now");
+	do_test (journal_seen == NULL, "nothing reported");
+
+	do_test (qof_collection_changes_since (col, 2, journal_cb, NULL),
+		"changes still in the journal");
+	do_test (g_list_length (journal_seen) == 3, "three changes since 2");
+	change = journal_seen->data;
+	do_test (change->event == QOF_EVENT_ADD && change->generation == 3 &&
+		guid_equal (&change->guid, &ents[2].guid), "oldest change first");
+	g_list_free (journal_seen);
+	journal_seen = NULL;
+
+	qof_entity_release (&ents[0]);
+	do_test (qof_collection_changes_since (col, gen, journal_cb, NULL),
+		"release in the journal");
+	change = journal_seen ? journal_seen->data : NULL;
+	do_test (change && change->event == QOF_EVENT_REMOVE &&
+		guid_equal (&change->guid, &ents[0].guid), "release noted");
+	g_list_free (journal_seen);
+	journal_seen = NULL;
+
+	/* wrap the ring */
+	for (i = 5; i < 10; i++)
+		qof_entity_init (&ents[i], "asdf", col);
+	gen = qof_collection_get_generation (col);
+	do_test (gen == 11, "generation after wrapping");
+	do_test (!qof_collection_changes_since (col, 2, journal_cb, NULL),
+		"dropped changes reported");
+	do_test (journal_seen == NULL, "nothing reported when dropped");
+	do_test (qof_collection_changes_since (col, gen - 8, journal_cb, NULL),
+		"whole journal");
+	do_test (g_list_length (journal_seen) == 8, "journal is full");
+	change = g_list_last (journal_seen)->data;
+	do_test (change->generation == gen &&
+		guid_equal (&change->guid, &ents[9].guid), "newest change last");
+	g_list_free (journal_seen);
+	journal_seen = NULL;
+
+	for (i = 1; i < 10; i++)
+		qof_entity_release (&ents[i]);
+	qof_collection_destroy (col);
+}
+
+/* the entities of a set operation come in the order of a */
+static QofEntity *walk_last = NULL;
+static gboolean walk_ordered = TRUE;
+
+static void
+ascending_cb (QofEntity * ent, gpointer user_data __attribute__ ((unused)))
+{
+	if (walk_last && ent < walk_last)
+		walk_ordered = FALSE;
+	walk_last = ent;
+}
+
+static void
+test_collection_sets (gint n)
+{
+	QofCollection *a, *b, *c, *u, *x, *d;
+	QofEntity *ents;
+	gint i;
+
+	/* a holds the first two thirds, b the last two */
+	a = qof_collection_new ("asdf");
+	c = qof_collection_new ("asdf");
+	ents = g_new0 (QofEntity, n);
+	for (i = 0; i < n; i++)
+		qof_entity_init (&ents[i], "asdf", i < 2 * n / 3 ? a : c);
+	b = qof_collection_new ("asdf");
+	for (i = n / 3; i < n; i++)
+		qof_collection_add_entity (b, &ents[i]);
+
+	u = qof_collection_union (a, b);
+	x = qof_collection_intersection (a, b);
+	d = qof_collection_difference (a, b);
+	do_test (qof_collection_count (u) == (guint) n, "union count");
+	do_test (qof_collection_count (x) == (guint) n / 3, "intersection count");
+	do_test (qof_collection_count (d) == (guint) n / 3, "difference count");
+	do_test (qof_collection_lookup_entity (x, &ents[n / 2].guid) ==
+		&ents[n / 2], "intersection holds shared");
+	do_test (!qof_collection_lookup_entity (d, &ents[n / 2].guid),
+		"difference drops shared");
+	do_test (qof_collection_lookup_entity (d, &ents[10].guid) == &ents[10],
+		"difference keeps own");
+	do_test (ents[10].collection == a, "entity stays in its collection");
+	walk_last = NULL;
+	qof_collection_foreach (u, ascending_cb, NULL);
+	walk_last = NULL;
+	qof_collection_foreach (x, ascending_cb, NULL);
+	do_test (walk_ordered && walk_last == &ents[2 * n / 3 - 1],
+		"union and intersection in order");
+	do_test (!qof_collection_equal (a, b), "different sets");
+	do_test (qof_collection_compare (a, b) == 1, "compare different sets");
+	do_test (qof_collection_compare (a, a) == 0, "compare same collection");
+
+	qof_collection_merge (d, x);
+	do_test (qof_collection_equal (d, a), "difference and intersection");
+	do_test (qof_collection_compare (d, a) == 0, "compare equal sets");
+	qof_collection_merge (d, b);
+	do_test (qof_collection_equal (d, u), "merge makes the union");
+	do_test (qof_collection_count (d) == (guint) n, "merge skips duplicates");
+
+	qof_collection_destroy (u);
+	qof_collection_destroy (x);
+	qof_collection_destroy (d);
+	qof_collection_destroy (b);
+	for (i = 0; i < n; i++)
+		qof_entity_release (&ents[i]);
+	g_free (ents);
+	qof_collection_destroy (a);
+	qof_collection_destroy (c);
+}
+
+static guint visited = 0;
+
+/* move every other entity out while walking the collection */
+static void
+move_cb (QofEntity * ent, gpointer user_data)
+{
+	if (visited++ % 2)
+		qof_collection_insert_entity (user_data, ent);
+}
+
 static void
 run_test (void)
 {
@@ -75,6 +441,33 @@ run_test (void)
 		ent->e_type = type;
 		qof_collection_insert_entity (col, ent);
 	}
+	do_test (qof_collection_count (col) == NENT, "all entities counted");
+	for (i = 0; i < NENT; i++)
+	{
+		if (qof_collection_lookup_entity (col, &eblk[i].guid) != &eblk[i])
+			break;
+	}
+	do_test (i == NENT, "all entities found");
+
+	{
+		QofCollection *other;
+		gint found = 0;
+
+		other = qof_collection_new (type);
+		qof_collection_foreach (col, move_cb, other);
+		do_test (visited == NENT, "removal while walking visits all");
+		do_test (qof_collection_count (col) == NENT - NENT / 2,
+			"half the entities moved");
+		for (i = 0; i < NENT; i++)
+		{
+			if (qof_collection_lookup_entity (col, &eblk[i].guid))
+				found++;
+		}
+		do_test (found == NENT - NENT / 2, "moved entities not found");
+		do_test (qof_collection_count (other) == NENT / 2,
+			"moved entities in the other collection");
+		qof_collection_destroy (other);
+	}
 
 	/* Make valgrind happy -- destroy the session. */
 	qof_session_destroy (sess);
@@ -87,6 +480,16 @@ main (void)
 	g_log_set_always_fatal (G_LOG_LEVEL_CRITICAL | G_LOG_LEVEL_WARNING);
 
 	test_null_guid ();
+	test_random_guid ();
+	test_guid_strings ();
+	test_guid_paths ();
+	test_collection_order ();
+	test_collection_journal ();
+	test_collection_sets (150);
+	/* large enough to be shared out to threads */
+	qof_query_set_max_threads (4);
+	test_collection_sets (30000);
+	qof_query_set_max_threads (1);
 	run_test ();
 
 	print_test_results ();
@@ -23,6 +23,7 @@
 /*
  * test the QofObject infrastructure with static and dynamic objects.
  */
+#include <string.h>
 #include <glib.h>
 #include "qof.h"
 #include "test-stuff.h"
@@ -209,10 +210,31 @@ test_object (void)
 
 	/* Test the global registration and lookup functions */
 	{
+		QofCollection *col;
+		gchar *name;
+		gint id;
+
+		do_test (qof_object_get_type_id (TEST_MODULE_NAME) == -1,
+				 "no type id before registration");
+		col = qof_book_get_collection (book, TEST_MODULE_NAME);
 		do_test (!qof_object_register (NULL), "register NULL");
 		do_test (qof_object_register (&bus_obj), "register test object");
 		do_test (!qof_object_register (&bus_obj),
 				 "register test object again");
+		id = qof_object_get_type_id (TEST_MODULE_NAME);
+		do_test (id >= 0, "type id on registration");
+		do_test (!safe_strcmp (qof_object_get_type_name (id),
+				TEST_MODULE_NAME), "type name from id");
+		name = g_strdup (TEST_MODULE_NAME);
+		do_test (qof_object_get_type_id (name) == id,
+				 "type id from a copy of the name");
+		g_free (name);
+		do_test (qof_book_get_collection_by_id (book, id) == col,
+				 "collection made before registration kept");
+		do_test (qof_book_get_collection (book, TEST_MODULE_NAME) == col,
+				 "collection by name and by id");
+		do_test (qof_book_get_collection_by_id (book, id + 100) == NULL,
+				 "no collection for unknown id");
 		do_test (qof_object_lookup (TEST_MODULE_NAME) == &bus_obj,
 				 "lookup our installed object");
 		do_test (qof_object_lookup ("snm98sn snml say  dyikh9y9ha") == NULL,
@@ -297,10 +319,436 @@ test_printable (const char *name, gpointer obj)
 	do_test (res != NULL, "object: Printable: mod_name, object");
 }
 
+static void
+test_book_arena (void)
+{
+	QofBook *book;
+	gchar *small[1000], *big, *again;
+	gint i, zero = 0;
+
+	book = qof_book_new ();
+	do_test (qof_book_alloc (book, 0) == NULL, "empty allocation");
+	/* more than one chunk */
+	for (i = 0; i < 1000; i++)
+	{
+		small[i] = qof_book_alloc (book, 100);
+		if (small[i][0] == 0 && small[i][99] == 0)
+			zero++;
+		memset (small[i], 'x', 100);
+	}
+	do_test (zero == 1000, "arena memory is zeroed");
+	qof_book_free (book, small[10], 100);
+	again = qof_book_alloc (book, 97);
+	do_test (again == small[10], "freed block reused");
+	do_test (again[0] == 0 && again[99] == 0, "reused block is zeroed");
+	big = qof_book_alloc (book, 10000);
+	memset (big, 'x', 10000);
+	qof_book_free (book, big, 10000);
+	big = qof_book_alloc (book, 20000);
+	memset (big, 'x', 20000);
+	/* the rest is released with the book */
+	qof_book_destroy (book);
+}
+
+/* undo records come from the book and go with it */
+static void
+test_book_undo (void)
+{
+	QofBook *book;
+	QofInstance inst;
+	gint i;
+
+	book = qof_book_new ();
+	qof_instance_init (&inst, "test-undo", book);
+	for (i = 0; i < 3; i++)
+	{
+		qof_book_start_operation (book, "create");
+		qof_undo_create (&inst);
+		qof_book_end_operation (book);
+	}
+	do_test (qof_book_undo_count (book) == 3, "undo operations recorded");
+	do_test (qof_book_can_undo (book), "undo possible");
+	qof_book_clear_undo (book);
+	do_test (qof_book_undo_count (book) == 0, "undo list cleared");
+	do_test (!qof_book_can_undo (book), "nothing left to undo");
+	qof_book_start_operation (book, "after clearing");
+	qof_undo_create (&inst);
+	qof_book_end_operation (book);
+	do_test (qof_book_undo_count (book) == 1, "undo recorded after clearing");
+	qof_instance_release (&inst);
+	qof_book_destroy (book);
+}
+
+static void
+test_book_handles (void)
+{
+	QofBook *book;
+	GUID *guids;
+	const GUID *back;
+	QofHandle h, first;
+	gint i, bad = 0;
+
+	book = qof_book_new ();
+	guids = g_new (GUID, 3000);
+	do_test (qof_book_lookup_handle (book, &guids[0]) == QOF_HANDLE_NONE,
+		"no handles yet");
+	/* more than one block */
+	for (i = 0; i < 3000; i++)
+	{
+		guid_new (&guids[i]);
+		if (qof_book_get_handle (book, &guids[i]) != (QofHandle) i + 1)
+			bad++;
+	}
+	do_test (bad == 0, "dense handles");
+	first = qof_book_get_handle (book, &guids[0]);
+	back = qof_book_handle_to_guid (book, first);
+	for (i = 0, bad = 0; i < 3000; i++)
+	{
+		h = qof_book_lookup_handle (book, &guids[i]);
+		if (h != (QofHandle) i + 1 ||
+			!guid_equal (qof_book_handle_to_guid (book, h), &guids[i]))
+			bad++;
+	}
+	do_test (bad == 0, "handles resolve both ways");
+	do_test (back == qof_book_handle_to_guid (book, first),
+		"handle guid does not move");
+	do_test (qof_book_handle_to_guid (book, QOF_HANDLE_NONE) == NULL,
+		"no guid for no handle");
+	do_test (qof_book_handle_to_guid (book, 3001) == NULL,
+		"no guid for unknown handle");
+	g_free (guids);
+	qof_book_destroy (book);
+}
+
+static void
+count_slot (const gchar * key __attribute__ ((unused)),
+	KvpValue * value __attribute__ ((unused)), gpointer data)
+{
+	(*(gint *) data)++;
+}
+
+/* frames change how they hold their slots as they grow */
+static void
+test_kvp_frame_size (void)
+{
+	KvpFrame *frame, *copy;
+	gchar key[16];
+	gint i, bad, n;
+
+	frame = kvp_frame_new ();
+	do_test (kvp_frame_is_empty (frame), "new frame is empty");
+	do_test (kvp_frame_get_hash (frame) == NULL, "no hash for a new frame");
+	for (i = 20; i > 0; i--)
+	{
+		g_snprintf (key, sizeof (key), "key%d", i);
+		kvp_frame_set_gint64 (frame, key, i);
+		if (i == 16)
+		{
+			copy = kvp_frame_copy (frame);
+			do_test (kvp_frame_get_count (copy) == 5, "small frame copied");
+			do_test (kvp_frame_get_gint64 (copy, "key18") == 18,
+				"small copy value");
+			do_test (kvp_frame_compare (frame, copy) == 0,
+				"small copy compares equal");
+			kvp_frame_delete (copy);
+		}
+	}
+	do_test (kvp_frame_get_count (frame) == 20, "twenty slots");
+	for (i = 1, bad = 0; i <= 20; i++)
+	{
+		g_snprintf (key, sizeof (key), "key%d", i);
+		if (kvp_frame_get_gint64 (frame, key) != i)
+			bad++;
+	}
+	do_test (bad == 0, "all slots found");
+	copy = kvp_frame_copy (frame);
+	do_test (kvp_frame_compare (frame, copy) == 0, "large copy compares equal");
+	kvp_frame_set_gint64 (copy, "key7", 70);
+	do_test (kvp_frame_compare (frame, copy) != 0, "changed copy differs");
+	kvp_frame_delete (copy);
+	for (i = 1; i <= 20; i++)
+	{
+		g_snprintf (key, sizeof (key), "key%d", i);
+		kvp_frame_set_value (frame, key, NULL);
+	}
+	do_test (kvp_frame_is_empty (frame), "emptied frame");
+	kvp_frame_delete (frame);
+
+	frame = kvp_frame_new ();
+	kvp_frame_set_string (frame, "b", "two");
+	kvp_frame_set_string (frame, "a/b/c", "deep");
+	kvp_frame_set_string (frame, "c", "three");
+	kvp_frame_set_string (frame, "b", "again");
+	kvp_frame_set_value (frame, "c", NULL);
+	do_test (kvp_frame_get_count (frame) == 2, "replaced and removed");
+	do_test (safe_strcmp (kvp_frame_get_string (frame, "b"), "again") == 0,
+		"replaced value");
+	do_test (safe_strcmp (kvp_frame_get_string (frame, "a/b/c"), "deep") == 0,
+		"nested value");
+	do_test (kvp_frame_get_slot (frame, "c") == NULL, "removed value");
+	n = 0;
+	kvp_frame_for_each_slot (frame, count_slot, &n);
+	do_test (n == 2, "foreach over small frame");
+	do_test (g_hash_table_size (kvp_frame_get_hash (frame)) == 2,
+		"hash of a small frame");
+	do_test (safe_strcmp (kvp_frame_get_string (frame, "b"), "again") == 0,
+		"value kept in the hash");
+	kvp_frame_delete (frame);
+}
+
+static void
+test_kvp_path (void)
+{
+	KvpFrame *frame;
+	KvpPath *path, *flat;
+	KvpValue *value;
+	const KvpValue *found;
+	GSList *keys;
+
+	do_test (kvp_path_new ("") == NULL, "empty path");
+	do_test (kvp_path_new ("a/b/") == NULL, "trailing slash");
+	frame = kvp_frame_new ();
+	path = kvp_path_new ("/a//b/c");
+	value = kvp_value_new_gint64 (42);
+	do_test (kvp_frame_set_value_path (frame, path, value) != NULL,
+		"set by path");
+	kvp_value_delete (value);
+	do_test (kvp_frame_get_gint64 (frame, "a/b/c") == 42,
+		"path value seen by string");
+	kvp_frame_set_string (frame, "a/b/c", "string");
+	found = kvp_frame_get_value_path (frame, path);
+	do_test (found && kvp_value_get_type (found) == KVP_TYPE_STRING,
+		"string value seen by path");
+	keys = g_slist_append (NULL, "a");
+	keys = g_slist_append (keys, "b");
+	kvp_path_free (path);
+	path = kvp_path_new_gslist (keys);
+	g_slist_free (keys);
+	found = kvp_frame_get_value_path (frame, path);
+	do_test (found && kvp_value_get_type (found) == KVP_TYPE_FRAME,
+		"path from a list");
+	/* a path cannot go through a value that is not a frame */
+	flat = kvp_path_new ("a/b/c/d");
+	do_test (kvp_frame_get_value_path (frame, flat) == NULL,
+		"no value below a string");
+	value = kvp_value_new_gint64 (1);
+	do_test (kvp_frame_set_value_path_nc (frame, flat, value) == NULL,
+		"cannot set below a string");
+	kvp_value_delete (value);
+	kvp_path_free (flat);
+	flat = kvp_path_new ("x");
+	kvp_frame_set_value_path_nc (frame, flat, kvp_value_new_gint64 (7));
+	do_test (kvp_frame_get_gint64 (frame, "x") == 7, "single key path");
+	kvp_frame_set_value_path (frame, flat, NULL);
+	do_test (kvp_frame_get_slot (frame, "x") == NULL, "deleted by path");
+	kvp_path_free (flat);
+	kvp_path_free (path);
+	kvp_frame_delete (frame);
+}
+
+static void
+test_string_cache (void)
+{
+	gchar *a, *b, *c, copy[16];
+	gint i, bad;
+
+	g_snprintf (copy, sizeof (copy), "%s", "cache-test");
+	a = qof_util_string_cache_insert ("cache-test");
+	b = qof_util_string_cache_insert (copy);
+	do_test (a == b, "one copy of a cached string");
+	do_test (a != copy, "cached string is a copy");
+	qof_util_string_cache_remove (a);
+	c = qof_util_string_cache_insert ("cache-test");
+	do_test (c == b, "string kept while referenced");
+	qof_util_string_cache_remove (b);
+	qof_util_string_cache_remove (c);
+	/* many strings, over all the shards */
+	for (i = 0, bad = 0; i < 1000; i++)
+	{
+		g_snprintf (copy, sizeof (copy), "key%d", i);
+		a = qof_util_string_cache_insert (copy);
+		if (safe_strcmp (a, copy) != 0 ||
+			a != qof_util_string_cache_insert (copy))
+			bad++;
+		qof_util_string_cache_remove (a);
+		qof_util_string_cache_remove (a);
+	}
+	do_test (bad == 0, "cached strings");
+}
+
+static void
+test_kvp_binary (void)
+{
+	KvpFrame *frame, *back;
+	KvpValue *value;
+	GList *list;
+	GUID guid;
+	QofTime *qt;
+	guint8 *buf, bin[3] = { 0, 1, 2 };
+	gsize size, cut;
+	gint64 i64;
+	gint bad;
+
+	frame = kvp_frame_new ();
+	kvp_frame_set_gint64 (frame, "int", -1234567890123LL);
+	kvp_frame_set_double (frame, "a/double", 2.5);
+	kvp_frame_set_numeric (frame, "a/numeric", qof_numeric_create (-7, 100));
+	kvp_frame_set_string (frame, "a/b/string", "hello");
+	guid_new (&guid);
+	kvp_frame_set_guid (frame, "a/b/guid", &guid);
+	qt = qof_time_set (1200000000, 500);
+	kvp_frame_set_time (frame, "time", qt);
+	kvp_frame_set_boolean (frame, "a/bool", TRUE);
+	kvp_frame_set_value_nc (frame, "binary", kvp_value_new_binary (bin, 3));
+	list = g_list_append (NULL, kvp_value_new_string ("one"));
+	list = g_list_append (list, kvp_value_new_gint64 (2));
+	kvp_frame_set_value_nc (frame, "a/list", kvp_value_new_glist_nc (list));
+
+	buf = kvp_frame_to_binary (frame, &size);
+	do_test (buf != NULL && size > 0, "frame encoded");
+	back = kvp_frame_from_binary (buf, size);
+	do_test (back != NULL, "frame decoded");
+	do_test (kvp_frame_compare (frame, back) == 0, "decoded frame is equal");
+	do_test (guid_equal (kvp_frame_get_guid (back, "a/b/guid"), &guid),
+		"decoded guid");
+	do_test (qof_time_equal (kvp_frame_get_time (back, "time"), qt),
+		"decoded time");
+	qof_time_free (kvp_frame_get_time (back, "time"));
+	kvp_frame_delete (back);
+
+	/* read straight from the buffer */
+	do_test (safe_strcmp (kvp_binary_get_string (buf, size, "a/b/string"),
+			"hello") == 0, "string read in place");
+	do_test (kvp_binary_get_string (buf, size, "a/b/string") >
+		(const gchar *) buf, "string points into the buffer");
+	do_test (kvp_binary_get_gint64 (buf, size, "/int", &i64)
+		&& i64 == -1234567890123LL, "integer read in place");
+	do_test (!kvp_binary_get_gint64 (buf, size, "a/b/string", &i64),
+		"not an integer");
+	do_test (kvp_binary_get_string (buf, size, "a/b/nothing") == NULL,
+		"no such key");
+	do_test (kvp_binary_get_string (buf, size, "int/b") == NULL,
+		"no frame below an integer");
+	value = kvp_binary_get_value (buf, size, "a/b");
+	do_test (value && kvp_value_get_type (value) == KVP_TYPE_FRAME
+		&& safe_strcmp (kvp_frame_get_string (kvp_value_get_frame (value),
+				"string"), "hello") == 0, "part of the frame decoded");
+	kvp_value_delete (value);
+	value = kvp_binary_get_value (buf, size, "a/list");
+	do_test (value && kvp_value_compare (value,
+			kvp_frame_get_value (frame, "a/list")) == 0, "list decoded");
+	kvp_value_delete (value);
+
+	/* damaged buffers are refused, not followed */
+	for (cut = 0, bad = 0; cut < size; cut++)
+	{
+		back = kvp_frame_from_binary (buf, cut);
+		if (back)
+		{
+			bad++;
+			kvp_frame_delete (back);
+		}
+	}
+	do_test (bad == 0, "truncated buffers refused");
+	for (cut = 0, bad = 0; cut < size; cut++)
+	{
+		if (kvp_binary_get_gint64 (buf, cut, "a/b/string", &i64) ||
+			kvp_binary_get_string (buf, cut, "a/b/nothing"))
+			bad++;
+	}
+	do_test (bad == 0, "nothing found in truncated buffers");
+	buf[0] = 'X';
+	do_test (kvp_frame_from_binary (buf, size) == NULL, "bad magic refused");
+	g_free (buf);
+
+	back = kvp_frame_new ();
+	buf = kvp_frame_to_binary (back, &size);
+	kvp_frame_delete (back);
+	back = kvp_frame_from_binary (buf, size);
+	do_test (back && kvp_frame_is_empty (back), "empty frame");
+	kvp_frame_delete (back);
+	g_free (buf);
+	kvp_frame_delete (frame);
+	qof_time_free (qt);
+}
+
+/* copies share their slots until one of them changes */
+static void
+test_kvp_frame_share (void)
+{
+	KvpFrame *frame, *copy, *copy2, *sub;
+	KvpValue *value;
+
+	frame = kvp_frame_new ();
+	kvp_frame_set_gint64 (frame, "a/b/int", 1);
+	kvp_frame_set_string (frame, "a/string", "original");
+	kvp_frame_set_boolean (frame, "bool", TRUE);
+	copy = kvp_frame_copy (frame);
+	copy2 = kvp_frame_copy (copy);
+	do_test (kvp_frame_compare (frame, copy) == 0, "copy is equal");
+	do_test (kvp_frame_get_boolean (copy, "bool"), "boolean copied");
+
+	kvp_frame_set_gint64 (copy, "a/b/int", 2);
+	do_test (kvp_frame_get_gint64 (frame, "a/b/int") == 1,
+		"original unchanged by the copy");
+	do_test (kvp_frame_get_gint64 (copy, "a/b/int") == 2, "copy changed");
+	do_test (kvp_frame_get_gint64 (copy2, "a/b/int") == 1,
+		"second copy unchanged");
+
+	kvp_frame_set_string (frame, "a/string", "changed");
+	do_test (safe_strcmp (kvp_frame_get_string (copy, "a/string"),
+			"original") == 0, "copy unchanged by the original");
+
+	/* changes through a frame handed out stay in that copy */
+	sub = kvp_frame_get_frame (copy2, "a/b");
+	kvp_frame_set_gint64 (sub, "int", 3);
+	do_test (kvp_frame_get_gint64 (frame, "a/b/int") == 1,
+		"handed out frame is the copy's own");
+	value = kvp_frame_get_value (copy2, "a/string");
+	kvp_frame_set_string (kvp_frame_get_frame (frame, "a"), "string", "again");
+	do_test (safe_strcmp (kvp_value_get_string (value), "original") == 0,
+		"handed out value is the copy's own");
+
+	kvp_frame_delete (frame);
+	do_test (kvp_frame_get_gint64 (copy, "a/b/int") == 2,
+		"copy outlives the original");
+	do_test (kvp_frame_get_gint64 (copy2, "a/b/int") == 3,
+		"second copy outlives the original");
+	kvp_frame_delete (copy);
+	kvp_frame_delete (copy2);
+
+	/* pointers handed out before a copy stay with the original */
+	frame = kvp_frame_new ();
+	kvp_frame_set_gint64 (frame, "a/int", 1);
+	sub = kvp_frame_get_frame (frame, "a");
+	copy = kvp_frame_copy (frame);
+	kvp_frame_set_string (sub, "x", "changed");
+	do_test (kvp_frame_get_string (copy, "a/x") == NULL,
+		"copy unchanged through an earlier frame");
+	do_test (safe_strcmp (kvp_frame_get_string (frame, "a/x"),
+			"changed") == 0, "earlier frame still the original's");
+	value = kvp_frame_get_value (frame, "a/int");
+	copy2 = kvp_frame_copy (frame);
+	kvp_frame_set_gint64 (frame, "int", 2);
+	kvp_frame_delete (copy2);
+	do_test (kvp_value_get_gint64 (value) == 1,
+		"earlier value outlives the copy");
+	kvp_frame_delete (copy);
+	kvp_frame_delete (frame);
+}
+
 int
 main (void)
 {
 	qof_init ();
+	test_book_arena ();
+	test_book_undo ();
+	test_book_handles ();
+	test_kvp_frame_size ();
+	test_kvp_path ();
+	test_string_cache ();
+	test_kvp_binary ();
+	test_kvp_frame_share ();
 	test_object ();
 	test_dynamic_object ();
 	print_test_results ();
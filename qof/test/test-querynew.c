@@ -33,6 +33,11 @@
 #define TEST_CORE		"TestCoreType"
 #define TEST_PARAM		"test-param"
 #define BAD_PARAM		"bad-param"
+#define QUERY_OBJ		"TestQueryObj"
+#define QUERY_MINOR		"minor"
+#define QUERY_DATE		"date"
+#define QUERY_AMOUNT	"amount"
+#define QUERY_COUNT		200
 
 static void
 obj_foreach (QofCollection * col, 
@@ -126,9 +131,917 @@ test_query_core (void)
 
 }
 
+/* simple object for running real queries against */
+typedef struct query_obj_s
+{
+	QofInstance inst;
+	gint64 minor;
+	QofTime *date;
+	QofNumeric amount;
+} query_obj;
+
+static gpointer
+query_obj_create (QofBook * book)
+{
+	query_obj *o;
+
+	g_return_val_if_fail (book, NULL);
+	o = g_new0 (query_obj, 1);
+	qof_instance_init (&o->inst, QUERY_OBJ, book);
+	o->date = qof_time_get_current ();
+	o->amount = qof_numeric_zero ();
+	return o;
+}
+
+static gint64
+query_obj_get_minor (query_obj * o)
+{
+	g_return_val_if_fail (o, 0);
+	return o->minor;
+}
+
+static void
+query_obj_set_minor (query_obj * o, gint64 m)
+{
+	g_return_if_fail (o);
+	o->minor = m;
+}
+
+/* counts the calls, to see the order the terms are tested in */
+static guint date_reads = 0;
+
+static QofTime *
+query_obj_get_date (query_obj * o)
+{
+	g_return_val_if_fail (o, NULL);
+	date_reads++;
+	return o->date;
+}
+
+static void
+query_obj_set_date (query_obj * o, QofTime * qt)
+{
+	g_return_if_fail (o);
+	o->date = qt;
+}
+
+static QofNumeric
+query_obj_get_amount (query_obj * o)
+{
+	g_return_val_if_fail (o, qof_numeric_zero ());
+	return o->amount;
+}
+
+static void
+query_obj_set_amount (query_obj * o, QofNumeric n)
+{
+	g_return_if_fail (o);
+	o->amount = n;
+}
+
+static QofObject query_object_def = {
+  .interface_version = QOF_OBJECT_VERSION,
+  .e_type = QUERY_OBJ,
+  .type_label = "Test Query Object",
+  .create = query_obj_create,
+  .book_begin = NULL,
+  .book_end = NULL,
+  .is_dirty = NULL,
+  .mark_clean = NULL,
+  .foreach = qof_collection_foreach,
+  .printable = NULL,
+  .version_cmp = NULL,
+};
+
+static void
+query_obj_register (void)
+{
+	static QofParam params[] = {
+		{QUERY_MINOR, QOF_TYPE_INT64, (QofAccessFunc) query_obj_get_minor,
+		 (QofSetterFunc) query_obj_set_minor, NULL},
+		{QUERY_DATE, QOF_TYPE_TIME, (QofAccessFunc) query_obj_get_date,
+		 (QofSetterFunc) query_obj_set_date, NULL},
+		{QUERY_AMOUNT, QOF_TYPE_NUMERIC, (QofAccessFunc) query_obj_get_amount,
+		 (QofSetterFunc) query_obj_set_amount, NULL},
+		{QOF_PARAM_BOOK, QOF_ID_BOOK, (QofAccessFunc) qof_instance_get_book,
+		 NULL, NULL},
+		{QOF_PARAM_GUID, QOF_TYPE_GUID, (QofAccessFunc) qof_instance_get_guid,
+		 NULL, NULL},
+		{NULL, NULL, NULL, NULL, NULL},
+	};
+
+	qof_class_register (QUERY_OBJ, NULL, params);
+	do_test (qof_object_register (&query_object_def),
+		"register query object");
+}
+
+/* run a single term query and count the results */
+static guint
+query_count (QofBook * book, const gchar * param, QofQueryPredData * pd)
+{
+	QofQuery *q;
+	guint count;
+
+	q = qof_query_create_for (QUERY_OBJ);
+	qof_query_set_book (q, book);
+	qof_query_add_term (q, qof_query_build_param_list (param, NULL), pd,
+		QOF_QUERY_AND);
+	count = g_list_length (qof_query_run (q));
+	qof_query_destroy (q);
+	return count;
+}
+
+static void
+test_query_index (QofBook * book, query_obj ** objs)
+{
+	QofQuery *q;
+	QofTime *qt;
+	const QofParam *param;
+
+	do_test (qof_index_declare (QUERY_OBJ, QUERY_MINOR),
+		"declare int64 index");
+	do_test (qof_index_declare (QUERY_OBJ, QUERY_DATE),
+		"declare time index");
+	do_test (qof_index_declare (QUERY_OBJ, QUERY_AMOUNT),
+		"declare numeric index");
+	do_test (!qof_index_declare (QUERY_OBJ, BAD_PARAM),
+		"no index on an unknown parameter");
+	do_test (qof_index_exists (QUERY_OBJ, QUERY_MINOR), "index exists");
+
+	do_test (query_count (book, QUERY_MINOR,
+			qof_query_int64_predicate (QOF_COMPARE_GTE, 150)) == 50,
+		"int64 GTE range");
+	do_test (query_count (book, QUERY_MINOR,
+			qof_query_int64_predicate (QOF_COMPARE_LT, 10)) == 10,
+		"int64 LT range");
+	do_test (query_count (book, QUERY_MINOR,
+			qof_query_int64_predicate (QOF_COMPARE_EQUAL, 42)) == 1,
+		"int64 equal");
+	do_test (query_count (book, QUERY_MINOR,
+			qof_query_int64_predicate (QOF_COMPARE_NEQ, 42)) ==
+		QUERY_COUNT - 1, "int64 not equal");
+	qt = qof_time_set ((QUERY_COUNT - 5) * 86400, 0);
+	do_test (query_count (book, QUERY_DATE,
+			qof_query_time_predicate (QOF_COMPARE_GT,
+				QOF_DATE_MATCH_NORMAL, qt)) == 4, "time GT range");
+	do_test (query_count (book, QUERY_AMOUNT,
+			qof_query_numeric_predicate (QOF_COMPARE_EQUAL,
+				QOF_NUMERIC_MATCH_ANY, qof_numeric_create (42, 100))) == 1,
+		"numeric equal");
+	do_test (query_count (book, QUERY_AMOUNT,
+			qof_query_numeric_predicate (QOF_COMPARE_LT,
+				QOF_NUMERIC_MATCH_ANY, qof_numeric_create (10, 100))) == 10,
+		"numeric LT range");
+
+	/* two ranges in one AND-term */
+	q = qof_query_create_for (QUERY_OBJ);
+	qof_query_set_book (q, book);
+	qof_query_add_term (q, qof_query_build_param_list (QUERY_MINOR, NULL),
+		qof_query_int64_predicate (QOF_COMPARE_GTE, 150), QOF_QUERY_AND);
+	qof_query_add_term (q, qof_query_build_param_list (QUERY_MINOR, NULL),
+		qof_query_int64_predicate (QOF_COMPARE_LT, 160), QOF_QUERY_AND);
+	do_test (g_list_length (qof_query_run (q)) == 10, "int64 AND range");
+	qof_query_destroy (q);
+
+	/* a committed change moves the entity in the index */
+	param = qof_class_get_parameter (QUERY_OBJ, QUERY_MINOR);
+	qof_util_param_edit (&objs[10]->inst, param);
+	query_obj_set_minor (objs[10], 500);
+	qof_util_param_commit (&objs[10]->inst, param);
+	do_test (query_count (book, QUERY_MINOR,
+			qof_query_int64_predicate (QOF_COMPARE_GTE, 150)) == 51,
+		"int64 range after commit");
+	do_test (query_count (book, QUERY_MINOR,
+			qof_query_int64_predicate (QOF_COMPARE_LT, 10)) == 10,
+		"int64 range unchanged by commit");
+
+	/* so does a setter that marks the instance dirty */
+	query_obj_set_minor (objs[11], 600);
+	qof_instance_set_dirty (&objs[11]->inst);
+	do_test (query_count (book, QUERY_MINOR,
+			qof_query_int64_predicate (QOF_COMPARE_GTE, 150)) == 52,
+		"int64 range after set dirty");
+	query_obj_set_minor (objs[11], 11);
+	qof_instance_set_dirty (&objs[11]->inst);
+
+	qof_index_drop (QUERY_OBJ, QUERY_MINOR);
+	do_test (!qof_index_exists (QUERY_OBJ, QUERY_MINOR), "index dropped");
+	do_test (query_count (book, QUERY_MINOR,
+			qof_query_int64_predicate (QOF_COMPARE_GTE, 150)) == 51,
+		"int64 range by scan");
+}
+
+static void
+test_query_top (QofBook * book)
+{
+	QofQuery *q;
+	GList *all, *top, *node;
+	guint len;
+
+	/* a cropped sort keeps the tail of the full sort */
+	q = qof_query_create_for (QUERY_OBJ);
+	qof_query_set_book (q, book);
+	qof_query_set_sort_order (q,
+		qof_query_build_param_list (QUERY_MINOR, NULL), NULL, NULL);
+	all = g_list_copy (qof_query_run (q));
+	len = g_list_length (all);
+	do_test (len == QUERY_COUNT, "sorted run");
+	qof_query_set_max_results (q, 5);
+	top = qof_query_run (q);
+	do_test (g_list_length (top) == 5, "top five");
+	for (node = g_list_nth (all, len - 5); node && top;
+		node = node->next, top = top->next)
+	{
+		if (node->data != top->data)
+			break;
+	}
+	do_test (node == NULL && top == NULL, "top five match the full sort");
+	do_test (((query_obj *) g_list_last (all)->data)->minor == 500,
+		"sorted by minor");
+
+	qof_query_set_sort_increasing (q, FALSE, FALSE, FALSE);
+	top = qof_query_run (q);
+	do_test (g_list_length (top) == 5 &&
+		((query_obj *) top->data)->minor == 4, "top five decreasing");
+	qof_query_set_max_results (q, 0);
+	do_test (qof_query_run (q) == NULL, "no results wanted");
+	qof_query_set_max_results (q, QUERY_COUNT * 2);
+	do_test (g_list_length (qof_query_run (q)) == QUERY_COUNT,
+		"more results wanted than found");
+	g_list_free (all);
+	qof_query_destroy (q);
+}
+
+/* terms that turn out to reject most objects are tested first */
+static void
+test_query_order (QofBook * book)
+{
+	QofQuery *q;
+
+	q = qof_query_create_for (QUERY_OBJ);
+	qof_query_set_book (q, book);
+	qof_query_add_term (q, qof_query_build_param_list (QUERY_DATE, NULL),
+		qof_query_time_predicate (QOF_COMPARE_GTE, QOF_DATE_MATCH_NORMAL,
+			qof_time_set (0, 0)), QOF_QUERY_AND);
+	qof_query_add_term (q, qof_query_build_param_list (QUERY_MINOR, NULL),
+		qof_query_int64_predicate (QOF_COMPARE_LT, 1), QOF_QUERY_AND);
+	do_test (g_list_length (qof_query_run (q)) == 1, "first ordered run");
+	date_reads = 0;
+	do_test (g_list_length (qof_query_run (q)) == 1, "second ordered run");
+	do_test (date_reads < 10, "selective term tested first");
+	qof_query_destroy (q);
+}
+
+/* equal queries share results until the book changes */
+static void
+test_query_cache (QofBook * book)
+{
+	QofQuery *q, *q2;
+	guint len;
+
+	qof_query_set_cache_size (4);
+	do_test (qof_query_get_cache_size () == 4, "set cache size");
+	q = qof_query_create_for (QUERY_OBJ);
+	qof_query_set_book (q, book);
+	qof_query_add_term (q, qof_query_build_param_list (QUERY_DATE, NULL),
+		qof_query_time_predicate (QOF_COMPARE_LT, QOF_DATE_MATCH_NORMAL,
+			qof_time_set (50 * 86400, 0)), QOF_QUERY_AND);
+	len = g_list_length (qof_query_run (q));
+	do_test (len == 50, "cached query first run");
+
+	q2 = qof_query_copy (q);
+	date_reads = 0;
+	do_test (g_list_length (qof_query_run (q2)) == len, "cache hit");
+	do_test (date_reads == 0, "cache hit tests nothing");
+
+	qof_book_mark_changed (book);
+	do_test (g_list_length (qof_query_run (q2)) == len, "book changed");
+	do_test (date_reads > 0, "changed book runs the query");
+
+	qof_query_destroy (q2);
+	qof_query_destroy (q);
+}
+
+/* matches found one at a time */
+static void
+test_query_cursor (QofBook * book)
+{
+	QofQuery *q;
+	QofQueryCursor *cursor;
+	query_obj *o, *prev;
+	GList *results;
+	guint n;
+
+	q = qof_query_create_for (QUERY_OBJ);
+	qof_query_set_book (q, book);
+	qof_query_add_term (q, qof_query_build_param_list (QUERY_MINOR, NULL),
+		qof_query_int64_predicate (QOF_COMPARE_LT, 10), QOF_QUERY_AND);
+	qof_query_set_sort_order (q, NULL, NULL, NULL);
+	cursor = qof_query_cursor_new (q);
+	for (n = 0; (o = qof_query_cursor_next (cursor)); n++)
+	{
+		if (o->minor >= 10)
+			break;
+	}
+	do_test (o == NULL && n == 10, "unsorted cursor");
+	do_test (qof_query_cursor_next (cursor) == NULL, "cursor stays at end");
+	qof_query_cursor_free (cursor);
+
+	/* a limit keeps the last matches, as qof_query_run does */
+	qof_query_set_max_results (q, 3);
+	results = g_list_copy (qof_query_run (q));
+	cursor = qof_query_cursor_new (q);
+	for (n = 0; (o = qof_query_cursor_next (cursor)); n++)
+	{
+		if (o != g_list_nth_data (results, n))
+			break;
+	}
+	do_test (o == NULL && n == 3, "cursor with max results");
+	qof_query_cursor_free (cursor);
+	g_list_free (results);
+
+	/* the date index gives the order */
+	qof_query_destroy (q);
+	q = qof_query_create_for (QUERY_OBJ);
+	qof_query_set_book (q, book);
+	qof_query_set_sort_order (q,
+		qof_query_build_param_list (QUERY_DATE, NULL), NULL, NULL);
+	cursor = qof_query_cursor_new (q);
+	for (n = 0, prev = NULL; (o = qof_query_cursor_next (cursor));
+		n++, prev = o)
+	{
+		if (prev && qof_time_cmp (prev->date, o->date) > 0)
+			break;
+	}
+	do_test (o == NULL && n == QUERY_COUNT, "indexed cursor in order");
+	qof_query_cursor_free (cursor);
+
+	qof_query_set_sort_increasing (q, FALSE, FALSE, FALSE);
+	cursor = qof_query_cursor_new (q);
+	o = qof_query_cursor_next (cursor);
+	do_test (o && qof_time_get_secs (o->date) == (QUERY_COUNT - 1) * 86400,
+		"decreasing cursor starts at the top");
+	qof_query_cursor_free (cursor);
+
+	/* no index for this order: run in full */
+	qof_query_set_sort_order (q,
+		qof_query_build_param_list (QUERY_AMOUNT, NULL), NULL, NULL);
+	cursor = qof_query_cursor_new (q);
+	for (n = 0; qof_query_cursor_next (cursor); n++)
+		;
+	do_test (n == QUERY_COUNT, "cursor over a full run");
+	qof_query_cursor_free (cursor);
+	qof_query_destroy (q);
+}
+
+/* objects released while a cursor is open */
+static void
+test_query_cursor_release (void)
+{
+	QofBook *book;
+	QofQuery *q;
+	QofQueryCursor *cursor;
+	query_obj *objs[100], *o;
+	gboolean ok;
+	gint i, n;
+
+	book = qof_book_new ();
+	for (i = 0; i < 100; i++)
+	{
+		objs[i] = query_obj_create (book);
+		objs[i]->minor = i;
+	}
+	q = qof_query_create_for (QUERY_OBJ);
+	qof_query_set_book (q, book);
+	qof_query_set_sort_order (q, NULL, NULL, NULL);
+	cursor = qof_query_cursor_new (q);
+	for (n = 0; n < 10; n++)
+		qof_query_cursor_next (cursor);
+	/* enough holes to compact the collection if nothing walked it */
+	for (i = 0; i < 90; i++)
+	{
+		if (i < 10 || i >= 20)
+		{
+			qof_instance_release (&objs[i]->inst);
+			g_free (objs[i]);
+			objs[i] = NULL;
+		}
+	}
+	ok = TRUE;
+	for (n = 0; (o = qof_query_cursor_next (cursor)); n++)
+	{
+		if (o->minor != (n < 10 ? 10 + n : 80 + n))
+			ok = FALSE;
+	}
+	do_test (ok && n == 20, "unsorted cursor across releases");
+	qof_query_cursor_free (cursor);
+
+	/* release the object the cursor stands on, and those after it */
+	qof_index_declare (QUERY_OBJ, QUERY_MINOR);
+	qof_query_set_sort_order (q,
+		qof_query_build_param_list (QUERY_MINOR, NULL), NULL, NULL);
+	cursor = qof_query_cursor_new (q);
+	o = qof_query_cursor_next (cursor);
+	do_test (o == objs[10], "indexed cursor starts at the lowest");
+	for (i = 10; i < 15; i++)
+	{
+		qof_instance_release (&objs[i]->inst);
+		g_free (objs[i]);
+		objs[i] = NULL;
+	}
+	ok = TRUE;
+	for (n = 0; (o = qof_query_cursor_next (cursor)); n++)
+	{
+		if (o->minor != (n < 5 ? 15 + n : 85 + n))
+			ok = FALSE;
+	}
+	do_test (ok && n == 15, "indexed cursor across releases");
+	qof_query_cursor_free (cursor);
+	do_test (g_list_length (qof_query_run (q)) == 15,
+		"released objects gone from the index");
+	qof_index_drop (QUERY_OBJ, QUERY_MINOR);
+	qof_query_destroy (q);
+	qof_book_destroy (book);
+}
+
+/* an incremental query gives the same results as a full run */
+static gboolean
+query_same_as_full (QofQuery * q)
+{
+	QofQuery *full;
+	GList *a, *b;
+
+	full = qof_query_copy (q);
+	for (a = qof_query_run (q), b = qof_query_run (full); a && b;
+		a = a->next, b = b->next)
+	{
+		if (((query_obj *) a->data)->minor != ((query_obj *) b->data)->minor)
+			break;
+	}
+	qof_query_destroy (full);
+	return (a == NULL && b == NULL);
+}
+
+static void
+test_query_incremental (void)
+{
+	QofBook *book;
+	QofQuery *q;
+	query_obj *objs[10], *o;
+	KvpValue *value;
+	gint i;
+
+	book = qof_book_new ();
+	for (i = 0; i < 10; i++)
+	{
+		objs[i] = query_obj_create (book);
+		objs[i]->minor = i;
+	}
+	q = qof_query_create_for (QUERY_OBJ);
+	qof_query_set_book (q, book);
+	qof_query_add_term (q, qof_query_build_param_list (QUERY_MINOR, NULL),
+		qof_query_int64_predicate (QOF_COMPARE_GTE, 5), QOF_QUERY_AND);
+	qof_query_set_sort_order (q,
+		qof_query_build_param_list (QUERY_MINOR, NULL), NULL, NULL);
+	qof_query_set_incremental (q, TRUE);
+	do_test (qof_query_get_incremental (q), "incremental set");
+	do_test (g_list_length (qof_query_run (q)) == 5, "first full run");
+
+	o = query_obj_create (book);
+	o->minor = 7;
+	qof_event_gen (&o->inst.entity, QOF_EVENT_CREATE, NULL);
+	do_test (g_list_length (qof_query_last_run (q)) == 6,
+		"created object added");
+	do_test (query_same_as_full (q), "created object in order");
+
+	objs[0]->minor = 9;
+	qof_event_gen (&objs[0]->inst.entity, QOF_EVENT_COMMIT, NULL);
+	objs[9]->minor = 0;
+	qof_event_gen (&objs[9]->inst.entity, QOF_EVENT_MODIFY, NULL);
+	do_test (g_list_length (qof_query_run (q)) == 6, "changed objects");
+	do_test (g_list_last (qof_query_run (q))->data == objs[0],
+		"changed object moved");
+	do_test (query_same_as_full (q), "changed objects in order");
+
+	qof_event_gen (&objs[6]->inst.entity, QOF_EVENT_DESTROY, NULL);
+	do_test (g_list_find (qof_query_run (q), objs[6]) == NULL,
+		"destroyed object dropped");
+
+	/* events missed while suspended force a full run */
+	qof_event_suspend ();
+	o = query_obj_create (book);
+	o->minor = 8;
+	qof_event_gen (&o->inst.entity, QOF_EVENT_CREATE, NULL);
+	qof_event_resume ();
+	do_test (g_list_find (qof_query_run (q), o) != NULL,
+		"missed event: full run");
+
+	qof_query_set_incremental (q, FALSE);
+	do_test (!qof_query_get_incremental (q), "incremental cleared");
+	qof_query_destroy (q);
+
+	/* a term that reads the book is not patched from the events of
+	 * the objects searched for */
+	q = qof_query_create_for (QUERY_OBJ);
+	qof_query_set_book (q, book);
+	value = kvp_value_new_gint64 (1);
+	qof_query_add_term (q, qof_query_build_param_list (QOF_PARAM_BOOK,
+			QOF_PARAM_KVP, NULL),
+		qof_query_kvp_predicate_path (QOF_COMPARE_EQUAL, "flag", value),
+		QOF_QUERY_AND);
+	kvp_value_delete (value);
+	qof_query_set_incremental (q, TRUE);
+	do_test (qof_query_run (q) == NULL, "book not flagged");
+	kvp_frame_set_gint64 (qof_book_get_slots (book), "flag", 1);
+	qof_event_gen (QOF_ENTITY (book), QOF_EVENT_MODIFY, NULL);
+	do_test (qof_query_run (q) != NULL, "book change seen through a chain");
+	qof_query_destroy (q);
+	qof_book_destroy (book);
+}
+
+/* enough objects for the scan to be shared out between threads */
+static void
+test_query_parallel (void)
+{
+	QofBook *book;
+	QofQuery *q;
+	GList *single, *threaded, *a, *b;
+	gint i;
+
+	book = qof_book_new ();
+	for (i = 0; i < 5000; i++)
+	{
+		query_obj *o = query_obj_create (book);
+		o->minor = i % 100;
+	}
+	q = qof_query_create_for (QUERY_OBJ);
+	qof_query_set_book (q, book);
+	qof_query_add_term (q, qof_query_build_param_list (QUERY_MINOR, NULL),
+		qof_query_int64_predicate (QOF_COMPARE_NEQ, 7), QOF_QUERY_AND);
+	single = g_list_copy (qof_query_run (q));
+	do_test (g_list_length (single) == 4950, "single thread scan");
+
+	qof_query_set_max_threads (4);
+	do_test (qof_query_get_max_threads () == 4, "set max threads");
+	threaded = qof_query_run (q);
+	do_test (g_list_length (threaded) == 4950, "threaded scan");
+	for (a = single, b = threaded; a && b; a = a->next, b = b->next)
+	{
+		if (a->data != b->data)
+			break;
+	}
+	do_test (a == NULL && b == NULL, "threaded scan in the same order");
+	qof_query_set_max_results (q, 10);
+	do_test (g_list_length (qof_query_run (q)) == 10,
+		"threaded scan with max results");
+	qof_query_set_max_threads (1);
+
+	g_list_free (single);
+	qof_query_destroy (q);
+	qof_book_destroy (book);
+}
+
+static void
+snapshot_count_cb (const GUID * guid __attribute__ ((unused)),
+	gpointer user_data)
+{
+	(*(guint *) user_data)++;
+}
+
+static gboolean
+snapshot_minor_is (QofSnapshot * snap, query_obj * o, const gchar * expect)
+{
+	gchar *str;
+	gboolean ret;
+
+	str = qof_snapshot_param_to_string (snap, QUERY_OBJ,
+		qof_instance_get_guid (&o->inst), QUERY_MINOR);
+	ret = (str && 0 == safe_strcmp (str, expect));
+	g_free (str);
+	return ret;
+}
+
+/* readers of a snapshot keep the values it was taken with */
+static void
+test_book_snapshot (void)
+{
+	QofBook *book;
+	QofSnapshot *snap;
+	const QofParam *param;
+	query_obj *objs[10], *o;
+	guint n;
+	gint i;
+
+	book = qof_book_new ();
+	for (i = 0; i < 10; i++)
+	{
+		objs[i] = query_obj_create (book);
+		objs[i]->minor = i;
+	}
+	snap = qof_book_snapshot (book);
+	do_test (qof_snapshot_count (snap, QUERY_OBJ) == 10, "snapshot count");
+	n = 0;
+	qof_snapshot_foreach (snap, QUERY_OBJ, snapshot_count_cb, &n);
+	do_test (n == 10, "snapshot foreach");
+
+	param = qof_class_get_parameter (QUERY_OBJ, QUERY_MINOR);
+	qof_util_param_edit (&objs[3]->inst, param);
+	query_obj_set_minor (objs[3], 99);
+	qof_util_param_commit (&objs[3]->inst, param);
+	do_test (objs[3]->minor == 99, "edit applied");
+	do_test (snapshot_minor_is (snap, objs[3], "3"), "edited value kept");
+	do_test (snapshot_minor_is (snap, objs[4], "4"), "unedited value read");
+
+	o = query_obj_create (book);
+	do_test (!qof_snapshot_contains (snap, QUERY_OBJ,
+			qof_instance_get_guid (&o->inst)), "new object not in snapshot");
+	do_test (qof_snapshot_contains (snap, QUERY_OBJ,
+			qof_instance_get_guid (&objs[5]->inst)), "old object in snapshot");
+
+	qof_instance_release (&objs[5]->inst);
+	do_test (snapshot_minor_is (snap, objs[5], "5"), "released value kept");
+	qof_snapshot_free (snap);
+
+	/* a snapshot outlives its book */
+	snap = qof_book_snapshot (book);
+	qof_book_destroy (book);
+	do_test (snapshot_minor_is (snap, objs[3], "99"), "book destroyed");
+	do_test (qof_snapshot_count (snap, QUERY_OBJ) == 10,
+		"count after book destroyed");
+	qof_snapshot_free (snap);
+}
+
+/* g_thread_create is deprecated from GLib 2.32 */
+static GThread *
+test_thread_new (GThreadFunc func, gpointer data)
+{
+#if GLIB_CHECK_VERSION(2,32,0)
+	return g_thread_new (NULL, func, data);
+#else
+	return g_thread_create (func, data, TRUE, NULL);
+#endif
+}
+
+#define SNAP_OBJS	1000
+
+typedef struct
+{
+	QofSnapshot *snap;
+	QofQuery *q;
+	GUID first, last;
+	volatile gint *writing;
+	gint runs;
+	gint bad;
+} snapshot_reader;
+
+static gpointer
+snapshot_reader_thread (gpointer data)
+{
+	snapshot_reader *rd = data;
+	GList *results;
+	gchar *str;
+
+	do
+	{
+		results = qof_snapshot_run_query (rd->snap, rd->q);
+		if (g_list_length (results) != SNAP_OBJS / 2 ||
+			!guid_equal (results->data, &rd->first) ||
+			!guid_equal (g_list_last (results)->data, &rd->last))
+			rd->bad++;
+		g_list_free (results);
+		str = qof_snapshot_param_to_string (rd->snap, QUERY_OBJ,
+			&rd->last, QUERY_MINOR);
+		if (safe_strcmp (str, "499"))
+			rd->bad++;
+		g_free (str);
+		rd->runs++;
+	}
+	while (g_atomic_int_get (rd->writing) || rd->runs < 3);
+	return NULL;
+}
+
+/* queries over a snapshot, from two threads while the book changes */
+static void
+test_snapshot_query (void)
+{
+	QofBook *book;
+	QofSnapshot *snap;
+	QofQuery *q, *bad;
+	const QofParam *param;
+	query_obj *objs[SNAP_OBJS];
+	snapshot_reader rd[2];
+	GThread *thread[2];
+	GList *results;
+	KvpValue *value;
+	volatile gint writing;
+	gint i;
+
+#if !GLIB_CHECK_VERSION(2,32,0)
+	if (!g_thread_supported ())
+		g_thread_init (NULL);
+#endif
+	book = qof_book_new ();
+	for (i = 0; i < SNAP_OBJS; i++)
+	{
+		objs[i] = query_obj_create (book);
+		objs[i]->minor = i;
+	}
+	snap = qof_book_snapshot (book);
+	q = qof_query_create_for (QUERY_OBJ);
+	qof_query_set_book (q, book);
+	qof_query_add_term (q, qof_query_build_param_list (QUERY_MINOR, NULL),
+		qof_query_int64_predicate (QOF_COMPARE_LT, SNAP_OBJS / 2),
+		QOF_QUERY_AND);
+	results = qof_snapshot_run_query (snap, q);
+	do_test (g_list_length (results) == SNAP_OBJS / 2, "snapshot query");
+	g_list_free (results);
+
+	/* the value of another entity can not be copied */
+	value = kvp_value_new_gint64 (1);
+	bad = qof_query_create_for (QUERY_OBJ);
+	qof_query_add_term (bad, qof_query_build_param_list (QOF_PARAM_BOOK,
+			QOF_PARAM_KVP, NULL), qof_query_kvp_predicate_path
+		(QOF_COMPARE_EQUAL, "a", value), QOF_QUERY_AND);
+	do_test (qof_snapshot_run_query (snap, bad) == NULL,
+		"snapshot query on another entity");
+	qof_query_destroy (bad);
+	kvp_value_delete (value);
+
+	writing = 1;
+	param = qof_class_get_parameter (QUERY_OBJ, QUERY_MINOR);
+	for (i = 0; i < 2; i++)
+	{
+		rd[i].snap = snap;
+		rd[i].q = q;
+		rd[i].first = *qof_instance_get_guid (&objs[0]->inst);
+		rd[i].last = *qof_instance_get_guid (&objs[SNAP_OBJS / 2 - 1]->inst);
+		rd[i].writing = &writing;
+		rd[i].runs = 0;
+		rd[i].bad = 0;
+		thread[i] = test_thread_new (snapshot_reader_thread, &rd[i]);
+	}
+	for (i = 0; i < SNAP_OBJS; i++)
+	{
+		qof_util_param_edit (&objs[i]->inst, param);
+		query_obj_set_minor (objs[i], SNAP_OBJS + i);
+		qof_util_param_commit (&objs[i]->inst, param);
+	}
+	g_atomic_int_set (&writing, 0);
+	for (i = 0; i < 2; i++)
+	{
+		g_thread_join (thread[i]);
+		do_test (rd[i].bad == 0, "snapshot readers see the old values");
+	}
+
+	results = qof_query_run (q);
+	do_test (results == NULL, "book has the new values");
+	results = qof_snapshot_run_query (snap, q);
+	do_test (g_list_length (results) == SNAP_OBJS / 2,
+		"snapshot query after the edits");
+	g_list_free (results);
+	qof_query_destroy (q);
+	qof_snapshot_free (snap);
+	qof_book_destroy (book);
+}
+
+#define MARKS 20000
+
+static gpointer
+mark_changed_thread (gpointer data)
+{
+	gint i;
+
+	for (i = 0; i < MARKS; i++)
+		qof_book_mark_changed (data);
+	return NULL;
+}
+
+/* books changed on two threads never get the same generation */
+static void
+test_book_generation (void)
+{
+	QofBook *book[3];
+	GThread *thread[2];
+	guint64 start;
+	gint i;
+
+#if !GLIB_CHECK_VERSION(2,32,0)
+	if (!g_thread_supported ())
+		g_thread_init (NULL);
+#endif
+	for (i = 0; i < 3; i++)
+		book[i] = qof_book_new ();
+	qof_book_mark_changed (book[2]);
+	start = qof_book_get_generation (book[2]);
+	for (i = 0; i < 2; i++)
+		thread[i] = test_thread_new (mark_changed_thread, book[i]);
+	for (i = 0; i < 2; i++)
+		g_thread_join (thread[i]);
+	do_test (qof_book_get_generation (book[0]) !=
+		qof_book_get_generation (book[1]), "generations differ");
+	qof_book_mark_changed (book[2]);
+	do_test (qof_book_get_generation (book[2]) == start + 2 * MARKS + 1,
+		"no generation lost");
+	for (i = 0; i < 3; i++)
+		qof_book_destroy (book[i]);
+}
+
 static void
 test_querynew (void)
 {
+	QofBook *book;
+	QofQuery *q;
+	GList *results;
+	query_obj *objs[QUERY_COUNT];
+	gint i;
+
+	query_obj_register ();
+	book = qof_book_new ();
+	for (i = 0; i < QUERY_COUNT; i++)
+	{
+		objs[i] = query_obj_create (book);
+		objs[i]->minor = i;
+		objs[i]->date = qof_time_set (i * 86400, 0);
+		objs[i]->amount = qof_numeric_create (i, 100);
+	}
+
+	/* a guid match is answered from the collection */
+	q = qof_query_create_for (QUERY_OBJ);
+	qof_query_set_book (q, book);
+	qof_query_add_guid_match (q,
+		qof_query_build_param_list (QOF_PARAM_GUID, NULL),
+		qof_instance_get_guid (&objs[57]->inst), QOF_QUERY_AND);
+	results = qof_query_run (q);
+	do_test (g_list_length (results) == 1, "guid match: one result");
+	do_test (results && results->data == objs[57], "guid match: right object");
+
+	/* OR-ing in another guid gives both, once each */
+	{
+		QofQuery *q2, *q3;
+
+		q2 = qof_query_create_for (QUERY_OBJ);
+		qof_query_set_book (q2, book);
+		qof_query_add_guid_match (q2,
+			qof_query_build_param_list (QOF_PARAM_GUID, NULL),
+			qof_instance_get_guid (&objs[3]->inst), QOF_QUERY_AND);
+		q3 = qof_query_merge (q, q2, QOF_QUERY_OR);
+		results = qof_query_run (q3);
+		do_test (g_list_length (results) == 2, "guid OR: two results");
+
+		/* the inverse has to scan */
+		qof_query_destroy (q3);
+		q3 = qof_query_invert (q);
+		results = qof_query_run (q3);
+		do_test (g_list_length (results) == QUERY_COUNT - 1,
+			"inverted guid match");
+		qof_query_destroy (q3);
+		qof_query_destroy (q2);
+	}
+	qof_query_destroy (q);
+
+	/* matching on the day leaves the times of the objects alone */
+	{
+		QofTime *qt, *date;
+		gboolean kept;
+
+		date = objs[57]->date;
+		objs[57]->date = qof_time_set (57 * 86400 + 3600, 0);
+		qt = qof_time_set (57 * 86400 + 1800, 0);
+		q = qof_query_create_for (QUERY_OBJ);
+		qof_query_set_book (q, book);
+		qof_query_add_term (q, qof_query_build_param_list (QUERY_DATE, NULL),
+			qof_query_time_predicate (QOF_COMPARE_EQUAL, QOF_DATE_MATCH_DAY,
+				qt), QOF_QUERY_AND);
+		results = qof_query_run (q);
+		do_test (g_list_length (results) == 1 && results->data == objs[57],
+			"day match");
+		kept = (qof_time_get_secs (objs[57]->date) == 57 * 86400 + 3600);
+		for (i = 0; i < QUERY_COUNT; i++)
+		{
+			if (i != 57 && qof_time_get_secs (objs[i]->date) != i * 86400)
+				kept = FALSE;
+		}
+		do_test (kept, "day match leaves the times alone");
+		do_test (qof_time_get_secs (qt) == 57 * 86400 + 1800,
+			"day match leaves the predicate alone");
+		qof_query_destroy (q);
+		qof_time_free (qt);
+		qof_time_free (objs[57]->date);
+		objs[57]->date = date;
+	}
+	test_query_index (book, objs);
+	test_query_top (book);
+	test_query_order (book);
+	test_query_cache (book);
+	test_query_cursor (book);
+	qof_book_destroy (book);
+	test_query_cursor_release ();
+	qof_query_set_cache_size (0);
+	test_book_snapshot ();
+	test_query_parallel ();
+	test_snapshot_query ();
+	test_book_generation ();
+	test_query_incremental ();
 }
 
 int